@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "batch_io.h"
+#include "log.h"
+
+int batch_io_init(BatchIO *io, unsigned int size, unsigned int flush_timeout_us, size_t buffer_size)
+{
+    memset(io, 0, sizeof(*io));
+    if (size == 0)
+        return -1;
+
+    io->size = size;
+    io->flush_timeout_us = flush_timeout_us;
+    io->buffer_size = buffer_size;
+
+    io->rx_msgs = calloc(size, sizeof(struct mmsghdr));
+    io->rx_iov = calloc(size, sizeof(struct iovec));
+    io->rx_addr = calloc(size, sizeof(struct sockaddr_in));
+    io->rx_buf = malloc(size * buffer_size);
+    io->rx_control = malloc(size * BATCH_IO_CONTROL_SIZE);
+    io->tx_msgs = calloc(size, sizeof(struct mmsghdr));
+    io->tx_iov = calloc(size, sizeof(struct iovec));
+    io->tx_addr = calloc(size, sizeof(struct sockaddr_in));
+    io->tx_buf = malloc(size * buffer_size);
+    io->tx_control = calloc(size, BATCH_IO_CONTROL_SIZE);
+    if (!io->rx_msgs || !io->rx_iov || !io->rx_addr || !io->rx_buf || !io->rx_control ||
+        !io->tx_msgs || !io->tx_iov || !io->tx_addr || !io->tx_buf || !io->tx_control)
+    {
+        batch_io_destroy(io);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < size; i++)
+    {
+        io->rx_iov[i].iov_base = io->rx_buf + i * buffer_size;
+        io->rx_iov[i].iov_len = buffer_size;
+        io->rx_msgs[i].msg_hdr.msg_iov = &io->rx_iov[i];
+        io->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        io->rx_msgs[i].msg_hdr.msg_name = &io->rx_addr[i];
+        io->rx_msgs[i].msg_hdr.msg_control = io->rx_control + i * BATCH_IO_CONTROL_SIZE;
+
+        io->tx_msgs[i].msg_hdr.msg_iov = &io->tx_iov[i];
+        io->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+        io->tx_msgs[i].msg_hdr.msg_name = &io->tx_addr[i];
+        io->tx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    return 0;
+}
+
+void batch_io_destroy(BatchIO *io)
+{
+    free(io->rx_msgs);
+    free(io->rx_iov);
+    free(io->rx_addr);
+    free(io->rx_buf);
+    free(io->rx_control);
+    free(io->tx_msgs);
+    free(io->tx_iov);
+    free(io->tx_addr);
+    free(io->tx_buf);
+    free(io->tx_control);
+    memset(io, 0, sizeof(*io));
+}
+
+static int recv_some(BatchIO *io, int sockfd, unsigned int from, int flags)
+{
+    // The kernel overwrites msg_namelen and msg_controllen, so reset them
+    // for every slot
+    for (unsigned int i = from; i < io->size; i++)
+    {
+        io->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        io->rx_msgs[i].msg_hdr.msg_controllen = BATCH_IO_CONTROL_SIZE;
+    }
+
+    int n = recvmmsg(sockfd, &io->rx_msgs[from], io->size - from, flags, NULL);
+    if (n > 0)
+    {
+        io->stats.rx_calls++;
+        io->stats.rx_packets += n;
+    }
+    return n;
+}
+
+static long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int batch_io_recv(BatchIO *io, int sockfd)
+{
+    io->rx_count = 0;
+    int n = recv_some(io, sockfd, 0, MSG_WAITFORONE);
+    if (n <= 0)
+        return n;
+    io->rx_count = n;
+
+    if (io->flush_timeout_us == 0)
+        return n;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (io->rx_count < io->size)
+    {
+        long left = (long)io->flush_timeout_us - elapsed_us(&start);
+        if (left <= 0)
+            break;
+
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        if (poll(&pfd, 1, (int)((left + 999) / 1000)) <= 0)
+            break;
+
+        n = recv_some(io, sockfd, io->rx_count, MSG_DONTWAIT);
+        if (n <= 0)
+            break;
+        io->rx_count += n;
+    }
+    return io->rx_count;
+}
+
+int batch_io_msg_ifindex(struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+        {
+            struct in_pktinfo info;
+            memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+            return info.ipi_ifindex;
+        }
+    }
+    return 0;
+}
+
+int batch_io_rx_ifindex(BatchIO *io, unsigned int i)
+{
+    return batch_io_msg_ifindex(&io->rx_msgs[i].msg_hdr);
+}
+
+uint8_t *batch_io_tx_buffer(BatchIO *io)
+{
+    if (io->tx_count == io->size)
+        return NULL;
+    return io->tx_buf + io->tx_count * io->buffer_size;
+}
+
+int batch_io_tx_add(BatchIO *io, void *data, size_t len, const struct sockaddr_in *dest)
+{
+    if (io->tx_count == io->size)
+        return -1;
+    io->tx_iov[io->tx_count].iov_base = data;
+    io->tx_iov[io->tx_count].iov_len = len;
+    io->tx_addr[io->tx_count] = *dest;
+    io->tx_msgs[io->tx_count].msg_hdr.msg_control = NULL;
+    io->tx_msgs[io->tx_count].msg_hdr.msg_controllen = 0;
+    io->tx_count++;
+    return 0;
+}
+
+int batch_io_tx_add_via(BatchIO *io, void *data, size_t len, const struct sockaddr_in *dest, int ifindex,
+                        struct in_addr source)
+{
+    unsigned int i = io->tx_count;
+    if (batch_io_tx_add(io, data, len, dest) < 0)
+        return -1;
+
+    struct msghdr *hdr = &io->tx_msgs[i].msg_hdr;
+    hdr->msg_control = io->tx_control + i * BATCH_IO_CONTROL_SIZE;
+    hdr->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    struct in_pktinfo info;
+    memset(&info, 0, sizeof(info));
+    info.ipi_ifindex = ifindex;
+    info.ipi_spec_dst = source;
+    memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+    return 0;
+}
+
+int batch_io_flush(BatchIO *io, int sockfd)
+{
+    unsigned int sent = 0, failed = 0;
+    while (sent < io->tx_count)
+    {
+        int n = sendmmsg(sockfd, &io->tx_msgs[sent], io->tx_count - sent, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // Drop the datagram that failed and carry on with the rest
+            log_every(LOG_LEVEL_ERROR, 10, "Error sending batch: %s", strerror(errno));
+            io->stats.tx_errors++;
+            sent++;
+            failed++;
+            continue;
+        }
+        io->stats.tx_calls++;
+        io->stats.tx_packets += n;
+        sent += n;
+    }
+    io->tx_count = 0;
+    // 'sent' also counts the datagrams skipped after an error
+    return sent - failed;
+}
+
+void batch_io_tx_discard(BatchIO *io)
+{
+    io->tx_count = 0;
+}
@@ -0,0 +1,115 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define BATCH_IO_CONTROL_SIZE 64 // Ancillary data per datagram (IP_PKTINFO)
+
+typedef struct
+{
+    uint64_t rx_packets;
+    uint64_t rx_calls;
+    uint64_t tx_packets;
+    uint64_t tx_calls;
+    uint64_t tx_errors; // Datagrams the kernel refused to send
+} BatchIOStats;
+
+// Counters another thread reads: each field is stored and loaded on its
+// own with relaxed atomics, so a reader never sees a torn value, only
+// counters from slightly different moments
+static inline void batch_io_stats_publish(BatchIOStats *to, const BatchIOStats *from)
+{
+    __atomic_store_n(&to->rx_packets, from->rx_packets, __ATOMIC_RELAXED);
+    __atomic_store_n(&to->rx_calls, from->rx_calls, __ATOMIC_RELAXED);
+    __atomic_store_n(&to->tx_packets, from->tx_packets, __ATOMIC_RELAXED);
+    __atomic_store_n(&to->tx_calls, from->tx_calls, __ATOMIC_RELAXED);
+    __atomic_store_n(&to->tx_errors, from->tx_errors, __ATOMIC_RELAXED);
+}
+
+static inline void batch_io_stats_load(const BatchIOStats *from, BatchIOStats *to)
+{
+    to->rx_packets = __atomic_load_n(&from->rx_packets, __ATOMIC_RELAXED);
+    to->rx_calls = __atomic_load_n(&from->rx_calls, __ATOMIC_RELAXED);
+    to->tx_packets = __atomic_load_n(&from->tx_packets, __ATOMIC_RELAXED);
+    to->tx_calls = __atomic_load_n(&from->tx_calls, __ATOMIC_RELAXED);
+    to->tx_errors = __atomic_load_n(&from->tx_errors, __ATOMIC_RELAXED);
+}
+
+// Preallocated receive and send rings for recvmmsg()/sendmmsg(). One
+// instance per worker thread; nothing in here is shared.
+typedef struct
+{
+    unsigned int size;             // Datagrams per syscall
+    unsigned int flush_timeout_us; // Extra time to wait for a batch to fill
+    size_t buffer_size;
+
+    struct mmsghdr *rx_msgs;
+    struct iovec *rx_iov;
+    struct sockaddr_in *rx_addr;
+    uint8_t *rx_buf;
+    uint8_t *rx_control;
+    unsigned int rx_count;
+
+    struct mmsghdr *tx_msgs;
+    struct iovec *tx_iov;
+    struct sockaddr_in *tx_addr;
+    uint8_t *tx_buf;
+    uint8_t *tx_control;
+    unsigned int tx_count;
+
+    BatchIOStats stats;
+} BatchIO;
+
+int batch_io_init(BatchIO *io, unsigned int size, unsigned int flush_timeout_us, size_t buffer_size);
+void batch_io_destroy(BatchIO *io);
+
+// Block for at least one datagram, then take whatever else arrives within
+// the flush timeout, up to the batch size. Returns the number received.
+int batch_io_recv(BatchIO *io, int sockfd);
+
+static inline uint8_t *batch_io_rx_data(BatchIO *io, unsigned int i)
+{
+    return io->rx_iov[i].iov_base;
+}
+
+static inline size_t batch_io_rx_len(BatchIO *io, unsigned int i)
+{
+    return io->rx_msgs[i].msg_len;
+}
+
+static inline struct sockaddr_in *batch_io_rx_addr(BatchIO *io, unsigned int i)
+{
+    return &io->rx_addr[i];
+}
+
+// Interface the datagram arrived on, or 0 if the socket does not have
+// IP_PKTINFO enabled
+int batch_io_rx_ifindex(BatchIO *io, unsigned int i);
+
+// Same, for a message received with recvmsg()
+int batch_io_msg_ifindex(struct msghdr *msg);
+
+// Buffer for the next outgoing datagram, or NULL if the send ring is full
+uint8_t *batch_io_tx_buffer(BatchIO *io);
+
+// Queue 'len' bytes at 'data' for 'dest'. 'data' may be the buffer from
+// batch_io_tx_buffer() or a receive buffer being forwarded in place.
+int batch_io_tx_add(BatchIO *io, void *data, size_t len, const struct sockaddr_in *dest);
+
+// Same, leaving through interface 'ifindex' from address 'source'
+// (IP_PKTINFO), as a relay needs for broadcasts on a given link
+int batch_io_tx_add_via(BatchIO *io, void *data, size_t len, const struct sockaddr_in *dest, int ifindex,
+                        struct in_addr source);
+
+// Send everything queued with as few sendmmsg() calls as possible.
+// Returns the number of datagrams the kernel accepted; the ones it
+// refused are dropped and counted in tx_errors.
+int batch_io_flush(BatchIO *io, int sockfd);
+
+// Drop everything queued without sending it
+void batch_io_tx_discard(BatchIO *io);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Every benchmark result is one CSV row,
+//   benchmark,case,n,metric,value,unit
+// so the output of 'make bench' can be stored and diffed across builds.
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_CSV_HEADER "benchmark,case,n,metric,value,unit"
+
+static inline double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline void bench_result(const char *benchmark, const char *name, uint64_t n,
+                                const char *metric, double value, const char *unit)
+{
+    printf("%s,%s,%llu,%s,%.3f,%s\n", benchmark, name, (unsigned long long)n, metric, value, unit);
+}
+
+#endif
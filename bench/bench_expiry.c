@@ -0,0 +1,126 @@
+// Mass expiry: 500k leases that all expire in the same second, as after
+// a site-wide reboot. Reports the worst-case time the lease mutex is held
+// by the expiry thread for several batch sizes.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "ip_pool.h"
+#include "lease_table.h"
+#include "timer_wheel.h"
+
+#define BENCH "expiry"
+#define POOL_FIRST 0x0a000002 // 10.0.0.2
+#define LEASES 500000
+#define START 1000000
+
+static IPPool pool;
+static LeaseTable table;
+static TimerWheel wheel;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t expired;
+
+static void expire_lease(TimerEntry *entry, void *arg)
+{
+    IPLease *lease = timer_container_of(entry, IPLease, timer);
+    ip_pool_release(&pool, ntohl(lease->ip.s_addr));
+    lease_table_remove(&table, lease);
+    expired++;
+}
+
+static void fill(uint32_t n, time_t expiration)
+{
+    uint8_t chaddr[16] = {0x02};
+    ip_pool_init(&pool, POOL_FIRST, POOL_FIRST + n - 1);
+    lease_table_init(&table, n);
+    timer_wheel_init(&wheel, START);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t ip;
+        ip_pool_find_free(&pool, &ip);
+        ip_pool_take(&pool, ip);
+        memcpy(&chaddr[2], &i, 4);
+        struct in_addr addr = {htonl(ip)};
+        IPLease *lease = lease_table_insert(&table, addr, chaddr, START, expiration);
+        timer_wheel_schedule(&wheel, &lease->timer, expiration);
+    }
+}
+
+static void bench_wheel(int budget)
+{
+    // Expiry 300 s out lives in level 1, so the burst includes a cascade
+    time_t expiration = START + 300;
+    fill(LEASES, expiration);
+    expired = 0;
+
+    double worst = 0, total = 0;
+    int batches = 0, more;
+    for (time_t now = START; now <= expiration; now++)
+    {
+        do
+        {
+            double t0 = bench_now_ns();
+            pthread_mutex_lock(&mutex);
+            more = timer_wheel_advance(&wheel, now, budget, expire_lease, NULL);
+            pthread_mutex_unlock(&mutex);
+            double held = bench_now_ns() - t0;
+            total += held;
+            if (held > worst)
+                worst = held;
+            batches++;
+        } while (more);
+    }
+
+    bench_result(BENCH, "wheel", budget, "locks", batches, "count");
+    bench_result(BENCH, "wheel", budget, "max-hold", worst / 1e3, "us");
+    bench_result(BENCH, "wheel", budget, "total", total / 1e6, "ms");
+    if (expired != LEASES || table.count != 0 || pool.free_count != LEASES)
+    {
+        fprintf(stderr, "expiry incomplete: %u expired, %u left\n", expired, table.count);
+        exit(1);
+    }
+
+    lease_table_destroy(&table);
+    ip_pool_destroy(&pool);
+}
+
+// The previous lease_manager(): full scan, shifting the array on removal
+static void bench_shift_sweep(uint32_t n)
+{
+    IPLease *leases = calloc(n, sizeof(IPLease));
+    int count = n;
+    for (uint32_t i = 0; i < n; i++)
+        leases[i].lease_expiration = START;
+
+    double t0 = bench_now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        if (START + 1 > leases[i].lease_expiration)
+        {
+            for (int j = i; j < count - 1; j++)
+                leases[j] = leases[j + 1];
+            count--;
+            i--;
+        }
+    }
+    bench_result(BENCH, "shift-baseline", n, "hold", (bench_now_ns() - t0) / 1e6, "ms");
+    free(leases);
+}
+
+int main(void)
+{
+    // n is the expiry budget per lock hold; LEASES expire together
+    bench_wheel(64);
+    bench_wheel(256);
+    bench_wheel(4096);
+    bench_wheel(LEASES * 2);
+
+    bench_shift_sweep(5000);
+    bench_shift_sweep(10000);
+    bench_shift_sweep(20000);
+    return 0;
+}
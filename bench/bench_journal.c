@@ -0,0 +1,170 @@
+// Lease journal throughput and restart time. Writers append a change and
+// wait until it is durable, as the server workers do before replying;
+// group commit lets concurrent writers share each fdatasync(). Restart
+// loads a snapshot plus a journal tail into an empty store.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "lease_db.h"
+
+#define BENCH "journal"
+#define POOL_FIRST 0x0a000002 // 10.0.0.2
+#define POOL_SIZE (1 << 21)
+#define RECORDS_PER_THREAD 2000
+#define LEASE_TIME 3600
+
+static char dir[] = "bench/journal.XXXXXX";
+static LeaseDB db;
+
+static void clear_dir(void)
+{
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[512];
+    while (d != NULL && (entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    if (d != NULL)
+        closedir(d);
+}
+
+static void client_key(uint32_t client, uint8_t key[16])
+{
+    memset(key, 0, 16);
+    key[0] = 0x02;
+    memcpy(&key[2], &client, 4);
+}
+
+static void *run_writer(void *arg)
+{
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    uint8_t key[16];
+    for (uint32_t i = 0; i < RECORDS_PER_THREAD; i++)
+    {
+        uint32_t client = id * RECORDS_PER_THREAD + i;
+        struct in_addr ip = {htonl(POOL_FIRST + client)};
+        client_key(client, key);
+        uint64_t seq = lease_db_append(&db, LEASE_DB_GRANT, ip, key, 0, LEASE_TIME);
+        if (lease_db_wait(&db, seq) < 0)
+        {
+            perror("lease journal");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+static void bench_append(int nthreads)
+{
+    pthread_t tids[64];
+    LeaseStore store;
+
+    clear_dir();
+    lease_store_init(&store, POOL_FIRST, POOL_FIRST + POOL_SIZE - 1, LEASE_SHARDS, 0);
+    lease_db_open(&db, dir);
+    lease_db_load(&db, &store, 0);
+    lease_db_snapshot(&db, &store);
+    lease_db_start(&db);
+
+    double start = bench_now_ns();
+    for (int t = 0; t < nthreads; t++)
+        pthread_create(&tids[t], NULL, run_writer, (void *)(uintptr_t)t);
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(tids[t], NULL);
+    double elapsed = bench_now_ns() - start;
+
+    double records = (double)nthreads * RECORDS_PER_THREAD;
+    bench_result(BENCH, "append", nthreads, "throughput", records / (elapsed / 1e9), "records/s");
+    bench_result(BENCH, "append", nthreads, "group", records / (db.commits ? db.commits : 1), "records/fsync");
+
+    lease_db_close(&db);
+    lease_store_destroy(&store);
+}
+
+static void bench_restart(uint32_t nleases)
+{
+    LeaseStore store;
+    uint8_t key[16];
+
+    // Fill the store, snapshot it, and journal renewals for a tenth of it
+    clear_dir();
+    lease_store_init(&store, POOL_FIRST, POOL_FIRST + POOL_SIZE - 1, LEASE_SHARDS, 0);
+    lease_db_open(&db, dir);
+    lease_db_load(&db, &store, 0);
+    for (uint32_t i = 0; i < nleases; i++)
+    {
+        struct in_addr ip = {htonl(POOL_FIRST + i)};
+        client_key(i, key);
+        lease_store_grant(&store, ip, key, 0, LEASE_TIME);
+    }
+    double start = bench_now_ns();
+    lease_db_snapshot(&db, &store);
+    double snapshot_ms = (bench_now_ns() - start) / 1e6;
+
+    lease_db_start(&db);
+    uint64_t seq = 0;
+    for (uint32_t i = 0; i < nleases / 10; i++)
+    {
+        struct in_addr ip = {htonl(POOL_FIRST + i * 10)};
+        client_key(i * 10, key);
+        seq = lease_db_append(&db, LEASE_DB_RENEW, ip, key, 0, 2 * LEASE_TIME);
+    }
+    if (lease_db_wait(&db, seq) < 0)
+    {
+        perror("lease journal");
+        exit(1);
+    }
+    lease_db_close(&db);
+    lease_store_destroy(&store);
+
+    // Restart
+    lease_store_init(&store, POOL_FIRST, POOL_FIRST + POOL_SIZE - 1, LEASE_SHARDS, 0);
+    lease_db_open(&db, dir);
+    start = bench_now_ns();
+    long loaded = lease_db_load(&db, &store, 1);
+    double load_ms = (bench_now_ns() - start) / 1e6;
+    lease_db_close(&db);
+
+    bench_result(BENCH, "snapshot", nleases, "write", snapshot_ms, "ms");
+    bench_result(BENCH, "restart", nleases, "load", load_ms, "ms");
+    lease_store_destroy(&store);
+    if (loaded != (long)nleases)
+    {
+        fprintf(stderr, "restart lost leases: %ld of %u\n", loaded, nleases);
+        exit(1);
+    }
+}
+
+int main(void)
+{
+    static const int threads[] = {1, 4, 16};
+    static const uint32_t sizes[] = {10000, 100000, 1000000};
+
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // n is the number of writer threads for "append", leases otherwise
+    for (int i = 0; i < 3; i++)
+        bench_append(threads[i]);
+
+    for (int i = 0; i < 3; i++)
+        bench_restart(sizes[i]);
+
+    clear_dir();
+    rmdir(dir);
+    return 0;
+}
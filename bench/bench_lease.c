@@ -0,0 +1,165 @@
+// Allocation cost of the lease store as the pool grows from 10 to 1M
+// addresses. Each operation is what a DISCOVER + REQUEST pair does:
+// find the first free address, take it and insert the lease.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "ip_pool.h"
+#include "lease_table.h"
+
+#define BENCH "lease"
+#define POOL_FIRST 0xc0110002 // 192.17.0.2
+
+static void make_mac(uint8_t chaddr[16], uint32_t i)
+{
+    memset(chaddr, 0, 16);
+    chaddr[0] = 0x02;
+    chaddr[2] = i >> 24;
+    chaddr[3] = i >> 16;
+    chaddr[4] = i >> 8;
+    chaddr[5] = i;
+}
+
+static void bench_store(uint32_t n)
+{
+    IPPool pool;
+    LeaseTable table;
+    uint8_t chaddr[16];
+
+    ip_pool_init(&pool, POOL_FIRST, POOL_FIRST + n - 1);
+    lease_table_init(&table, n);
+
+    double start = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t ip;
+        if (!ip_pool_find_free(&pool, &ip) || !ip_pool_take(&pool, ip))
+        {
+            fprintf(stderr, "pool exhausted early at %u\n", i);
+            exit(1);
+        }
+        struct in_addr addr = {htonl(ip)};
+        make_mac(chaddr, i);
+        lease_table_insert(&table, addr, chaddr, 0, 0);
+    }
+    double alloc_ns = (bench_now_ns() - start) / n;
+
+    // Release and re-allocate the same addresses in a scattered order
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t k = (uint32_t)(((uint64_t)i * 2654435761u) % n);
+        struct in_addr addr = {htonl(POOL_FIRST + k)};
+        make_mac(chaddr, k);
+        IPLease *lease = lease_table_find(&table, addr, chaddr);
+        lease_table_remove(&table, lease);
+        ip_pool_release(&pool, POOL_FIRST + k);
+
+        uint32_t ip;
+        ip_pool_find_free(&pool, &ip);
+        ip_pool_take(&pool, ip);
+        addr.s_addr = htonl(ip);
+        lease_table_insert(&table, addr, chaddr, 0, 0);
+    }
+    double churn_ns = (bench_now_ns() - start) / n;
+
+    start = bench_now_ns();
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        make_mac(chaddr, i);
+        found += lease_table_find_mac(&table, chaddr) != NULL;
+    }
+    double lookup_ns = (bench_now_ns() - start) / n;
+
+    // get_available_ip() on a full pool with only the last address free
+    uint32_t last = POOL_FIRST + n - 1;
+    make_mac(chaddr, n - 1);
+    lease_table_remove(&table, lease_table_find_mac(&table, chaddr));
+    ip_pool_release(&pool, last);
+    uint32_t rounds = n < 100000 ? 100000 : n;
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < rounds; i++)
+    {
+        uint32_t ip;
+        if (!ip_pool_find_free(&pool, &ip) || ip != last)
+        {
+            fprintf(stderr, "find_free returned the wrong address\n");
+            exit(1);
+        }
+    }
+    double find_ns = (bench_now_ns() - start) / rounds;
+
+    // Remove every lease, as RELEASE does
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < n - 1; i++)
+    {
+        make_mac(chaddr, i);
+        IPLease *lease = lease_table_find_mac(&table, chaddr);
+        ip_pool_release(&pool, ntohl(lease->ip.s_addr));
+        lease_table_remove(&table, lease);
+    }
+    double remove_ns = (bench_now_ns() - start) / (n > 1 ? n - 1 : 1);
+
+    bench_result(BENCH, "store", n, "alloc", alloc_ns, "ns/op");
+    bench_result(BENCH, "store", n, "churn", churn_ns, "ns/op");
+    bench_result(BENCH, "store", n, "mac-lookup", lookup_ns, "ns/op");
+    bench_result(BENCH, "store", n, "find-free", find_ns, "ns/op");
+    bench_result(BENCH, "store", n, "remove", remove_ns, "ns/op");
+    if (found != n || table.count != 0 || pool.free_count != n)
+    {
+        fprintf(stderr, "lease store mismatch: %u of %u found, %u left\n", found, n, table.count);
+        exit(1);
+    }
+
+    lease_table_destroy(&table);
+    ip_pool_destroy(&pool);
+}
+
+// The previous get_available_ip(): every candidate scans every lease
+static void bench_linear(uint32_t n)
+{
+    uint32_t *leased = malloc(n * sizeof(uint32_t));
+    uint32_t count = 0;
+
+    double start = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+    {
+        for (uint32_t off = 0; off < n; off++)
+        {
+            uint32_t ip = POOL_FIRST + off;
+            int available = 1;
+            for (uint32_t j = 0; j < count; j++)
+            {
+                if (leased[j] == ip)
+                {
+                    available = 0;
+                    break;
+                }
+            }
+            if (available)
+            {
+                leased[count++] = ip;
+                break;
+            }
+        }
+    }
+    bench_result(BENCH, "linear-baseline", n, "alloc", (bench_now_ns() - start) / n, "ns/op");
+    free(leased);
+}
+
+int main(void)
+{
+    static const uint32_t sizes[] = {10, 100, 1000, 10000, 100000, 1000000};
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    for (int i = 0; i < nsizes; i++)
+        bench_store(sizes[i]);
+    for (int i = 0; i < nsizes && sizes[i] <= 1000; i++)
+        bench_linear(sizes[i]);
+    return 0;
+}
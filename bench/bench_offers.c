@@ -0,0 +1,257 @@
+// 10k DISCOVERs at once must get 10k distinct offers. First in process,
+// with threads offering through the lease store the way the workers do
+// (and, for contrast, with the old search-only lookup), then over
+// loopback against server.out, where retransmissions must also get the
+// same answers back.
+//
+//   bench_offers.out [server_binary]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "dhcp_options.h"
+#include "lease_store.h"
+
+#define BENCH "offers"
+#define CLIENTS 10000
+#define THREADS 8
+#define POOL_FIRST 0x0a000002 // 10.0.0.2
+#define POOL_SIZE 20000
+#define SERVER_PORT "16768"
+#define BURST 128
+#define SERVER_ID "192.17.0.1" // Built into server.out
+
+static LeaseStore store;
+static pthread_barrier_t barrier;
+static struct in_addr offered[CLIENTS];
+static int reserve; // 1 = lease_store_offer(), 0 = search only
+
+static void client_key(uint32_t client, uint8_t chaddr[16])
+{
+    memset(chaddr, 0, 16);
+    chaddr[0] = 0x02;
+    uint32_t be = htonl(client);
+    memcpy(&chaddr[2], &be, 4);
+}
+
+static void *offer_thread(void *arg)
+{
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    uint8_t chaddr[16];
+    pthread_barrier_wait(&barrier);
+    for (uint32_t c = id; c < CLIENTS; c += THREADS)
+    {
+        client_key(c, chaddr);
+        if (reserve)
+            lease_store_offer(&store, 0, store.npools, chaddr, 0, 10, &offered[c]);
+        else
+            lease_store_find_free(&store, &offered[c]);
+    }
+    return NULL;
+}
+
+static uint32_t count_duplicates(void)
+{
+    uint8_t *seen = calloc(POOL_SIZE, 1);
+    uint32_t duplicates = 0;
+    for (uint32_t c = 0; c < CLIENTS; c++)
+    {
+        uint32_t off = ntohl(offered[c].s_addr) - POOL_FIRST;
+        if (off >= POOL_SIZE || seen[off]++)
+            duplicates++;
+    }
+    free(seen);
+    return duplicates;
+}
+
+static void bench_store(const char *name, int with_reservation)
+{
+    lease_store_init(&store, POOL_FIRST, POOL_FIRST + POOL_SIZE - 1, LEASE_SHARDS, 0);
+    memset(offered, 0, sizeof(offered));
+    reserve = with_reservation;
+
+    pthread_t threads[THREADS];
+    pthread_barrier_init(&barrier, NULL, THREADS);
+    double start = bench_now_ns();
+    for (uintptr_t t = 0; t < THREADS; t++)
+        pthread_create(&threads[t], NULL, offer_thread, (void *)t);
+    for (int t = 0; t < THREADS; t++)
+        pthread_join(threads[t], NULL);
+    double elapsed = bench_now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+
+    // Every client then requests what it was offered
+    uint32_t rejected = 0;
+    uint8_t chaddr[16];
+    for (uint32_t c = 0; c < CLIENTS; c++)
+    {
+        client_key(c, chaddr);
+        if (lease_store_grant(&store, offered[c], chaddr, 0, 3600) != LEASE_OK)
+            rejected++;
+    }
+    uint32_t duplicates = count_duplicates();
+
+    bench_result(BENCH, name, CLIENTS, "offer", elapsed / CLIENTS, "ns/op");
+    bench_result(BENCH, name, CLIENTS, "duplicates", duplicates, "count");
+    bench_result(BENCH, name, CLIENTS, "requests-rejected", rejected, "count");
+    if (with_reservation && (duplicates != 0 || rejected != 0 || lease_store_offer_count(&store) != 0))
+    {
+        fprintf(stderr, "%u duplicate offers, %u rejected requests\n", duplicates, rejected);
+        exit(1);
+    }
+    lease_store_destroy(&store);
+}
+
+static pid_t start_server(const char *binary)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(binary, binary, "-w", "2", "-p", SERVER_PORT, "-n", "20000", "-l", "error", (char *)NULL);
+        perror("exec server");
+        _exit(1);
+    }
+    usleep(300000); // Let it bind
+    return pid;
+}
+
+static void send_message(int fd, const struct sockaddr_in *server, uint32_t client, uint8_t type)
+{
+    DHCPMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op = 1;
+    msg.htype = 1;
+    msg.hlen = 6;
+    msg.xid = htonl(client + 1);
+    client_key(client, msg.chaddr);
+    uint8_t *p = dhcp_begin_options(&msg, type);
+    if (type == DHCPREQUEST)
+    {
+        struct in_addr server_id;
+        inet_aton(SERVER_ID, &server_id);
+        p = dhcp_put_option(p, DHO_REQUESTED_IP, 4, &offered[client]);
+        p = dhcp_put_option(p, DHO_SERVER_ID, 4, &server_id);
+    }
+    *p++ = DHO_END;
+    sendto(fd, &msg, dhcp_message_length(&msg, p), 0, (const struct sockaddr *)server, sizeof(*server));
+}
+
+// Send one 'type' message per client, BURST at a time, and store the
+// yiaddr of each answer of type 'expected'. Returns the answers received.
+static uint32_t exchange(int fd, const struct sockaddr_in *server, uint8_t type, uint8_t expected,
+                         struct in_addr *answers, double *seconds)
+{
+    uint8_t buffer[1024] __attribute__((aligned(8)));
+    uint32_t replies = 0;
+    memset(answers, 0, CLIENTS * sizeof(struct in_addr));
+    double start = bench_now_ns();
+    for (uint32_t first = 0; first < CLIENTS; first += BURST)
+    {
+        uint32_t n = CLIENTS - first < BURST ? CLIENTS - first : BURST;
+        for (uint32_t c = first; c < first + n; c++)
+            send_message(fd, server, c, type);
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        uint32_t got = 0;
+        while (got < n && poll(&pfd, 1, 200) > 0)
+        {
+            ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+            DHCPOptions opts;
+            const DHCPMessage *msg = (const DHCPMessage *)buffer;
+            uint32_t client = ntohl(msg->xid) - 1;
+            if (len < DHCP_HEADER_SIZE || dhcp_parse_options(buffer, len, &opts) < 0 ||
+                opts.message_type != expected || client >= CLIENTS || answers[client].s_addr != 0)
+                continue;
+            answers[client].s_addr = msg->yiaddr;
+            got++;
+        }
+        replies += got;
+    }
+    *seconds = (bench_now_ns() - start) / 1e9;
+    return replies;
+}
+
+// Fire the DISCOVERs BURST at a time and check the offers, then
+// retransmit them (same xid) and the REQUESTs that follow, which must be
+// answered the same way
+static void bench_server(const char *binary)
+{
+    static struct in_addr again[CLIENTS];
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 8 << 20;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in server = {0};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(SERVER_PORT));
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    pid_t pid = start_server(binary);
+    double seconds;
+    uint32_t replies = exchange(fd, &server, DHCPDISCOVER, DHCPOFFER, offered, &seconds);
+
+    // Only the clients that got an answer take part in the check
+    uint8_t *seen = calloc(POOL_SIZE * 2, 1);
+    uint32_t duplicates = 0;
+    uint32_t base = ntohl(inet_addr("192.17.0.3"));
+    for (uint32_t c = 0; c < CLIENTS; c++)
+    {
+        if (offered[c].s_addr == 0)
+            continue;
+        uint32_t off = ntohl(offered[c].s_addr) - base;
+        if (off >= POOL_SIZE * 2 || seen[off]++)
+            duplicates++;
+    }
+    free(seen);
+
+    bench_result(BENCH, "server", CLIENTS, "offers", replies, "count");
+    bench_result(BENCH, "server", CLIENTS, "replies", replies / seconds, "msgs/s");
+    bench_result(BENCH, "server", CLIENTS, "duplicates", duplicates, "count");
+    if (duplicates != 0 || replies < CLIENTS * 9 / 10)
+    {
+        fprintf(stderr, "%u offers, %u duplicates\n", replies, duplicates);
+        exit(1);
+    }
+
+    uint32_t changed = 0;
+    replies = exchange(fd, &server, DHCPDISCOVER, DHCPOFFER, again, &seconds);
+    for (uint32_t c = 0; c < CLIENTS; c++)
+        changed += again[c].s_addr != 0 && offered[c].s_addr != 0 && again[c].s_addr != offered[c].s_addr;
+    bench_result(BENCH, "server-retransmit", CLIENTS, "replies", replies / seconds, "msgs/s");
+    bench_result(BENCH, "server-retransmit", CLIENTS, "changed", changed, "count");
+
+    uint32_t acks = exchange(fd, &server, DHCPREQUEST, DHCPACK, again, &seconds);
+    uint32_t acks_again = exchange(fd, &server, DHCPREQUEST, DHCPACK, again, &seconds);
+    bench_result(BENCH, "server-request", CLIENTS, "acks", acks, "count");
+    bench_result(BENCH, "server-request-retransmit", CLIENTS, "acks", acks_again, "count");
+    bench_result(BENCH, "server-request-retransmit", CLIENTS, "replies", acks_again / seconds, "msgs/s");
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(fd);
+
+    if (changed != 0 || acks_again < acks * 9 / 10)
+    {
+        fprintf(stderr, "%u retransmitted DISCOVERs got another address, %u of %u REQUESTs acked again\n",
+                changed, acks_again, acks);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bench_store("search-only", 0);
+    bench_store("reserved", 1);
+    bench_server(argc > 1 ? argv[1] : "./server.out");
+    return 0;
+}
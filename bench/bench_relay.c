@@ -0,0 +1,115 @@
+// Relay overhead over loopback: the load generator against server.out
+// directly, then through relay.out one datagram per syscall and in
+// batches. The server gets a 127.0.0.0/8 subnet so relayed requests
+// (giaddr 127.0.0.1) find a pool.
+//
+//   bench_relay.out [server_binary [relay_binary]]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "loadgen.h"
+
+#define BENCH "relay"
+#define SERVER_PORT "16867"
+#define RELAY_PORT "16868"
+#define CLIENTS 256
+#define DURATION 3
+
+static const char config_text[] = "server-id 127.0.0.1\n"
+                                  "subnet 127.0.0.0/8\n"
+                                  "range 127.1.0.1 127.1.255.254\n"
+                                  "lease-time 600\n";
+
+static pid_t spawn(char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execv(argv[0], argv);
+        perror("exec");
+        _exit(1);
+    }
+    usleep(300000); // Let it bind
+    return pid;
+}
+
+static void stop(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static int bench(const char *name, const char *port)
+{
+    static LoadgenResult result;
+    LoadgenConfig config;
+    memset(&config, 0, sizeof(config));
+    config.server.sin_family = AF_INET;
+    config.server.sin_port = htons(atoi(port));
+    config.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    config.clients = CLIENTS;
+    config.duration = DURATION;
+    config.renewals = 1;
+    config.timeout_ms = 200;
+
+    if (loadgen_run(&config, &result) < 0)
+        return -1;
+
+    const LoadgenTypeStats *s = &result.types[LOADGEN_DISCOVER];
+    bench_result(BENCH, name, CLIENTS, "discover-replies", s->replies / result.seconds, "msgs/s");
+    bench_result(BENCH, name, CLIENTS, "discover-timeouts", s->timeouts, "count");
+    bench_result(BENCH, name, CLIENTS, "discover-p50", histogram_percentile(&s->latency, 50) / 1e3, "us");
+    bench_result(BENCH, name, CLIENTS, "discover-p99", histogram_percentile(&s->latency, 99) / 1e3, "us");
+    bench_result(BENCH, name, CLIENTS, "total", result.total_sent / result.seconds, "msgs/s");
+    if (s->replies == 0)
+    {
+        fprintf(stderr, "no replies in %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_relay(const char *relay, const char *name, const char *batch)
+{
+    char *argv[] = {(char *)relay, "-i", "lo", "-p", RELAY_PORT, "-b", (char *)batch, "-s", "0",
+                    "-l", "error", "127.0.0.1:" SERVER_PORT, NULL};
+    pid_t pid = spawn(argv);
+    int ret = bench(name, RELAY_PORT);
+    stop(pid);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server = argc > 1 ? argv[1] : "./server.out";
+    const char *relay = argc > 2 ? argv[2] : "./relay.out";
+
+    char config[] = "/tmp/bench_relay_XXXXXX";
+    int fd = mkstemp(config);
+    if (fd < 0 || write(fd, config_text, sizeof(config_text) - 1) < 0)
+    {
+        perror("config");
+        return 1;
+    }
+    close(fd);
+
+    char *server_argv[] = {(char *)server, "-w", "1", "-p", SERVER_PORT, "-f", config, "-l", "error", NULL};
+    pid_t pid = spawn(server_argv);
+    int ret = bench("direct", SERVER_PORT);
+    if (ret == 0)
+        ret = bench_relay(relay, "relay-single", "1");
+    if (ret == 0)
+        ret = bench_relay(relay, "relay-batched", "32");
+    stop(pid);
+    unlink(config);
+    return ret < 0 ? 1 : 0;
+}
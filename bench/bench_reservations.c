@@ -0,0 +1,124 @@
+// Static reservations: time to build the perfect hash at startup, its
+// size, and lookups of reserved and unknown MACs, next to a binary search
+// over the same reservations sorted by MAC.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "reservations.h"
+
+#define BENCH "reservations"
+#define LOOKUPS 10000000
+#define PROBES 65536 // Distinct MACs looked up, in random order
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int compare_mac(const void *a, const void *b)
+{
+    const Reservation *x = a, *y = b;
+    return (x->mac > y->mac) - (x->mac < y->mac);
+}
+
+static const Reservation *bsearch_mac(const Reservation *sorted, uint32_t count, uint64_t mac)
+{
+    uint32_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (sorted[mid].mac < mac)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < count && sorted[lo].mac == mac ? &sorted[lo] : NULL;
+}
+
+static void bench_count(uint32_t count)
+{
+    // Locally administered MACs, scattered but distinct (odd multiplier
+    // modulo 2^40), one address each from 10.0.0.0/8
+    Reservation *list = malloc(count * sizeof(Reservation));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        list[i].mac = (UINT64_C(0x02) << 40) | ((i * UINT64_C(0x9e3779b97f)) & UINT64_C(0xffffffffff));
+        list[i].ip.s_addr = htonl(0x0a000000 + i);
+    }
+
+    ReservationTable table;
+    double start = bench_now_ns();
+    if (reservation_table_build(&table, list, count) < 0)
+    {
+        fprintf(stderr, "cannot build the reservation table\n");
+        exit(1);
+    }
+    double built = bench_now_ns() - start;
+    bench_result(BENCH, "build", count, "time", built / 1e6, "ms");
+    bench_result(BENCH, "build", count, "size",
+                 (double)(table.count * sizeof(Reservation) + table.nbuckets * sizeof(uint32_t)) / count, "bytes/entry");
+
+    // Misses share the low 40 bits with a reserved MAC
+    uint64_t *hits = malloc(PROBES * sizeof(uint64_t));
+    uint64_t *misses = malloc(PROBES * sizeof(uint64_t));
+    for (uint32_t i = 0; i < PROBES; i++)
+    {
+        hits[i] = list[rng() % count].mac;
+        misses[i] = hits[i] ^ (UINT64_C(0x04) << 40);
+    }
+
+    uint32_t found = 0;
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < LOOKUPS; i++)
+        found += reservation_table_find(&table, hits[i % PROBES]) != NULL;
+    double elapsed = bench_now_ns() - start;
+    if (found != LOOKUPS)
+    {
+        fprintf(stderr, "%u of %u reserved MACs not found\n", LOOKUPS - found, LOOKUPS);
+        exit(1);
+    }
+    bench_result(BENCH, "hit", count, "lookup", elapsed / LOOKUPS, "ns/op");
+
+    found = 0;
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < LOOKUPS; i++)
+        found += reservation_table_find(&table, misses[i % PROBES]) != NULL;
+    elapsed = bench_now_ns() - start;
+    if (found != 0)
+    {
+        fprintf(stderr, "%u unknown MACs found\n", found);
+        exit(1);
+    }
+    bench_result(BENCH, "miss", count, "lookup", elapsed / LOOKUPS, "ns/op");
+
+    qsort(list, count, sizeof(Reservation), compare_mac);
+    found = 0;
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < LOOKUPS; i++)
+        found += bsearch_mac(list, count, hits[i % PROBES]) != NULL;
+    elapsed = bench_now_ns() - start;
+    if (found != LOOKUPS)
+        exit(1);
+    bench_result(BENCH, "bsearch-hit", count, "lookup", elapsed / LOOKUPS, "ns/op");
+
+    free(hits);
+    free(misses);
+    free(list);
+    reservation_table_destroy(&table);
+}
+
+int main(void)
+{
+    bench_count(1000);
+    bench_count(100000);
+    bench_count(1000000);
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Lease store throughput against worker threads. Each thread runs
+// grant/renew/release cycles for its own clients, as the server workers
+// do for DISCOVER/REQUEST/RENEW/RELEASE. One shard is equivalent to the
+// former single global mutex.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "lease_store.h"
+
+#define BENCH "shards"
+#define POOL_FIRST 0x0a000002 // 10.0.0.2
+#define POOL_SIZE (1 << 20)
+#define CLIENTS_PER_THREAD 4096
+#define CYCLES_PER_THREAD 400000
+
+static LeaseStore store;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t failures;
+    struct in_addr leased[CLIENTS_PER_THREAD];
+} Worker;
+
+static void *run_worker(void *arg)
+{
+    Worker *worker = arg;
+    uint8_t chaddr[16] = {0x02};
+    chaddr[1] = worker->id;
+
+    for (uint32_t i = 0; i < CYCLES_PER_THREAD; i++)
+    {
+        uint32_t client = i % CLIENTS_PER_THREAD;
+        memcpy(&chaddr[2], &client, 4);
+        struct in_addr *ip = &worker->leased[client];
+
+        if (ip->s_addr == 0)
+        {
+            // DISCOVER + REQUEST, retrying if another thread won the address
+            int status;
+            do
+            {
+                if (!lease_store_find_free(&store, ip))
+                    break;
+                status = lease_store_grant(&store, *ip, chaddr, 0, 3600);
+            } while (status == LEASE_TAKEN);
+        }
+        else if (i % 3 == 0)
+        {
+            if (lease_store_release(&store, *ip, chaddr) != LEASE_OK)
+                worker->failures++;
+            ip->s_addr = 0;
+        }
+        else if (lease_store_renew(&store, *ip, chaddr, 0, 3600) != LEASE_OK)
+        {
+            worker->failures++;
+        }
+    }
+    return NULL;
+}
+
+static void bench(uint32_t nshards, int nthreads)
+{
+    pthread_t tids[64];
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+
+    lease_store_init(&store, POOL_FIRST, POOL_FIRST + POOL_SIZE - 1, nshards, 0);
+
+    double start = bench_now_ns();
+    for (int t = 0; t < nthreads; t++)
+    {
+        workers[t].id = t;
+        pthread_create(&tids[t], NULL, run_worker, &workers[t]);
+    }
+    uint32_t failures = 0;
+    for (int t = 0; t < nthreads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        failures += workers[t].failures;
+    }
+    double elapsed = bench_now_ns() - start;
+
+    double ops = (double)nthreads * CYCLES_PER_THREAD;
+    char name[32];
+    snprintf(name, sizeof(name), "shards-%u", nshards);
+    bench_result(BENCH, name, nthreads, "throughput", ops / (elapsed / 1e9), "ops/s");
+    if (failures)
+    {
+        fprintf(stderr, "%u lease operations failed\n", failures);
+        exit(1);
+    }
+
+    lease_store_destroy(&store);
+    free(workers);
+}
+
+int main(void)
+{
+    static const int threads[] = {1, 2, 4, 8};
+
+    // n is the number of worker threads
+    for (int s = 0; s < 2; s++)
+    {
+        uint32_t nshards = s == 0 ? 1 : LEASE_SHARDS;
+        for (int i = 0; i < 4; i++)
+            bench(nshards, threads[i]);
+    }
+    return 0;
+}
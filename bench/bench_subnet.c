@@ -0,0 +1,147 @@
+// Subnet selection by relay address against the number of subnets, and
+// the cost of a /8 pool: startup time, memory, and allocation rate.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "subnet.h"
+
+#define BENCH "subnet"
+#define LOOKUPS 10000000
+#define GRANTS 1000000
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static double rss_mb(void)
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+// 'count' /24 subnets spread over 10.0.0.0/8, looked up by random relay
+// addresses inside them
+static void bench_lookup(uint32_t count)
+{
+    SubnetConfig config;
+    subnet_config_init(&config);
+    uint32_t stride = 65536 / count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t network = 0x0a000000 + i * stride * 256;
+        Subnet *subnet = subnet_config_add(&config, network, 24);
+        subnet_add_range(subnet, network + 10, network + 250);
+    }
+    if (subnet_config_finish(&config) < 0)
+        exit(1);
+
+    uint32_t *relays = malloc(LOOKUPS / 100 * sizeof(uint32_t));
+    for (uint32_t i = 0; i < LOOKUPS / 100; i++)
+        relays[i] = 0x0a000000 + (rng() % count) * stride * 256 + 1;
+
+    double start = bench_now_ns();
+    uint32_t missed = 0;
+    for (uint32_t i = 0; i < LOOKUPS; i++)
+    {
+        uint32_t relay = relays[i % (LOOKUPS / 100)];
+        struct in_addr giaddr = {htonl(relay)};
+        Subnet *subnet = subnet_select(&config, giaddr, 0);
+        if (subnet == NULL || subnet->network != (relay & 0xffffff00))
+            missed++;
+    }
+    double elapsed = bench_now_ns() - start;
+
+    if (missed)
+    {
+        fprintf(stderr, "%u lookups found the wrong subnet\n", missed);
+        exit(1);
+    }
+    bench_result(BENCH, "lookup", count, "lookup", elapsed / LOOKUPS, "ns/op");
+    free(relays);
+    subnet_config_destroy(&config);
+}
+
+static void bench_slash8(void)
+{
+    SubnetConfig config;
+    subnet_config_init(&config);
+    Subnet *subnet = subnet_config_add(&config, 0x0a000000, 8);
+    subnet_add_range(subnet, 0x0a00000a, 0x0afffffe);
+    if (subnet_config_finish(&config) < 0)
+        exit(1);
+    subnet = &config.subnets[0];
+
+    uint32_t nranges;
+    IPRange *ranges = subnet_config_ranges(&config, &nranges);
+    double rss_before = rss_mb();
+    double start = bench_now_ns();
+    LeaseStore store;
+    if (lease_store_init_ranges(&store, ranges, nranges, LEASE_SHARDS, 0) < 0)
+    {
+        fprintf(stderr, "cannot allocate a /8 pool\n");
+        exit(1);
+    }
+    double init_ms = (bench_now_ns() - start) / 1e6;
+    double rss_init = rss_mb() - rss_before;
+    double bitmap_mb = (store.pools[0].nwords + store.pools[0].nsummary) * 8.0 / (1 << 20);
+
+    uint8_t chaddr[16] = {0x02};
+    start = bench_now_ns();
+    for (uint32_t i = 0; i < GRANTS; i++)
+    {
+        struct in_addr ip;
+        memcpy(&chaddr[2], &i, 4);
+        if (!lease_store_find_free_in(&store, subnet->first_pool, subnet->nranges, &ip) ||
+            lease_store_grant(&store, ip, chaddr, 0, 3600) != LEASE_OK)
+        {
+            fprintf(stderr, "grant %u failed\n", i);
+            exit(1);
+        }
+    }
+    double grant_ns = (bench_now_ns() - start) / GRANTS;
+
+    uint64_t size, free_count;
+    lease_store_usage(&store, &size, &free_count);
+    if (size - free_count != GRANTS)
+    {
+        fprintf(stderr, "pool counts %llu leases, expected %u\n", (unsigned long long)(size - free_count), GRANTS);
+        exit(1);
+    }
+
+    bench_result(BENCH, "pool-/8", size, "init", init_ms, "ms");
+    bench_result(BENCH, "pool-/8", size, "bitmap", bitmap_mb, "MB");
+    bench_result(BENCH, "pool-/8", size, "rss-empty", rss_init, "MB");
+    bench_result(BENCH, "pool-/8", GRANTS, "grant", grant_ns, "ns/op");
+    bench_result(BENCH, "pool-/8", GRANTS, "rss-leased", rss_mb() - rss_before, "MB");
+
+    lease_store_destroy(&store);
+    free(ranges);
+    subnet_config_destroy(&config);
+}
+
+int main(void)
+{
+    // First, so the resident size is not masked by memory freed earlier
+    bench_slash8();
+
+    uint32_t counts[] = {16, 256, 4096, 65536};
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        bench_lookup(counts[i]);
+    return 0;
+}
@@ -1,375 +1,697 @@
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <time.h>
-#include <net/if.h>
-#include <sys/ioctl.h>
 #include <signal.h>
 #include <termios.h>
 #include <fcntl.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "dhcp.h"
+#include "dhcp_options.h"
+#include "loadgen.h"
 
 #define BUFFER_SIZE 1024
 #define DHCP_SERVER_PORT 67
-#define LEASE_TIME 20
-
-volatile sig_atomic_t lease_expired = 0;
+#define LEASE_TIME 20 // When the ACK carries no lease time
+#define RETRANSMIT_MS 4000      // First retransmission timeout, doubled each time (RFC 2131 4.1)
+#define RETRANSMIT_MAX_MS 64000
+#define REQUEST_ATTEMPTS 5      // REQUESTs without an answer before starting over
+#define RENEW_MIN_WAIT_NS 60000000000ULL // Shortest wait between renewal retransmissions
+#define LEASE_CACHE "client.lease"       // Lease kept across restarts, for INIT-REBOOT
+#define LEASE_CACHE_LINE 128
+
+// Where DISCOVER, REQUEST and REBIND go: broadcast unless -s is given
+struct sockaddr_in server_dest;
+uint16_t client_port = 0; // 0 = any
+unsigned int retransmit_ms = RETRANSMIT_MS;
+const char *lease_cache_path = LEASE_CACHE;
+
+// Options the client asks the server for (option 55)
+static const uint8_t parameter_list[] = {DHO_SUBNET_MASK, DHO_ROUTER, DHO_DNS_SERVER};
+
+// RFC 2131 figure 5
+typedef enum
+{
+    STATE_INIT,
+    STATE_SELECTING,
+    STATE_REQUESTING,
+    STATE_BOUND,
+    STATE_RENEWING,
+    STATE_REBINDING,
+    STATE_REBOOTING // Confirming a cached lease after a restart
+} ClientState;
+
+// What the client remembers of its lease between runs. The expiry is
+// wall-clock time, since the monotonic clock restarts with the machine.
+typedef struct
+{
+    struct in_addr address;
+    struct in_addr server_id;
+    time_t expires;
+    struct in_addr subnet_mask; // 0 if the server sent none
+    struct in_addr router;
+    struct in_addr dns_server;
+} CachedLease;
 
 typedef struct
 {
-    uint8_t op;
-    uint8_t htype;
-    uint8_t hlen;
-    uint8_t hops;
+    ClientState state;
+    int sockfd;
+    int timerfd;
     uint32_t xid;
-    uint16_t secs;
-    uint16_t flags;
-    uint32_t ciaddr;
-    uint32_t yiaddr;
-    uint32_t siaddr;
-    uint32_t giaddr;
-    uint8_t chaddr[16];
-    uint8_t sname[64];
-    uint8_t file[128];
-    uint8_t options[312];
-} DHCPMessage;
-
-void read_dhcp_options(DHCPMessage *msg)
+    unsigned int attempts; // Messages sent in the current exchange
+    uint64_t started_ns;   // First message of the exchange, for 'secs'
+
+    struct in_addr offered; // Address in the OFFER being requested
+    struct in_addr address; // Bound address, 0 until the first ACK
+    struct in_addr server_id;
+    struct sockaddr_in server; // Where the ACK came from, for renewals
+
+    // Absolute CLOCK_MONOTONIC times of the current lease
+    uint64_t t1_ns;
+    uint64_t t2_ns;
+    uint64_t expiry_ns;
+} Client;
+
+static uint64_t now_ns(void)
 {
-    uint8_t *options = msg->options;
-    int i = 13; // Start after the magic cookie and the first option
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    struct in_addr ip_addr;
-    ip_addr.s_addr = msg->yiaddr;
+void read_dhcp_options(const DHCPOptions *opts)
+{
+    struct in_addr addr;
+    if (dhcp_option_addr(opts, DHO_SUBNET_MASK, &addr))
+        printf("Subnet Mask: %s\n", inet_ntoa(addr));
+    if (dhcp_option_addr(opts, DHO_ROUTER, &addr))
+        printf("Router: %s\n", inet_ntoa(addr));
+    if (dhcp_option_addr(opts, DHO_DNS_SERVER, &addr))
+        printf("DNS Server: %s\n", inet_ntoa(addr));
+    printf("\n");
+}
 
-    while (i < sizeof(msg->options) && options[i] != 255) // 255 is the END option
-    {
-        uint8_t option_type = options[i++];
-        if (i >= sizeof(msg->options))
-            break;
-        uint8_t option_length = options[i++];
+static uint32_t option_seconds(const DHCPOptions *opts, uint8_t code, uint32_t fallback)
+{
+    uint8_t len;
+    const uint8_t *value = dhcp_option_get(opts, code, &len);
+    if (value == NULL || len != 4)
+        return fallback;
+    uint32_t seconds;
+    memcpy(&seconds, value, 4);
+    return ntohl(seconds);
+}
 
-        if (i + option_length > sizeof(msg->options))
-        {
-            break;
-        }
+// The timer fires once, at 'deadline_ns'
+static void arm_timer(Client *client, uint64_t deadline_ns)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline_ns / 1000000000;
+    its.it_value.tv_nsec = deadline_ns % 1000000000;
+    if (timerfd_settime(client->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        perror("Error setting timer");
+}
 
-        switch (option_type)
-        {
-        case 1: // Subnet Mask
-        {
-            struct in_addr subnet;
-            memcpy(&subnet.s_addr, &options[i], 4);
-            printf("Subnet Mask: %s\n", inet_ntoa(subnet));
-        }
+// Send the message of the current state: DISCOVER, REQUEST, or a renewal
+// unicast to the server (RENEWING) or broadcast (REBINDING)
+static void send_state_message(Client *client)
+{
+    DHCPMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op = 1;    // BOOTREQUEST
+    msg.htype = 1; // Ethernet
+    msg.hlen = 6;  // MAC address length
+    msg.xid = htonl(client->xid);
+    msg.secs = htons((now_ns() - client->started_ns) / 1000000000);
+
+    const struct sockaddr_in *dest = &server_dest;
+    const char *name;
+    uint8_t *p;
+    switch (client->state)
+    {
+    case STATE_SELECTING:
+        name = "DISCOVER";
+        msg.flags = htons(0x8000); // Broadcast flag
+        p = dhcp_begin_options(&msg, DHCPDISCOVER);
+        p = dhcp_put_option(p, DHO_RAPID_COMMIT, 0, NULL); // An ACK right away is welcome (RFC 4039)
         break;
-        case 6: // DNS Server
-        {
-            struct in_addr dns;
-            memcpy(&dns.s_addr, &options[i], 4);
-            printf("DNS Server: %s\n", inet_ntoa(dns));
-        }
+    case STATE_REQUESTING:
+        name = "REQUEST";
+        msg.flags = htons(0x8000);
+        p = dhcp_begin_options(&msg, DHCPREQUEST);
+        p = dhcp_put_option(p, DHO_REQUESTED_IP, 4, &client->offered);
+        p = dhcp_put_option(p, DHO_SERVER_ID, 4, &client->server_id);
         break;
-        }
-
-        i += option_length;
+    case STATE_REBOOTING:
+        // The cached address in option 50, no server identifier and no
+        // ciaddr: any server on the network may answer (RFC 2131 4.3.2)
+        name = "REQUEST (INIT-REBOOT)";
+        msg.flags = htons(0x8000);
+        p = dhcp_begin_options(&msg, DHCPREQUEST);
+        p = dhcp_put_option(p, DHO_REQUESTED_IP, 4, &client->address);
+        break;
+    case STATE_RENEWING:
+    case STATE_REBINDING:
+        // No server identifier while renewing or rebinding (RFC 2131 4.3.2)
+        name = client->state == STATE_RENEWING ? "RENEW" : "REBIND";
+        msg.ciaddr = client->address.s_addr;
+        if (client->state == STATE_RENEWING)
+            dest = &client->server;
+        p = dhcp_begin_options(&msg, DHCPREQUEST);
+        break;
+    default:
+        return;
     }
-    printf("\n");
+    p = dhcp_put_option(p, DHO_PARAMETER_LIST, sizeof(parameter_list), parameter_list);
+    *p++ = DHO_END;
+
+    if (sendto(client->sockfd, &msg, dhcp_message_length(&msg, p), 0, (const struct sockaddr *)dest, sizeof(*dest)) < 0)
+        perror("Error sending");
+    else
+        printf("Sent DHCP %s%s\n", name, client->attempts > 0 ? " (retransmission)" : "");
+    client->attempts++;
 }
 
-void send_dhcp_discover(int sockfd, struct sockaddr_in *server_addr)
+// When to retransmit the message just sent. DISCOVER and REQUEST back off
+// exponentially with +-1/4 of the first timeout of jitter; renewals wait
+// half the time left until T2 (or the end of the lease), at least a
+// minute, but never past it.
+static uint64_t next_deadline(const Client *client, uint64_t now)
 {
-    DHCPMessage discover_msg;
-    memset(&discover_msg, 0, sizeof(discover_msg));
-    discover_msg.op = 1;                  // BOOTREQUEST
-    discover_msg.htype = 1;               // Ethernet
-    discover_msg.hlen = 6;                // MAC address length
-    discover_msg.xid = htonl(0x12345678); // Transaction ID
-    discover_msg.flags = htons(0x8000);   // Broadcast flag
-
-    // Set DHCP options
-    discover_msg.options[0] = 0x63; // Magic cookie
-    discover_msg.options[1] = 0x82;
-    discover_msg.options[2] = 0x53;
-    discover_msg.options[3] = 0x63;
-    discover_msg.options[4] = 53; // DHCP Message Type
-    discover_msg.options[5] = 1;  // Length
-    discover_msg.options[6] = 1;  // DHCPDISCOVER
-
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(DHCP_SERVER_PORT);
-    dest_addr.sin_addr.s_addr = INADDR_BROADCAST;
-
-    int broadcastEnable = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) < 0)
+    if (client->state == STATE_RENEWING || client->state == STATE_REBINDING)
     {
-        perror("setsockopt");
-        close(sockfd);
-        exit(1);
+        uint64_t until = client->state == STATE_RENEWING ? client->t2_ns : client->expiry_ns;
+        uint64_t wait = until > now ? (until - now) / 2 : 0;
+        if (wait < RENEW_MIN_WAIT_NS)
+            wait = RENEW_MIN_WAIT_NS;
+        return now + wait < until ? now + wait : until;
     }
 
-    sendto(sockfd, &discover_msg, sizeof(discover_msg), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    printf("Sent DHCP DISCOVER\n");
+    uint64_t interval = (uint64_t)retransmit_ms << (client->attempts - 1 < 5 ? client->attempts - 1 : 5);
+    if (interval > RETRANSMIT_MAX_MS)
+        interval = RETRANSMIT_MAX_MS;
+    int64_t jitter = (int64_t)(random() % (retransmit_ms / 2 + 1)) - retransmit_ms / 4;
+    return now + (interval + jitter) * 1000000;
 }
 
-void handle_dhcp_offer(int sockfd, DHCPMessage *offer_msg)
+static void transmit(Client *client)
 {
-    struct in_addr offered_ip;
-    offered_ip.s_addr = offer_msg->yiaddr;
-    printf("Received DHCP OFFER: \nIP Address: %s\n", inet_ntoa(offered_ip));
-
-    read_dhcp_options(offer_msg);
+    send_state_message(client);
+    arm_timer(client, next_deadline(client, now_ns()));
 }
 
-void send_dhcp_request(int sockfd, struct sockaddr_in *server_addr, DHCPMessage *offer_msg)
+// Start a new exchange with a fresh transaction ID
+static void start_exchange(Client *client, ClientState state)
 {
-    DHCPMessage request_msg;
-    memset(&request_msg, 0, sizeof(request_msg));
-    request_msg.op = 1;                     // BOOTREQUEST
-    request_msg.htype = 1;                  // Ethernet
-    request_msg.hlen = 6;                   // MAC address length
-    request_msg.xid = offer_msg->xid;       // Use the same transaction ID
-    request_msg.flags = htons(0x8000);      // Broadcast flag
-    request_msg.yiaddr = offer_msg->yiaddr; // Requested IP address
-
-    request_msg.options[0] = 0x63; // Magic cookie
-    request_msg.options[1] = 0x82;
-    request_msg.options[2] = 0x53;
-    request_msg.options[3] = 0x63;
-    request_msg.options[4] = 53; // DHCP Message Type
-    request_msg.options[5] = 1;  // Length
-    request_msg.options[6] = 3;  // DHCP REQUEST
-    request_msg.options[7] = 50; // Requested IP Address
-    request_msg.options[8] = 4;  // Length
-
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(DHCP_SERVER_PORT);
-    dest_addr.sin_addr.s_addr = INADDR_BROADCAST;
-
-    sendto(sockfd, &request_msg, sizeof(request_msg), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    printf("Sent DHCP REQUEST\n");
+    client->state = state;
+    client->xid = (uint32_t)random();
+    client->attempts = 0;
+    client->started_ns = now_ns();
+    transmit(client);
 }
 
-void handle_dhcp_ack(int sockfd, DHCPMessage *ack_msg)
+// One "keyword value" per line, like the server's configuration file
+static int lease_cache_load(const char *path, CachedLease *lease)
 {
-    struct in_addr assigned_ip;
-    assigned_ip.s_addr = ack_msg->yiaddr;
-    printf("Received DHCP ACK: \nIP Address: %s\n", inet_ntoa(assigned_ip));
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
 
-    read_dhcp_options(ack_msg);
+    memset(lease, 0, sizeof(*lease));
+    char line[LEASE_CACHE_LINE];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char key[32], value[64];
+        if (sscanf(line, "%31s %63s", key, value) != 2 || key[0] == '#')
+            continue;
+        if (strcmp(key, "address") == 0)
+            inet_pton(AF_INET, value, &lease->address);
+        else if (strcmp(key, "server-id") == 0)
+            inet_pton(AF_INET, value, &lease->server_id);
+        else if (strcmp(key, "expires") == 0)
+            lease->expires = (time_t)strtoll(value, NULL, 10);
+        else if (strcmp(key, "subnet-mask") == 0)
+            inet_pton(AF_INET, value, &lease->subnet_mask);
+        else if (strcmp(key, "router") == 0)
+            inet_pton(AF_INET, value, &lease->router);
+        else if (strcmp(key, "dns") == 0)
+            inet_pton(AF_INET, value, &lease->dns_server);
+    }
+    fclose(file);
+    return lease->address.s_addr != 0 && lease->expires != 0 ? 0 : -1;
 }
 
-void send_dhcp_release(int sockfd, struct sockaddr_in *server_addr, DHCPMessage *ack_msg)
+static void put_cache_addr(FILE *file, const char *key, struct in_addr addr)
 {
-    DHCPMessage release_msg;
-    memset(&release_msg, 0, sizeof(release_msg));
-    release_msg.op = 1;                              // BOOTREQUEST
-    release_msg.htype = 1;                           // Ethernet
-    release_msg.hlen = 6;                            // MAC address length
-    release_msg.xid = ack_msg->xid;                  // Use the same transaction ID
-    release_msg.yiaddr = ack_msg->yiaddr;            // Client IP address
-    memcpy(release_msg.chaddr, ack_msg->chaddr, 16); // Copy the client's MAC address
+    if (addr.s_addr != 0)
+        fprintf(file, "%s %s\n", key, inet_ntoa(addr));
+}
 
-    // Set DHCP options
-    uint8_t *options = release_msg.options;
-    options[0] = 0x63; // Magic cookie
-    options[1] = 0x82;
-    options[2] = 0x53;
-    options[3] = 0x63;
-
-    options[4] = 53; // DHCP Message Type
-    options[5] = 1;  // Length
-    options[6] = 7;  // DHCPRELEASE
-
-    options[7] = 54; // Server Identifier
-    options[8] = 4;  // Length
-    memcpy(&options[9], &ack_msg->siaddr, 4);
-
-    options[13] = 255; // End option
-
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(DHCP_SERVER_PORT);
-    dest_addr.sin_addr.s_addr = INADDR_BROADCAST;
-
-    sendto(sockfd, &release_msg, sizeof(release_msg), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    printf("Sent DHCP RELEASE\n");
+// Written to a temporary file and renamed, so a crash leaves either the
+// old lease or the new one
+static void lease_cache_save(const char *path, const CachedLease *lease)
+{
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "w");
+    if (file == NULL)
+    {
+        perror(tmp);
+        return;
+    }
+    fprintf(file, "# Lease of client.out, confirmed with INIT-REBOOT on the next start\n");
+    put_cache_addr(file, "address", lease->address);
+    put_cache_addr(file, "server-id", lease->server_id);
+    fprintf(file, "expires %lld\n", (long long)lease->expires);
+    put_cache_addr(file, "subnet-mask", lease->subnet_mask);
+    put_cache_addr(file, "router", lease->router);
+    put_cache_addr(file, "dns", lease->dns_server);
+    if (fclose(file) != 0 || rename(tmp, path) < 0)
+    {
+        perror(path);
+        unlink(tmp);
+    }
 }
 
-void send_dhcp_renew(int sockfd, struct sockaddr_in *server_addr, DHCPMessage *ack_msg) {
-    DHCPMessage renew_msg;
-    memset(&renew_msg, 0, sizeof(renew_msg));
-    renew_msg.op = 1;                   // BOOTREQUEST
-    renew_msg.htype = 1;                // Ethernet
-    renew_msg.hlen = 6;                 // MAC address length
-    renew_msg.xid = ack_msg->xid;       // Use the same transaction ID
-    renew_msg.ciaddr = ack_msg->yiaddr; // Current IP address
-    renew_msg.yiaddr = ack_msg->yiaddr;
-    memcpy(renew_msg.chaddr, ack_msg->chaddr, 16);
+// The address is gone: the next start goes through DISCOVER
+static void lease_lost(Client *client)
+{
+    client->address.s_addr = 0;
+    unlink(lease_cache_path);
+}
 
-    // Set DHCP options
-    uint8_t *options = renew_msg.options;
-    options[0] = 0x63; // Magic cookie
-    options[1] = 0x82;
-    options[2] = 0x53;
-    options[3] = 0x63;
+static void handle_dhcp_offer(Client *client, const DHCPMessage *offer_msg, const DHCPOptions *opts,
+                              const struct sockaddr_in *from)
+{
+    client->offered.s_addr = offer_msg->yiaddr;
+    printf("Received DHCP OFFER: \nIP Address: %s\n", inet_ntoa(client->offered));
+    read_dhcp_options(opts);
 
-    options[4] = 53; // DHCP Message Type
-    options[5] = 1;  // Length
-    options[6] = 3;  // DHCPREQUEST (used for renewing)
+    if (!dhcp_option_addr(opts, DHO_SERVER_ID, &client->server_id))
+        client->server_id = from->sin_addr;
 
-    options[7] = 54; // Server Identifier
-    options[8] = 4;  // Length
-    memcpy(&options[9], &ack_msg->siaddr, 4);
+    // The REQUEST keeps the OFFER's transaction ID
+    client->state = STATE_REQUESTING;
+    client->attempts = 0;
+    transmit(client);
+}
 
-    options[13] = 255; // End option
+static void handle_dhcp_ack(Client *client, const DHCPMessage *ack_msg, const DHCPOptions *opts,
+                            const struct sockaddr_in *from)
+{
+    client->address.s_addr = ack_msg->yiaddr;
+    printf("Received DHCP ACK: \nIP Address: %s\n", inet_ntoa(client->address));
+    read_dhcp_options(opts);
+
+    dhcp_option_addr(opts, DHO_SERVER_ID, &client->server_id);
+    client->server = *from;
+
+    // Times count from the start of the exchange, a little before the
+    // server started the lease (RFC 2131 4.4.1)
+    uint32_t lease = option_seconds(opts, DHO_LEASE_TIME, LEASE_TIME);
+    uint32_t t1 = option_seconds(opts, DHO_RENEWAL_TIME, lease / 2);
+    uint32_t t2 = option_seconds(opts, DHO_REBINDING_TIME, (uint32_t)((uint64_t)lease * 7 / 8));
+    uint64_t start = client->started_ns;
+    client->t1_ns = start + (uint64_t)t1 * 1000000000;
+    client->t2_ns = start + (uint64_t)t2 * 1000000000;
+    client->expiry_ns = start + (uint64_t)lease * 1000000000;
+
+    client->state = STATE_BOUND;
+    arm_timer(client, client->t1_ns);
+    printf("Bound to %s for %u s, renewing in %u s\n", inet_ntoa(client->address), lease, t1);
+
+    CachedLease cached;
+    memset(&cached, 0, sizeof(cached));
+    cached.address = client->address;
+    cached.server_id = client->server_id;
+    cached.expires = time(NULL) - (time_t)((now_ns() - start) / 1000000000) + lease;
+    dhcp_option_addr(opts, DHO_SUBNET_MASK, &cached.subnet_mask);
+    dhcp_option_addr(opts, DHO_ROUTER, &cached.router);
+    dhcp_option_addr(opts, DHO_DNS_SERVER, &cached.dns_server);
+    lease_cache_save(lease_cache_path, &cached);
+}
 
-    sendto(sockfd, &renew_msg, sizeof(renew_msg), 0, (struct sockaddr *)server_addr, sizeof(*server_addr));
-    printf("Sent DHCP RENEW\n");
+static void handle_message(Client *client, const uint8_t *buffer, size_t len, const struct sockaddr_in *from)
+{
+    DHCPOptions opts;
+    const DHCPMessage *msg = (const DHCPMessage *)buffer;
+    if (dhcp_parse_options(buffer, len, &opts) < 0 || msg->op != 2)
+    {
+        printf("Ignoring malformed DHCP message\n");
+        return;
+    }
+    if (ntohl(msg->xid) != client->xid)
+        return;
+
+    int requesting = client->state == STATE_REQUESTING || client->state == STATE_RENEWING ||
+                     client->state == STATE_REBINDING || client->state == STATE_REBOOTING;
+    if (client->state == STATE_SELECTING && opts.message_type == DHCPOFFER)
+        handle_dhcp_offer(client, msg, &opts, from);
+    else if (client->state == STATE_SELECTING && opts.message_type == DHCPACK &&
+             dhcp_option_present(&opts, DHO_RAPID_COMMIT))
+        handle_dhcp_ack(client, msg, &opts, from); // Rapid Commit: the server already committed the lease
+    else if (requesting && opts.message_type == DHCPACK)
+        handle_dhcp_ack(client, msg, &opts, from);
+    else if (requesting && opts.message_type == DHCPNAK)
+    {
+        printf("Received DHCP NAK, starting over\n");
+        lease_lost(client);
+        start_exchange(client, STATE_SELECTING);
+    }
+    else
+        printf("Ignoring DHCP message of type %d\n", opts.message_type);
 }
 
-void lease_timer_handler(int signum) {
-    lease_expired = 1;
+// Read every datagram waiting on the socket
+static void receive_messages(Client *client)
+{
+    uint8_t buffer[BUFFER_SIZE] __attribute__((aligned(8)));
+    while (1)
+    {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t recv_len = recvfrom(client->sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+        if (recv_len < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+                perror("Error receiving data");
+            return;
+        }
+        handle_message(client, buffer, recv_len, &from);
+    }
 }
 
-int kbhit(void) {
-    struct termios oldt, newt;
-    int ch;
-    int oldf;
+static void handle_timer(Client *client)
+{
+    uint64_t expirations;
+    if (read(client->timerfd, &expirations, sizeof(expirations)) < 0)
+        return;
 
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-    oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    uint64_t now = now_ns();
+    switch (client->state)
+    {
+    case STATE_SELECTING:
+        transmit(client);
+        break;
+    case STATE_REQUESTING:
+    case STATE_REBOOTING:
+        if (client->attempts < REQUEST_ATTEMPTS)
+            transmit(client);
+        else
+        {
+            printf("No answer to the REQUEST, starting over\n");
+            if (client->state == STATE_REBOOTING)
+                lease_lost(client);
+            start_exchange(client, STATE_SELECTING);
+        }
+        break;
+    case STATE_BOUND:
+        start_exchange(client, STATE_RENEWING);
+        break;
+    case STATE_RENEWING:
+        if (now >= client->t2_ns)
+            start_exchange(client, STATE_REBINDING);
+        else
+            transmit(client);
+        break;
+    case STATE_REBINDING:
+        if (now >= client->expiry_ns)
+        {
+            printf("Lease on %s expired, starting over\n", inet_ntoa(client->address));
+            lease_lost(client);
+            start_exchange(client, STATE_SELECTING);
+        }
+        else
+            transmit(client);
+        break;
+    default:
+        break;
+    }
+}
 
-    ch = getchar();
+static void send_dhcp_release(Client *client)
+{
+    DHCPMessage release_msg;
+    memset(&release_msg, 0, sizeof(release_msg));
+    release_msg.op = 1;                             // BOOTREQUEST
+    release_msg.htype = 1;                          // Ethernet
+    release_msg.hlen = 6;                           // MAC address length
+    release_msg.xid = htonl((uint32_t)random());    // New transaction ID
+    release_msg.ciaddr = client->address.s_addr;    // Client IP address
 
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-    fcntl(STDIN_FILENO, F_SETFL, oldf);
+    // Set DHCP options
+    uint8_t *p = dhcp_begin_options(&release_msg, DHCPRELEASE);
+    p = dhcp_put_option(p, DHO_SERVER_ID, 4, &client->server_id);
+    *p++ = DHO_END;
+
+    // A lease restored from the lease file may not know the server's address
+    const struct sockaddr_in *dest = client->server.sin_addr.s_addr != 0 ? &client->server : &server_dest;
+    if (sendto(client->sockfd, &release_msg, dhcp_message_length(&release_msg, p), 0,
+               (const struct sockaddr *)dest, sizeof(*dest)) < 0)
+        perror("Error sending");
+    else
+        printf("Sent DHCP RELEASE\n");
+}
 
-    if(ch != EOF) {
-        ungetc(ch, stdin);
-        return 1;
-    }
+static struct termios saved_termios;
+static int termios_saved = 0;
 
-    return 0;
+static void restore_terminal(void)
+{
+    if (termios_saved)
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
 }
 
-int main()
+// Keys arrive one at a time, without echo, until the client exits
+static void raw_terminal(void)
 {
-    int sockfd;
-    struct sockaddr_in client_addr, server_addr;
-    socklen_t server_len = sizeof(server_addr);
-    char buffer[BUFFER_SIZE];
-    DHCPMessage *dhcp_msg;
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_termios) < 0)
+        return;
+    struct termios raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    termios_saved = 1;
+    atexit(restore_terminal);
+}
+
+static int epoll_add(int epfd, int fd)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// One interactive client: everything happens in reaction to the socket,
+// the timer, a key or a signal, so the process sleeps while bound
+static int run_client(void)
+{
+    Client client;
+    memset(&client, 0, sizeof(client));
+    client.state = STATE_INIT;
 
     // Create UDP socket
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0)
+    client.sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (client.sockfd < 0)
     {
         perror("Error creating socket");
-        exit(1);
+        return -1;
+    }
+
+    int broadcastEnable = 1;
+    if (setsockopt(client.sockfd, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) < 0)
+    {
+        perror("setsockopt");
+        return -1;
     }
 
     // Configure client address
+    struct sockaddr_in client_addr;
     memset(&client_addr, 0, sizeof(client_addr));
     client_addr.sin_family = AF_INET;
-    client_addr.sin_port = htons(INADDR_ANY);
+    client_addr.sin_port = htons(client_port);
     client_addr.sin_addr.s_addr = INADDR_ANY;
 
     // Bind socket to address
-    if (bind(sockfd, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0)
+    if (bind(client.sockfd, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0)
     {
         perror("Error binding socket");
-        close(sockfd);
-        exit(1);
+        return -1;
     }
 
-    // Send DHCPDISCOVER
-    send_dhcp_discover(sockfd, &server_addr);
-
-    // Receive DHCPOFFER
-    ssize_t recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&server_addr, &server_len);
-    if (recv_len < 0)
+    // SIGINT and SIGTERM are read from a descriptor, so the terminal is
+    // restored on the way out
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    int sigfd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    client.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sigfd < 0 || client.timerfd < 0 || epfd < 0 || epoll_add(epfd, client.sockfd) < 0 ||
+        epoll_add(epfd, client.timerfd) < 0 || epoll_add(epfd, sigfd) < 0)
     {
-        perror("Error receiving data");
-        close(sockfd);
-        exit(1);
+        perror("Error setting up the event loop");
+        return -1;
     }
-    dhcp_msg = (DHCPMessage *)buffer;
-    handle_dhcp_offer(sockfd, dhcp_msg);
-
-    // Send DHCPREQUEST
-    send_dhcp_request(sockfd, &server_addr, dhcp_msg);
-
-    // Receive DHCPACK
-    recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&server_addr, &server_len);
-    if (recv_len < 0)
+    int keys = epoll_add(epfd, STDIN_FILENO) == 0;
+    if (keys)
     {
-        perror("Error receiving data");
-        close(sockfd);
-        exit(1);
+        raw_terminal();
+        printf("Press SPACE to release the IP address\n");
     }
-    dhcp_msg = (DHCPMessage *)buffer;
-    handle_dhcp_ack(sockfd, dhcp_msg);
-
-    // Set up timer for lease expiration
-    struct sigaction sa;
-    struct itimerval timer;
-
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = &lease_timer_handler;
-    sigaction(SIGALRM, &sa, NULL);
 
-    // Configure the timer to expire after LEASE_TIME seconds
-    timer.it_value.tv_sec = LEASE_TIME;
-    timer.it_value.tv_usec = 0;
-    timer.it_interval.tv_sec = LEASE_TIME;
-    timer.it_interval.tv_usec = 0;
+    srandom(time(NULL) ^ getpid());
 
-    // Start the timer
-    if (setitimer(ITIMER_REAL, &timer, NULL) == -1) {
-        perror("Error setting timer");
-        exit(1);
+    // A lease still valid from the last run is confirmed in one round trip
+    CachedLease cached;
+    if (lease_cache_load(lease_cache_path, &cached) == 0 && cached.expires > time(NULL))
+    {
+        client.address = cached.address;
+        client.server_id = cached.server_id;
+        printf("Cached lease for %s, %lld s left\n", inet_ntoa(cached.address),
+               (long long)(cached.expires - time(NULL)));
+        start_exchange(&client, STATE_REBOOTING);
     }
+    else
+        start_exchange(&client, STATE_SELECTING);
 
-    printf("Press SPACE to release the IP address\n");
-
-    while (1) {
-        if (lease_expired) {
-            lease_expired = 0;
-            send_dhcp_renew(sockfd, &server_addr, dhcp_msg);
+    while (1)
+    {
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return -1;
+        }
 
-            // Receive DHCPACK after renew
-            recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&server_addr, &server_len);
-            if (recv_len < 0) {
-                perror("Error receiving data");
-                break;
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == client.sockfd)
+                receive_messages(&client);
+            else if (fd == client.timerfd)
+                handle_timer(&client);
+            else if (fd == sigfd)
+            {
+                printf("Client terminating\n");
+                return 0;
+            }
+            else if (fd == STDIN_FILENO)
+            {
+                char c;
+                ssize_t got = read(STDIN_FILENO, &c, 1);
+                if (got <= 0)
+                {
+                    // No more input: keep the lease until killed
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                    continue;
+                }
+                if (c != ' ')
+                    continue;
+                if (client.address.s_addr != 0)
+                {
+                    send_dhcp_release(&client);
+                    lease_lost(&client);
+                }
+                printf("Client terminating\n");
+                return 0;
             }
-            dhcp_msg = (DHCPMessage *)buffer;
-            handle_dhcp_ack(sockfd, dhcp_msg);
         }
+    }
+}
 
-        if (kbhit()) {
-            char c = getchar();
-            if (c == ' ') {
-                send_dhcp_release(sockfd, &server_addr, dhcp_msg);
-                break;
-            }
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s server_ip] [-p server_port] [-P client_port] [-W timeout_ms] [-L lease_file]\n"
+                    "       [-n clients [-R rate] [-t seconds] [-r renewals] [-k]]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    memset(&server_dest, 0, sizeof(server_dest));
+    server_dest.sin_family = AF_INET;
+    server_dest.sin_port = htons(DHCP_SERVER_PORT);
+    server_dest.sin_addr.s_addr = INADDR_BROADCAST;
+
+    // Without -n the client runs a single interactive lease cycle
+    LoadgenConfig load;
+    memset(&load, 0, sizeof(load));
+    load.duration = 10;
+    load.renewals = 1;
+    load.timeout_ms = 1000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:P:n:R:t:r:W:L:k")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (inet_pton(AF_INET, optarg, &server_dest.sin_addr) != 1)
+                usage(argv[0]);
+            break;
+        case 'p':
+            server_dest.sin_port = htons(atoi(optarg));
+            break;
+        case 'P':
+            client_port = atoi(optarg);
+            break;
+        case 'n':
+            load.clients = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            load.rate = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            load.duration = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            load.renewals = strtoul(optarg, NULL, 10);
+            break;
+        case 'W':
+            // Reply timeout under load, first retransmission otherwise
+            load.timeout_ms = retransmit_ms = strtoul(optarg, NULL, 10);
+            if (retransmit_ms < 1)
+                usage(argv[0]);
+            break;
+        case 'L':
+            lease_cache_path = optarg;
+            break;
+        case 'k':
+            load.rapid_commit = 1;
+            break;
+        default:
+            usage(argv[0]);
         }
- // Sleep for 100ms to reduce CPU usage
     }
 
-    close(sockfd);
-    printf("Client terminating\n");
-    return 0;
+    if (load.clients > 0)
+    {
+        load.server = server_dest;
+        load.client_port = client_port;
+        printf("Load: %u clients against %s:%u for %u s\n", load.clients,
+               inet_ntoa(load.server.sin_addr), ntohs(load.server.sin_port), load.duration);
+
+        static LoadgenResult result;
+        if (loadgen_run(&load, &result) < 0)
+            return 1;
+        loadgen_print(&load, &result);
+        return 0;
+    }
+
+    return run_client() < 0 ? 1 : 0;
 }
@@ -0,0 +1,55 @@
+#ifndef DHCP_H
+#define DHCP_H
+
+#include <stdint.h>
+
+#define DHCP_MAGIC_COOKIE 0x63825363
+#define DHCP_HEADER_SIZE 236 // BOOTP header up to the options field
+#define DHCP_MIN_PACKET 300  // Shortest BOOTP message relays must accept (RFC 1542)
+
+// DHCP message types (option 53)
+#define DHCPDISCOVER 1
+#define DHCPOFFER 2
+#define DHCPREQUEST 3
+#define DHCPDECLINE 4
+#define DHCPACK 5
+#define DHCPNAK 6
+#define DHCPRELEASE 7
+#define DHCPINFORM 8
+
+// Option codes
+#define DHO_PAD 0
+#define DHO_SUBNET_MASK 1
+#define DHO_ROUTER 3
+#define DHO_DNS_SERVER 6
+#define DHO_REQUESTED_IP 50
+#define DHO_LEASE_TIME 51
+#define DHO_MESSAGE_TYPE 53
+#define DHO_SERVER_ID 54
+#define DHO_PARAMETER_LIST 55
+#define DHO_RENEWAL_TIME 58
+#define DHO_REBINDING_TIME 59
+#define DHO_CLIENT_ID 61
+#define DHO_RAPID_COMMIT 80
+#define DHO_END 255
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t htype;
+    uint8_t hlen;
+    uint8_t hops;
+    uint32_t xid;
+    uint16_t secs;
+    uint16_t flags;
+    uint32_t ciaddr;
+    uint32_t yiaddr;
+    uint32_t siaddr;
+    uint32_t giaddr;
+    uint8_t chaddr[16];
+    uint8_t sname[64];
+    uint8_t file[128];
+    uint8_t options[312];
+} DHCPMessage;
+
+#endif
@@ -0,0 +1,123 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "dhcp_options.h"
+
+#define OPTIONS_START (DHCP_HEADER_SIZE + 4) // After the magic cookie
+
+int dhcp_parse_options(const uint8_t *packet, size_t len, DHCPOptions *opts)
+{
+    opts->packet = packet;
+    memset(opts->present, 0, sizeof(opts->present));
+    opts->message_type = 0;
+
+    if (len < OPTIONS_START)
+        return -1;
+
+    uint32_t cookie;
+    memcpy(&cookie, packet + DHCP_HEADER_SIZE, 4);
+    if (cookie != htonl(DHCP_MAGIC_COOKIE))
+        return -1;
+
+    size_t i = OPTIONS_START;
+    while (i < len)
+    {
+        uint8_t code = packet[i++];
+        if (code == DHO_PAD)
+            continue;
+        if (code == DHO_END)
+            break;
+
+        if (i >= len)
+            return -1;
+        uint8_t option_len = packet[i++];
+        if (option_len > len - i)
+            return -1;
+
+        if (!dhcp_option_present(opts, code))
+        {
+            opts->present[code >> 6] |= UINT64_C(1) << (code & 63);
+            opts->offset[code] = (uint16_t)i;
+            opts->length[code] = option_len;
+        }
+        i += option_len;
+    }
+
+    if (dhcp_option_present(opts, DHO_MESSAGE_TYPE) && opts->length[DHO_MESSAGE_TYPE] == 1)
+        opts->message_type = packet[opts->offset[DHO_MESSAGE_TYPE]];
+    return 0;
+}
+
+const uint8_t *dhcp_option_get(const DHCPOptions *opts, uint8_t code, uint8_t *len)
+{
+    if (!dhcp_option_present(opts, code))
+        return NULL;
+    if (len != NULL)
+        *len = opts->length[code];
+    return opts->packet + opts->offset[code];
+}
+
+int dhcp_option_addr(const DHCPOptions *opts, uint8_t code, struct in_addr *addr)
+{
+    uint8_t len;
+    const uint8_t *value = dhcp_option_get(opts, code, &len);
+    if (value == NULL || len != 4)
+        return 0;
+    memcpy(&addr->s_addr, value, 4);
+    return 1;
+}
+
+void dhcp_client_key(const DHCPMessage *msg, const DHCPOptions *opts, uint8_t key[16])
+{
+    uint8_t len;
+    const uint8_t *id = dhcp_option_get(opts, DHO_CLIENT_ID, &len);
+    if (id == NULL || len == 0)
+    {
+        memcpy(key, msg->chaddr, 16);
+        return;
+    }
+
+    memset(key, 0, 16);
+    if (len <= 16)
+    {
+        memcpy(key, id, len);
+        return;
+    }
+
+    // FNV-1a over the identifier, spread across both halves of the key
+    uint64_t h1 = UINT64_C(0xcbf29ce484222325), h2 = UINT64_C(0x84222325cbf29ce4);
+    for (uint8_t i = 0; i < len; i++)
+    {
+        h1 = (h1 ^ id[i]) * UINT64_C(0x100000001b3);
+        h2 = (h2 ^ id[len - 1 - i]) * UINT64_C(0x100000001b3);
+    }
+    memcpy(key, &h1, 8);
+    memcpy(key + 8, &h2, 8);
+}
+
+uint8_t *dhcp_begin_options(DHCPMessage *msg, uint8_t message_type)
+{
+    uint8_t *options = msg->options;
+    options[0] = 0x63; // Magic cookie
+    options[1] = 0x82;
+    options[2] = 0x53;
+    options[3] = 0x63;
+    options[4] = DHO_MESSAGE_TYPE;
+    options[5] = 1;
+    options[6] = message_type;
+    return &options[7];
+}
+
+uint8_t *dhcp_put_option(uint8_t *p, uint8_t code, uint8_t len, const void *data)
+{
+    p[0] = code;
+    p[1] = len;
+    memcpy(&p[2], data, len);
+    return p + 2 + len;
+}
+
+size_t dhcp_message_length(const DHCPMessage *msg, const uint8_t *end)
+{
+    size_t len = (size_t)(end - (const uint8_t *)msg);
+    return len < DHCP_MIN_PACKET ? DHCP_MIN_PACKET : len;
+}
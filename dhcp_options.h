@@ -0,0 +1,52 @@
+#ifndef DHCP_OPTIONS_H
+#define DHCP_OPTIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "dhcp.h"
+
+// Index of the options in a received packet. Values are not copied:
+// each present option records its offset into the packet, and accessors
+// return pointers into the caller's buffer, which must outlive the index.
+typedef struct
+{
+    const uint8_t *packet;
+    uint64_t present[4]; // Bit per option code
+    uint16_t offset[256]; // Offset of the value from the start of the packet
+    uint8_t length[256];
+    uint8_t message_type; // Option 53, or 0 if absent
+} DHCPOptions;
+
+// Walk the options of a 'len'-byte packet once. Returns 0 on success and
+// -1 if the packet is shorter than the fixed header, the magic cookie is
+// wrong, or an option runs past the end of the data. A missing END is
+// tolerated. The first occurrence of a repeated option wins.
+int dhcp_parse_options(const uint8_t *packet, size_t len, DHCPOptions *opts);
+
+static inline int dhcp_option_present(const DHCPOptions *opts, uint8_t code)
+{
+    return (opts->present[code >> 6] >> (code & 63)) & 1;
+}
+
+// Pointer to the option value and its length, or NULL if absent
+const uint8_t *dhcp_option_get(const DHCPOptions *opts, uint8_t code, uint8_t *len);
+
+// Read a 4-byte address option. Returns 0 if absent or the wrong length.
+int dhcp_option_addr(const DHCPOptions *opts, uint8_t code, struct in_addr *addr);
+
+// Key identifying the client: the client identifier (option 61) when
+// present, otherwise chaddr. Long identifiers are folded into 16 bytes.
+void dhcp_client_key(const DHCPMessage *msg, const DHCPOptions *opts, uint8_t key[16]);
+
+// Write the magic cookie and the message type; returns where the next
+// option goes
+uint8_t *dhcp_begin_options(DHCPMessage *msg, uint8_t message_type);
+
+uint8_t *dhcp_put_option(uint8_t *p, uint8_t code, uint8_t len, const void *data);
+
+// Bytes to send for a message whose options end at 'end'
+size_t dhcp_message_length(const DHCPMessage *msg, const uint8_t *end);
+
+#endif
@@ -0,0 +1,114 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "dhcp_reply.h"
+
+static uint8_t *put_option(uint8_t *p, uint8_t code, uint8_t len, const void *data)
+{
+    p[0] = code;
+    p[1] = len;
+    memcpy(&p[2], data, len);
+    return p + 2 + len;
+}
+
+static void add_param(ReplyTemplate *tpl, uint8_t code, uint8_t len, const void *data)
+{
+    if (tpl->param_count == REPLY_MAX_PARAMS || tpl->param_used + 2 + len > REPLY_OPTION_SPACE)
+        return;
+
+    put_option(&tpl->param_data[tpl->param_used], code, len, data);
+    tpl->param_offset[code] = (uint8_t)(tpl->param_used + 1);
+    tpl->param_order[tpl->param_count++] = code;
+    tpl->param_used += 2 + len;
+}
+
+void reply_template_init(ReplyTemplate *tpl, uint8_t message_type, uint16_t flags, const ReplyParams *params)
+{
+    memset(tpl, 0, sizeof(*tpl));
+    tpl->msg.op = 2; // BOOTREPLY
+    tpl->msg.flags = htons(flags);
+
+    uint8_t *options = tpl->msg.options;
+    uint32_t cookie = htonl(DHCP_MAGIC_COOKIE);
+    memcpy(options, &cookie, 4);
+
+    uint8_t *p = options + 4;
+    uint32_t lease_time = htonl(params->lease_time);
+    p = put_option(p, DHO_MESSAGE_TYPE, 1, &message_type);
+    p = put_option(p, DHO_SERVER_ID, 4, &params->server_id);
+
+    // A NAK carries no lease and no configuration (RFC 2131 table 3)
+    if (message_type == DHCPNAK)
+    {
+        tpl->fixed_length = DHCP_HEADER_SIZE + (size_t)(p - options);
+        return;
+    }
+    // Nor does the ACK to an INFORM, which leaves addressing to the client
+    if (params->lease_time != 0)
+        p = put_option(p, DHO_LEASE_TIME, 4, &lease_time);
+    tpl->fixed_length = DHCP_HEADER_SIZE + (size_t)(p - options);
+
+    add_param(tpl, DHO_SUBNET_MASK, 4, &params->subnet_mask);
+    add_param(tpl, DHO_DNS_SERVER, 4, &params->dns_server);
+    add_param(tpl, DHO_ROUTER, 4, &params->router);
+}
+
+void reply_template_add_option(ReplyTemplate *tpl, uint8_t code, uint8_t len, const void *data)
+{
+    uint8_t *p = (uint8_t *)&tpl->msg + tpl->fixed_length;
+    tpl->fixed_length += (size_t)(put_option(p, code, len, data) - p);
+}
+
+static uint8_t *put_param(const ReplyTemplate *tpl, uint8_t *p, uint8_t code)
+{
+    if (tpl->param_offset[code] == 0)
+        return p;
+    const uint8_t *tlv = &tpl->param_data[tpl->param_offset[code] - 1];
+    memcpy(p, tlv, 2 + tlv[1]);
+    return p + 2 + tlv[1];
+}
+
+size_t reply_template_build(const ReplyTemplate *tpl, const DHCPMessage *request, uint32_t yiaddr,
+                            const uint8_t *prl, uint8_t prl_len, DHCPMessage *reply)
+{
+    memcpy(reply, &tpl->msg, tpl->fixed_length);
+    reply->htype = request->htype;
+    reply->hlen = request->hlen;
+    reply->xid = request->xid;
+    // RFC 2131: a relay routes the reply back by giaddr and the client's flags
+    reply->flags |= request->flags;
+    reply->giaddr = request->giaddr;
+    memcpy(reply->chaddr, request->chaddr, 16);
+    reply->yiaddr = yiaddr;
+
+    uint8_t *start = (uint8_t *)reply;
+    uint8_t *p = start + tpl->fixed_length;
+    if (prl == NULL)
+    {
+        for (int i = 0; i < tpl->param_count; i++)
+            p = put_param(tpl, p, tpl->param_order[i]);
+    }
+    else
+    {
+        // Each configured option is sent at most once, in the client's order
+        uint64_t sent[4] = {0};
+        for (uint8_t i = 0; i < prl_len; i++)
+        {
+            uint8_t code = prl[i];
+            if (sent[code >> 6] & (UINT64_C(1) << (code & 63)))
+                continue;
+            sent[code >> 6] |= UINT64_C(1) << (code & 63);
+            p = put_param(tpl, p, code);
+        }
+    }
+    *p++ = DHO_END;
+
+    // Pad short replies up to the BOOTP minimum
+    size_t length = (size_t)(p - start);
+    if (length < DHCP_MIN_PACKET)
+    {
+        memset(p, 0, DHCP_MIN_PACKET - length);
+        length = DHCP_MIN_PACKET;
+    }
+    return length;
+}
@@ -0,0 +1,50 @@
+#ifndef DHCP_REPLY_H
+#define DHCP_REPLY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "dhcp.h"
+
+#define REPLY_OPTION_SPACE 128 // Bytes for pre-encoded parameter options
+#define REPLY_MAX_PARAMS 16
+
+// Network parameters every OFFER/ACK can carry
+typedef struct
+{
+    uint32_t lease_time; // Seconds, 0 for no lease time option
+    struct in_addr server_id;
+    struct in_addr subnet_mask;
+    struct in_addr dns_server;
+    struct in_addr router;
+} ReplyParams;
+
+// A reply encoded once at startup. The header and the options every reply
+// must carry (message type, server identifier, lease time) are laid out
+// in 'msg'; the parameter options a client may ask for are kept encoded
+// separately, so a reply is a copy of the fixed part plus the requested
+// TLVs, then patching of the per-client header fields.
+typedef struct
+{
+    DHCPMessage msg;
+    size_t fixed_length; // Bytes of 'msg' up to the end of the fixed options
+    uint8_t param_data[REPLY_OPTION_SPACE];
+    size_t param_used;
+    uint8_t param_offset[256]; // Offset + 1 into param_data, 0 if not configured
+    uint8_t param_order[REPLY_MAX_PARAMS]; // Sent when the client has no parameter list
+    int param_count;
+} ReplyTemplate;
+
+void reply_template_init(ReplyTemplate *tpl, uint8_t message_type, uint16_t flags, const ReplyParams *params);
+
+// Add an option every reply built from 'tpl' carries
+void reply_template_add_option(ReplyTemplate *tpl, uint8_t code, uint8_t len, const void *data);
+
+// Fill 'reply' for 'request' and return the number of bytes to send.
+// 'prl' is the client's parameter request list (option 55); with NULL
+// every configured parameter is included.
+size_t reply_template_build(const ReplyTemplate *tpl, const DHCPMessage *request, uint32_t yiaddr,
+                            const uint8_t *prl, uint8_t prl_len, DHCPMessage *reply);
+
+#endif
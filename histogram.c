@@ -0,0 +1,78 @@
+#include <string.h>
+
+#include "histogram.h"
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+static uint32_t bucket_index(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB)
+        return (uint32_t)value;
+    uint32_t exponent = 63 - __builtin_clzll(value);
+    uint32_t sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + sub;
+}
+
+// Midpoint of the values a bucket covers
+static uint64_t bucket_value(uint32_t idx)
+{
+    if (idx < HISTOGRAM_SUB)
+        return idx;
+    uint32_t exponent = idx / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+    uint32_t shift = exponent - HISTOGRAM_SUB_BITS;
+    uint64_t low = (uint64_t)(HISTOGRAM_SUB + idx % HISTOGRAM_SUB) << shift;
+    return low + ((UINT64_C(1) << shift) >> 1);
+}
+
+void histogram_init(Histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void histogram_record(Histogram *h, uint64_t value)
+{
+    // Single writer: plain increments, published with relaxed stores
+    uint64_t *bucket = &h->buckets[bucket_index(value)];
+    STORE(bucket, *bucket + 1);
+    STORE(&h->count, h->count + 1);
+    if (value > h->max)
+        STORE(&h->max, value);
+}
+
+void histogram_merge(Histogram *into, const Histogram *from)
+{
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        into->buckets[i] += LOAD(&from->buckets[i]);
+    into->count += LOAD(&from->count);
+    uint64_t max = LOAD(&from->max);
+    if (max > into->max)
+        into->max = max;
+}
+
+void histogram_subtract(Histogram *h, const Histogram *earlier)
+{
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        h->buckets[i] -= earlier->buckets[i];
+    h->count -= earlier->count;
+}
+
+uint64_t histogram_percentile(const Histogram *h, double p)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t value = bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
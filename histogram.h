@@ -0,0 +1,36 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+// Log-linear histogram: values below HISTOGRAM_SUB are counted exactly,
+// larger ones in HISTOGRAM_SUB buckets per power of two, so any
+// percentile is within about 3% of the true value. Recording is an
+// index computation and an increment. There is one writer per
+// histogram; fields are stored atomically, so another thread may merge
+// or read it at any time and see a slightly stale copy.
+typedef struct
+{
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+void histogram_init(Histogram *h);
+void histogram_record(Histogram *h, uint64_t value);
+
+// Add the counts of 'from' to 'into'
+void histogram_merge(Histogram *into, const Histogram *from);
+
+// Take away the counts of 'earlier', an older copy of 'h', leaving what
+// was recorded since. The maximum stays that of 'h'.
+void histogram_subtract(Histogram *h, const Histogram *earlier);
+
+// Value at percentile 'p' (0-100), or 0 if empty
+uint64_t histogram_percentile(const Histogram *h, double p);
+
+#endif
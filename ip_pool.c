@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ip_pool.h"
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELAXED(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+int ip_pool_init(IPPool *pool, uint32_t first, uint32_t last)
+{
+    memset(pool, 0, sizeof(*pool));
+    if (last < first)
+        return -1;
+
+    pool->first = first;
+    pool->size = last - first + 1;
+    pool->nwords = (pool->size + 63) / 64;
+    pool->nsummary = (pool->nwords + 63) / 64;
+
+    pool->bits = malloc(pool->nwords * sizeof(uint64_t));
+    pool->summary = calloc(pool->nsummary, sizeof(uint64_t));
+    if (pool->bits == NULL || pool->summary == NULL)
+    {
+        ip_pool_destroy(pool);
+        return -1;
+    }
+
+    // Every address starts free; clear the tail bits past the end of the range
+    memset(pool->bits, 0xff, pool->nwords * sizeof(uint64_t));
+    if (pool->size % 64)
+        pool->bits[pool->nwords - 1] = (UINT64_C(1) << (pool->size % 64)) - 1;
+
+    for (uint32_t w = 0; w < pool->nwords; w++)
+        pool->summary[w / 64] |= UINT64_C(1) << (w % 64);
+
+    pool->free_count = pool->size;
+    return 0;
+}
+
+void ip_pool_destroy(IPPool *pool)
+{
+    free(pool->bits);
+    free(pool->summary);
+    memset(pool, 0, sizeof(*pool));
+}
+
+int ip_pool_contains(const IPPool *pool, uint32_t ip)
+{
+    return ip - pool->first < pool->size;
+}
+
+int ip_pool_is_free(const IPPool *pool, uint32_t ip)
+{
+    if (!ip_pool_contains(pool, ip))
+        return 0;
+    uint32_t off = ip - pool->first;
+    return (LOAD(&pool->bits[off / 64]) >> (off % 64)) & 1;
+}
+
+uint32_t ip_pool_free_count(const IPPool *pool)
+{
+    return LOAD(&pool->free_count);
+}
+
+int ip_pool_find_free(IPPool *pool, uint32_t *ip)
+{
+    // The hint only moves forward past words that are exhausted, so the
+    // amortized cost stays constant while the pool fills up. It is updated
+    // without synchronization, so fall back to a scan from the start
+    // before reporting the pool as full.
+    uint32_t start = LOAD(&pool->hint);
+    while (ip_pool_free_count(pool) > 0)
+    {
+        for (uint32_t s = start; s < pool->nsummary; s++)
+        {
+            uint64_t summary = LOAD(&pool->summary[s]);
+            while (summary)
+            {
+                uint32_t w = s * 64 + __builtin_ctzll(summary);
+                uint64_t bits = LOAD(&pool->bits[w]);
+                if (bits)
+                {
+                    STORE_RELAXED(&pool->hint, s);
+                    *ip = pool->first + w * 64 + __builtin_ctzll(bits);
+                    return 1;
+                }
+                summary &= summary - 1;
+            }
+        }
+        if (start == 0)
+            break;
+        start = 0;
+    }
+    return 0;
+}
+
+int ip_pool_take(IPPool *pool, uint32_t ip)
+{
+    if (!ip_pool_contains(pool, ip))
+        return 0;
+
+    uint32_t off = ip - pool->first;
+    uint32_t w = off / 64;
+    uint64_t mask = UINT64_C(1) << (off % 64);
+    uint64_t old = __atomic_fetch_and(&pool->bits[w], ~mask, __ATOMIC_ACQ_REL);
+    if (!(old & mask))
+        return 0;
+
+    if ((old & ~mask) == 0)
+    {
+        // The word looks exhausted. A concurrent release may have refilled
+        // it in between, so re-check after clearing the summary bit.
+        uint64_t sbit = UINT64_C(1) << (w % 64);
+        __atomic_fetch_and(&pool->summary[w / 64], ~sbit, __ATOMIC_ACQ_REL);
+        if (LOAD(&pool->bits[w]) != 0)
+            __atomic_fetch_or(&pool->summary[w / 64], sbit, __ATOMIC_ACQ_REL);
+    }
+    __atomic_fetch_sub(&pool->free_count, 1, __ATOMIC_ACQ_REL);
+    return 1;
+}
+
+void ip_pool_release(IPPool *pool, uint32_t ip)
+{
+    if (!ip_pool_contains(pool, ip))
+        return;
+
+    uint32_t off = ip - pool->first;
+    uint32_t w = off / 64;
+    uint64_t mask = UINT64_C(1) << (off % 64);
+    uint64_t old = __atomic_fetch_or(&pool->bits[w], mask, __ATOMIC_ACQ_REL);
+    if (old & mask)
+        return; // Already free
+
+    __atomic_fetch_or(&pool->summary[w / 64], UINT64_C(1) << (w % 64), __ATOMIC_ACQ_REL);
+    if (w / 64 < LOAD(&pool->hint))
+        STORE_RELAXED(&pool->hint, w / 64);
+    __atomic_fetch_add(&pool->free_count, 1, __ATOMIC_ACQ_REL);
+}
@@ -0,0 +1,41 @@
+#ifndef IP_POOL_H
+#define IP_POOL_H
+
+#include <stdint.h>
+
+// Free-address bitmap for a contiguous range of IPv4 addresses.
+// Bit set = address free. A second level (summary) has one bit per
+// bitmap word that still holds at least one free address, so the first
+// free address is found with two ctz operations instead of a scan.
+// All operations are atomic, so the pool can be shared by threads
+// without a lock.
+typedef struct
+{
+    uint32_t first;      // First address of the range (host byte order)
+    uint32_t size;       // Number of addresses in the range
+    uint32_t free_count; // Addresses currently free
+    uint32_t nwords;     // Words in bits[]
+    uint32_t nsummary;   // Words in summary[]
+    uint32_t hint;       // Lowest summary word that may have a set bit
+    uint64_t *bits;
+    uint64_t *summary;
+} IPPool;
+
+int ip_pool_init(IPPool *pool, uint32_t first, uint32_t last);
+void ip_pool_destroy(IPPool *pool);
+
+int ip_pool_contains(const IPPool *pool, uint32_t ip);
+int ip_pool_is_free(const IPPool *pool, uint32_t ip);
+uint32_t ip_pool_free_count(const IPPool *pool);
+
+// Lowest free address without taking it. Returns 0 if the pool is full.
+int ip_pool_find_free(IPPool *pool, uint32_t *ip);
+
+// Mark an address as leased. Returns 0 if it was not free, so two
+// threads taking the same address cannot both succeed.
+int ip_pool_take(IPPool *pool, uint32_t ip);
+
+// Return an address to the pool.
+void ip_pool_release(IPPool *pool, uint32_t ip);
+
+#endif
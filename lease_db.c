@@ -0,0 +1,587 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "lease_db.h"
+
+#define JOURNAL_MAGIC "DHCPJRNL"
+#define SNAPSHOT_MAGIC "DHCPSNAP"
+#define LEASE_DB_VERSION 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t generation;
+    uint64_t count; // Records that follow (snapshot only)
+} LeaseFileHeader;
+
+// A mapped snapshot or journal
+typedef struct
+{
+    void *base;
+    size_t size;
+    const LeaseRecord *records;
+    size_t count;
+} MappedFile;
+
+// Journal records for one address, in journal order
+typedef struct
+{
+    uint32_t ip;
+    uint32_t head;
+    uint32_t tail;
+    uint8_t seen; // Already folded into a snapshot record
+} ReplayEntry;
+
+static uint32_t record_checksum(const LeaseRecord *record)
+{
+    const uint8_t *p = (const uint8_t *)record;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(LeaseRecord, checksum); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static void db_path(const LeaseDB *db, char *path, size_t size, const char *name, uint64_t generation)
+{
+    if (generation)
+        snprintf(path, size, "%s/%s.%llu", db->dir, name, (unsigned long long)generation);
+    else
+        snprintf(path, size, "%s/%s", db->dir, name);
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fsync_dir(const LeaseDB *db)
+{
+    int fd = open(db->dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+// Map a file and check its header. Returns -1 if it is missing or not ours.
+static int map_file(const char *path, const char *magic, MappedFile *file, LeaseFileHeader *header)
+{
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(LeaseFileHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+
+    memcpy(header, base, sizeof(*header));
+    if (memcmp(header->magic, magic, 8) != 0 || header->version != LEASE_DB_VERSION ||
+        header->record_size != sizeof(LeaseRecord))
+    {
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    file->base = base;
+    file->size = st.st_size;
+    file->records = (const LeaseRecord *)((uint8_t *)base + sizeof(LeaseFileHeader));
+    file->count = (st.st_size - sizeof(LeaseFileHeader)) / sizeof(LeaseRecord);
+    return 0;
+}
+
+static void unmap_file(MappedFile *file)
+{
+    if (file->base != NULL)
+        munmap(file->base, file->size);
+    memset(file, 0, sizeof(*file));
+}
+
+int lease_db_open(LeaseDB *db, const char *dir)
+{
+    memset(db, 0, sizeof(*db));
+    if (strlen(dir) >= sizeof(db->dir) - 32)
+        return -1;
+    strcpy(db->dir, dir);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+
+    db->fd = -1;
+    pthread_mutex_init(&db->lock, NULL);
+    pthread_mutex_init(&db->io_lock, NULL);
+    pthread_cond_init(&db->appended, NULL);
+    pthread_cond_init(&db->committed, NULL);
+    return 0;
+}
+
+void lease_db_close(LeaseDB *db)
+{
+    if (db->writer_running)
+    {
+        pthread_mutex_lock(&db->lock);
+        db->stop = 1;
+        pthread_cond_signal(&db->appended);
+        pthread_mutex_unlock(&db->lock);
+        pthread_join(db->writer, NULL);
+    }
+    if (db->fd >= 0)
+        close(db->fd);
+    free(db->pending);
+    pthread_mutex_destroy(&db->lock);
+    pthread_mutex_destroy(&db->io_lock);
+    pthread_cond_destroy(&db->appended);
+    pthread_cond_destroy(&db->committed);
+    memset(db, 0, sizeof(*db));
+    db->fd = -1;
+}
+
+static uint32_t hash_ip(uint32_t ip)
+{
+    ip ^= ip >> 16;
+    ip *= 0x45d9f3bu;
+    ip ^= ip >> 16;
+    return ip;
+}
+
+static ReplayEntry *replay_lookup(ReplayEntry *entries, uint32_t mask, uint32_t ip)
+{
+    uint32_t i = hash_ip(ip) & mask;
+    while (entries[i].ip != 0 && entries[i].ip != ip)
+        i = (i + 1) & mask;
+    return &entries[i];
+}
+
+// Apply journal changes for one address on top of 'state'
+static int replay_fold(LeaseRecord *state, int live, const LeaseRecord **journal,
+                       const uint32_t *next, uint32_t idx)
+{
+    for (; idx != UINT32_MAX; idx = next[idx])
+    {
+        const LeaseRecord *change = journal[idx];
+        if (change->type == LEASE_DB_GRANT)
+        {
+            *state = *change;
+            live = 1;
+        }
+        else if (live && memcmp(state->key, change->key, 16) == 0)
+        {
+            if (change->type == LEASE_DB_RENEW)
+                state->lease_expiration = change->lease_expiration;
+            else if (change->type == LEASE_DB_RELEASE)
+                live = 0;
+        }
+    }
+    return live;
+}
+
+static long restore_record(LeaseStore *store, const LeaseRecord *record, time_t now)
+{
+    if (record->lease_expiration <= now)
+        return 0;
+    struct in_addr ip = {record->ip};
+    return lease_store_restore(store, ip, record->key, record->lease_start,
+                               record->lease_expiration) == LEASE_OK;
+}
+
+long lease_db_load(LeaseDB *db, LeaseStore *store, time_t now)
+{
+    char path[512];
+    LeaseFileHeader header;
+    MappedFile snapshot;
+    uint64_t generation = 1;
+
+    db_path(db, path, sizeof(path), "snapshot", 0);
+    int have_snapshot = map_file(path, SNAPSHOT_MAGIC, &snapshot, &header) == 0;
+    if (have_snapshot)
+    {
+        generation = header.generation;
+        if (header.count < snapshot.count)
+            snapshot.count = header.count;
+    }
+    db->snapshot_generation = generation;
+
+    // Map every journal written since the snapshot. A crash can leave a
+    // newer journal than the snapshot names, so keep going while they exist.
+    MappedFile *journals = NULL;
+    uint32_t njournals = 0;
+    size_t total = 0;
+    for (;; generation++)
+    {
+        MappedFile file;
+        db_path(db, path, sizeof(path), "journal", generation);
+        if (map_file(path, JOURNAL_MAGIC, &file, &header) < 0)
+            break;
+        MappedFile *grown = realloc(journals, (njournals + 1) * sizeof(MappedFile));
+        if (grown == NULL)
+        {
+            unmap_file(&file);
+            break;
+        }
+        journals = grown;
+        journals[njournals++] = file;
+        total += file.count;
+    }
+    db->generation = generation - 1;
+
+    // Index the journal by address; a torn tail ends each journal
+    const LeaseRecord **changes = malloc((total + 1) * sizeof(*changes));
+    uint32_t *next = malloc((total + 1) * sizeof(uint32_t));
+    uint32_t nbuckets = 16;
+    while (nbuckets < total * 2)
+        nbuckets <<= 1;
+    ReplayEntry *entries = calloc(nbuckets, sizeof(ReplayEntry));
+    long loaded = -1;
+    if (changes == NULL || next == NULL || entries == NULL)
+        goto out;
+
+    uint32_t nchanges = 0;
+    for (uint32_t j = 0; j < njournals; j++)
+    {
+        for (size_t i = 0; i < journals[j].count; i++)
+        {
+            const LeaseRecord *record = &journals[j].records[i];
+            if (record->checksum != record_checksum(record) || record->ip == 0)
+                break;
+            ReplayEntry *entry = replay_lookup(entries, nbuckets - 1, record->ip);
+            if (entry->ip == 0)
+            {
+                entry->ip = record->ip;
+                entry->head = nchanges;
+            }
+            else
+            {
+                next[entry->tail] = nchanges;
+            }
+            entry->tail = nchanges;
+            next[nchanges] = UINT32_MAX;
+            changes[nchanges++] = record;
+        }
+    }
+
+    // Stream the snapshot, folding in any later changes to each address
+    loaded = 0;
+    for (size_t i = 0; have_snapshot && i < snapshot.count; i++)
+    {
+        LeaseRecord state = snapshot.records[i];
+        int live = 1;
+        if (nchanges > 0)
+        {
+            ReplayEntry *entry = replay_lookup(entries, nbuckets - 1, state.ip);
+            if (entry->ip != 0)
+            {
+                entry->seen = 1;
+                live = replay_fold(&state, live, changes, next, entry->head);
+            }
+        }
+        if (live)
+            loaded += restore_record(store, &state, now);
+    }
+
+    // Addresses that only appear in the journal
+    for (uint32_t i = 0; nchanges > 0 && i < nbuckets; i++)
+    {
+        if (entries[i].ip == 0 || entries[i].seen)
+            continue;
+        LeaseRecord state;
+        if (replay_fold(&state, 0, changes, next, entries[i].head))
+            loaded += restore_record(store, &state, now);
+    }
+
+out:
+    free(changes);
+    free(next);
+    free(entries);
+    for (uint32_t j = 0; j < njournals; j++)
+        unmap_file(&journals[j]);
+    free(journals);
+    if (have_snapshot)
+        unmap_file(&snapshot);
+    return loaded;
+}
+
+static void *journal_writer(void *arg)
+{
+    LeaseDB *db = arg;
+    uint8_t *batch = NULL;
+    size_t batch_cap = 0;
+
+    pthread_mutex_lock(&db->lock);
+    for (;;)
+    {
+        while (db->pending_len == 0 && !db->stop)
+            pthread_cond_wait(&db->appended, &db->lock);
+        if (db->pending_len == 0)
+            break;
+        pthread_mutex_unlock(&db->lock);
+
+        // Everything appended while the previous sync ran goes out in
+        // one write and one fdatasync()
+        pthread_mutex_lock(&db->io_lock);
+        pthread_mutex_lock(&db->lock);
+        uint8_t *data = db->pending;
+        size_t len = db->pending_len;
+        size_t cap = db->pending_cap;
+        uint64_t seq = db->appended_seq;
+        db->pending = batch;
+        db->pending_cap = batch_cap;
+        db->pending_len = 0;
+        pthread_mutex_unlock(&db->lock);
+
+        // After a failure nothing more is written: records past a gap or a
+        // torn record would not be replayed anyway
+        int error = db->error;
+        if (error == 0 && (write_all(db->fd, data, len) < 0 || fdatasync(db->fd) < 0))
+            error = errno;
+        db->commits++;
+        pthread_mutex_unlock(&db->io_lock);
+
+        batch = data;
+        batch_cap = cap;
+        pthread_mutex_lock(&db->lock);
+        if (error == 0)
+            db->durable_seq = seq;
+        else
+            db->error = error;
+        pthread_cond_broadcast(&db->committed);
+    }
+    pthread_mutex_unlock(&db->lock);
+    free(batch);
+    return NULL;
+}
+
+int lease_db_start(LeaseDB *db)
+{
+    if (db->fd < 0)
+        return -1;
+    if (pthread_create(&db->writer, NULL, journal_writer, db) != 0)
+        return -1;
+    db->writer_running = 1;
+    return 0;
+}
+
+uint64_t lease_db_append(LeaseDB *db, uint32_t type, struct in_addr ip, const uint8_t key[16],
+                         time_t lease_start, time_t lease_expiration)
+{
+    LeaseRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.ip = ip.s_addr;
+    memcpy(record.key, key, 16);
+    record.lease_start = lease_start;
+    record.lease_expiration = lease_expiration;
+    record.checksum = record_checksum(&record);
+
+    pthread_mutex_lock(&db->lock);
+    if (db->pending_len + sizeof(record) > db->pending_cap)
+    {
+        size_t cap = db->pending_cap ? db->pending_cap * 2 : 64 * sizeof(record);
+        uint8_t *grown = realloc(db->pending, cap);
+        if (grown == NULL)
+        {
+            // The change is lost; whoever waits for it must not reply
+            db->error = ENOMEM;
+            pthread_mutex_unlock(&db->lock);
+            return UINT64_MAX;
+        }
+        db->pending = grown;
+        db->pending_cap = cap;
+    }
+    memcpy(db->pending + db->pending_len, &record, sizeof(record));
+    db->pending_len += sizeof(record);
+    uint64_t seq = ++db->appended_seq;
+    db->since_snapshot++;
+    pthread_cond_signal(&db->appended);
+    pthread_mutex_unlock(&db->lock);
+    return seq;
+}
+
+int lease_db_wait(LeaseDB *db, uint64_t seq)
+{
+    pthread_mutex_lock(&db->lock);
+    while (db->durable_seq < seq && db->error == 0 && db->writer_running)
+        pthread_cond_wait(&db->committed, &db->lock);
+    int durable = db->durable_seq >= seq;
+    int error = db->error;
+    pthread_mutex_unlock(&db->lock);
+    if (durable)
+        return 0;
+    errno = error != 0 ? error : EIO;
+    return -1;
+}
+
+uint64_t lease_db_since_snapshot(LeaseDB *db)
+{
+    pthread_mutex_lock(&db->lock);
+    uint64_t n = db->since_snapshot;
+    pthread_mutex_unlock(&db->lock);
+    return n;
+}
+
+static int open_journal(LeaseDB *db, uint64_t generation)
+{
+    char path[512];
+    db_path(db, path, sizeof(path), "journal", generation);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        return -1;
+
+    LeaseFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, 8);
+    header.version = LEASE_DB_VERSION;
+    header.record_size = sizeof(LeaseRecord);
+    header.generation = generation;
+    if (write_all(fd, &header, sizeof(header)) < 0 || fdatasync(fd) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+typedef struct
+{
+    FILE *file;
+    uint64_t count;
+    int error;
+} SnapshotWriter;
+
+static void snapshot_lease(const IPLease *lease, void *arg)
+{
+    SnapshotWriter *writer = arg;
+    LeaseRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = LEASE_DB_GRANT;
+    record.ip = lease->ip.s_addr;
+    memcpy(record.key, lease->chaddr, 16);
+    record.lease_start = lease->lease_start;
+    record.lease_expiration = lease->lease_expiration;
+    record.checksum = record_checksum(&record);
+    if (fwrite(&record, sizeof(record), 1, writer->file) != 1)
+        writer->error = 1;
+    writer->count++;
+}
+
+static int write_snapshot(LeaseDB *db, LeaseStore *store, uint64_t generation)
+{
+    char path[512], tmp[512];
+    db_path(db, path, sizeof(path), "snapshot", 0);
+    db_path(db, tmp, sizeof(tmp), "snapshot.tmp", 0);
+
+    SnapshotWriter writer = {fopen(tmp, "wb"), 0, 0};
+    if (writer.file == NULL)
+        return -1;
+    setvbuf(writer.file, NULL, _IOFBF, 1 << 20);
+
+    LeaseFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = LEASE_DB_VERSION;
+    header.record_size = sizeof(LeaseRecord);
+    header.generation = generation;
+    fwrite(&header, sizeof(header), 1, writer.file);
+    lease_store_foreach(store, snapshot_lease, &writer);
+
+    // The count is only known once every shard has been visited
+    header.count = writer.count;
+    if (fseek(writer.file, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, writer.file) != 1)
+        writer.error = 1;
+    if (fflush(writer.file) != 0 || fsync(fileno(writer.file)) < 0)
+        writer.error = 1;
+    fclose(writer.file);
+
+    if (writer.error || rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return fsync_dir(db);
+}
+
+int lease_db_snapshot(LeaseDB *db, LeaseStore *store)
+{
+    uint64_t generation = db->generation + 1;
+    int fd = open_journal(db, generation);
+    if (fd < 0)
+        return -1;
+
+    // Switch journals: whatever was appended before this point goes to the
+    // old one, everything after to the new one
+    pthread_mutex_lock(&db->io_lock);
+    pthread_mutex_lock(&db->lock);
+    uint8_t *data = db->pending;
+    size_t len = db->pending_len;
+    uint64_t seq = db->appended_seq;
+    db->pending = NULL;
+    db->pending_len = 0;
+    db->pending_cap = 0;
+    int old_fd = db->fd;
+    db->fd = fd;
+    db->generation = generation;
+    db->since_snapshot = 0;
+    pthread_mutex_unlock(&db->lock);
+
+    int error = 0;
+    if (old_fd >= 0)
+    {
+        pthread_mutex_lock(&db->lock);
+        error = db->error;
+        pthread_mutex_unlock(&db->lock);
+        if (error == 0 && len > 0 && (write_all(old_fd, data, len) < 0 || fdatasync(old_fd) < 0))
+            error = errno;
+        close(old_fd);
+    }
+    free(data);
+    pthread_mutex_lock(&db->lock);
+    if (error != 0)
+        db->error = error;
+    else if (db->durable_seq < seq)
+        db->durable_seq = seq;
+    pthread_cond_broadcast(&db->committed);
+    pthread_mutex_unlock(&db->lock);
+    pthread_mutex_unlock(&db->io_lock);
+
+    if (write_snapshot(db, store, generation) < 0)
+        return -1;
+
+    // The snapshot covers every journal before the new one
+    char path[512];
+    for (uint64_t g = db->snapshot_generation; g < generation; g++)
+    {
+        db_path(db, path, sizeof(path), "journal", g);
+        unlink(path);
+    }
+    db->snapshot_generation = generation;
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef LEASE_DB_H
+#define LEASE_DB_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "lease_store.h"
+
+#define LEASE_DB_GRANT 1
+#define LEASE_DB_RENEW 2
+#define LEASE_DB_RELEASE 3
+
+// On-disk record, shared by the journal and the snapshot
+typedef struct
+{
+    uint32_t type;
+    uint32_t ip; // Network byte order
+    uint8_t key[16];
+    int64_t lease_start;
+    int64_t lease_expiration;
+    uint32_t checksum;
+    uint32_t reserved;
+} LeaseRecord;
+
+// Persistent lease state: compact snapshots of every active lease plus
+// an append-only journal of the changes made since. Appends are buffered
+// and a writer thread commits them in groups, one fdatasync() per group,
+// so concurrent handlers share the cost of each sync.
+typedef struct
+{
+    char dir[256];
+    int fd;              // Current journal
+    uint64_t generation;          // Suffix of the current journal file
+    uint64_t snapshot_generation; // First journal not covered by the snapshot
+
+    pthread_mutex_t lock;
+    pthread_cond_t appended;
+    pthread_cond_t committed;
+    uint8_t *pending; // Records not yet handed to the writer
+    size_t pending_len;
+    size_t pending_cap;
+    uint64_t appended_seq;
+    uint64_t durable_seq;
+    uint64_t since_snapshot; // Records in the journal since the last snapshot
+    int error; // errno of the first failed append, write or sync; sticky
+    int stop;
+
+    pthread_mutex_t io_lock; // Held while writing to the journal
+    pthread_t writer;
+    int writer_running;
+
+    uint64_t commits; // fdatasync() calls
+} LeaseDB;
+
+int lease_db_open(LeaseDB *db, const char *dir);
+void lease_db_close(LeaseDB *db);
+
+// Rebuild 'store' from the snapshot and every journal after it, skipping
+// leases that expired before 'now'. Returns the number of leases loaded.
+long lease_db_load(LeaseDB *db, LeaseStore *store, time_t now);
+
+// Start the journal writer. Call after lease_db_load().
+int lease_db_start(LeaseDB *db);
+
+// Queue a change and return its sequence number. A change that cannot
+// be queued sets the error, and waiting for it fails.
+uint64_t lease_db_append(LeaseDB *db, uint32_t type, struct in_addr ip, const uint8_t key[16],
+                         time_t lease_start, time_t lease_expiration);
+
+// Block until every change up to 'seq' is on disk. Returns -1 with errno
+// set if it never will: once a write or sync fails, nothing later is
+// reported durable, since the journal may have a gap or a torn record.
+// The error lasts until the server restarts.
+int lease_db_wait(LeaseDB *db, uint64_t seq);
+
+// Write a snapshot of 'store' and start a new journal, removing the old
+// ones. Changes made while the snapshot is written land in the new
+// journal, and replaying them over the snapshot is idempotent.
+int lease_db_snapshot(LeaseDB *db, LeaseStore *store);
+
+uint64_t lease_db_since_snapshot(LeaseDB *db);
+
+#endif
@@ -0,0 +1,481 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "lease_store.h"
+
+int lease_store_init(LeaseStore *store, uint32_t first, uint32_t last, uint32_t nshards, time_t now)
+{
+    IPRange range = {first, last};
+    return lease_store_init_ranges(store, &range, 1, nshards, now);
+}
+
+int lease_store_init_ranges(LeaseStore *store, const IPRange *ranges, uint32_t nranges,
+                            uint32_t nshards, time_t now)
+{
+    memset(store, 0, sizeof(*store));
+    if (nshards == 0 || nshards > LEASE_SHARDS_MAX || (nshards & (nshards - 1)) != 0)
+        return -1;
+    if (nranges == 0)
+        return -1;
+    for (uint32_t i = 1; i < nranges; i++)
+    {
+        if (ranges[i].first <= ranges[i - 1].last)
+            return -1;
+    }
+
+    store->pools = calloc(nranges, sizeof(IPPool));
+    if (store->pools == NULL)
+        return -1;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < nranges; i++)
+    {
+        if (ip_pool_init(&store->pools[i], ranges[i].first, ranges[i].last) < 0)
+        {
+            lease_store_destroy(store);
+            return -1;
+        }
+        store->npools++;
+        total += store->pools[i].size;
+    }
+
+    store->shards = aligned_alloc(64, nshards * sizeof(LeaseShard));
+    if (store->shards == NULL)
+    {
+        lease_store_destroy(store);
+        return -1;
+    }
+
+    // Size the tables for the leases likely to be active, not for the
+    // whole pool: a /8 would otherwise cost hundreds of megabytes of
+    // buckets up front. The tables double as they fill.
+    uint32_t expected = total < LEASE_STORE_EXPECTED ? (uint32_t)total : LEASE_STORE_EXPECTED;
+    uint32_t per_shard = expected / nshards + 1;
+    for (uint32_t i = 0; i < nshards; i++)
+    {
+        LeaseShard *shard = &store->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        histogram_init(&shard->lock_wait);
+        timer_wheel_init(&shard->timers, now);
+        timer_wheel_init(&shard->offer_timers, now);
+        if (lease_table_init(&shard->table, per_shard) < 0)
+        {
+            pthread_mutex_destroy(&shard->lock);
+            lease_store_destroy(store);
+            return -1;
+        }
+        if (lease_table_init(&shard->offers, 16) < 0)
+        {
+            lease_table_destroy(&shard->table);
+            pthread_mutex_destroy(&shard->lock);
+            lease_store_destroy(store);
+            return -1;
+        }
+        store->nshards++;
+    }
+    return 0;
+}
+
+void lease_store_destroy(LeaseStore *store)
+{
+    for (uint32_t i = 0; i < store->nshards; i++)
+    {
+        lease_table_destroy(&store->shards[i].table);
+        lease_table_destroy(&store->shards[i].offers);
+        pthread_mutex_destroy(&store->shards[i].lock);
+    }
+    free(store->shards);
+    for (uint32_t i = 0; i < store->npools; i++)
+        ip_pool_destroy(&store->pools[i]);
+    free(store->pools);
+    memset(store, 0, sizeof(*store));
+}
+
+// Lock a shard, timing the wait only when the lock is contended. The
+// sample is recorded while the lock is held, so the histogram needs no
+// synchronization of its own.
+static void shard_lock(LeaseShard *shard)
+{
+    if (pthread_mutex_trylock(&shard->lock) == 0)
+    {
+        histogram_record(&shard->lock_wait, 0);
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&shard->lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    histogram_record(&shard->lock_wait, (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec);
+}
+
+LeaseShard *lease_store_shard(LeaseStore *store, const uint8_t chaddr[16])
+{
+    // Top bits pick the shard; the table buckets use the low bits
+    uint32_t h = lease_hash_mac(chaddr);
+    return &store->shards[(h >> 26) & (store->nshards - 1)];
+}
+
+IPPool *lease_store_pool(LeaseStore *store, struct in_addr ip)
+{
+    uint32_t addr = ntohl(ip.s_addr);
+    uint32_t lo = 0, hi = store->npools;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (addr < store->pools[mid].first)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    // lo is the first pool starting past addr
+    if (lo == 0 || !ip_pool_contains(&store->pools[lo - 1], addr))
+        return NULL;
+    return &store->pools[lo - 1];
+}
+
+int lease_store_in_range(LeaseStore *store, struct in_addr ip)
+{
+    return lease_store_pool(store, ip) != NULL;
+}
+
+int lease_store_find_free_in(LeaseStore *store, uint32_t first_pool, uint32_t npools, struct in_addr *ip)
+{
+    for (uint32_t i = first_pool; i < first_pool + npools && i < store->npools; i++)
+    {
+        uint32_t free_ip;
+        if (ip_pool_find_free(&store->pools[i], &free_ip))
+        {
+            ip->s_addr = htonl(free_ip);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int lease_store_find_free(LeaseStore *store, struct in_addr *ip)
+{
+    return lease_store_find_free_in(store, 0, store->npools, ip);
+}
+
+int lease_store_exclude(LeaseStore *store, struct in_addr ip)
+{
+    IPPool *pool = lease_store_pool(store, ip);
+    if (pool == NULL)
+        return LEASE_OUT_OF_RANGE;
+    return ip_pool_take(pool, ntohl(ip.s_addr)) ? LEASE_OK : LEASE_TAKEN;
+}
+
+void lease_store_usage(LeaseStore *store, uint64_t *size, uint64_t *free_count)
+{
+    *size = 0;
+    *free_count = 0;
+    for (uint32_t i = 0; i < store->npools; i++)
+    {
+        *size += store->pools[i].size;
+        *free_count += ip_pool_free_count(&store->pools[i]);
+    }
+}
+
+// Return an address to whichever pool holds it
+static void release_address(LeaseStore *store, struct in_addr ip)
+{
+    IPPool *pool = lease_store_pool(store, ip);
+    if (pool != NULL)
+        ip_pool_release(pool, ntohl(ip.s_addr));
+}
+
+// Drop a pending offer; the caller decides what happens to its address
+static void remove_offer(LeaseShard *shard, IPLease *offer)
+{
+    timer_wheel_cancel(&shard->offer_timers, &offer->timer);
+    lease_table_remove(&shard->offers, offer);
+}
+
+int lease_store_offer(LeaseStore *store, uint32_t first_pool, uint32_t npools, const uint8_t chaddr[16],
+                      time_t now, uint32_t ttl, struct in_addr *ip)
+{
+    LeaseShard *shard = lease_store_shard(store, chaddr);
+    shard_lock(shard);
+
+    IPLease *offer = lease_table_find_mac(&shard->offers, chaddr);
+    if (offer != NULL)
+    {
+        IPPool *pool = lease_store_pool(store, offer->ip);
+        if (pool != NULL && (uint32_t)(pool - store->pools) - first_pool < npools)
+        {
+            // Same client again (retransmit or new exchange): same address
+            offer->lease_expiration = now + ttl;
+            timer_wheel_schedule(&shard->offer_timers, &offer->timer, offer->lease_expiration);
+            *ip = offer->ip;
+            pthread_mutex_unlock(&shard->lock);
+            return LEASE_OK;
+        }
+        // The client moved to another subnet
+        struct in_addr old = offer->ip;
+        remove_offer(shard, offer);
+        release_address(store, old);
+    }
+
+    // A client that still holds a lease here (it rebooted without
+    // INIT-REBOOT) gets the same address back; its REQUEST then extends
+    // the lease instead of adding a second one
+    IPLease *held = lease_table_find_mac(&shard->table, chaddr);
+    if (held != NULL)
+    {
+        IPPool *pool = lease_store_pool(store, held->ip);
+        if (pool != NULL && (uint32_t)(pool - store->pools) - first_pool < npools)
+        {
+            *ip = held->ip;
+            pthread_mutex_unlock(&shard->lock);
+            return LEASE_OK;
+        }
+    }
+
+    // Another thread may take the address between the search and the
+    // take; search again rather than offering it twice
+    do
+    {
+        if (!lease_store_find_free_in(store, first_pool, npools, ip))
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return LEASE_EXHAUSTED;
+        }
+    } while (!ip_pool_take(lease_store_pool(store, *ip), ntohl(ip->s_addr)));
+
+    offer = lease_table_insert(&shard->offers, *ip, chaddr, now, now + ttl);
+    if (offer != NULL)
+        timer_wheel_schedule(&shard->offer_timers, &offer->timer, offer->lease_expiration);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (offer == NULL)
+    {
+        release_address(store, *ip);
+        return LEASE_NO_MEMORY;
+    }
+    return LEASE_OK;
+}
+
+uint32_t lease_store_offer_count(LeaseStore *store)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < store->nshards; i++)
+    {
+        LeaseShard *shard = &store->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        count += shard->offers.count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return count;
+}
+
+static int insert_lease(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16],
+                        time_t lease_start, time_t lease_expiration)
+{
+    IPPool *pool = lease_store_pool(store, ip);
+    if (pool == NULL)
+        return LEASE_OUT_OF_RANGE;
+
+    LeaseShard *shard = lease_store_shard(store, chaddr);
+    shard_lock(shard);
+
+    // The address offered to this client is already taken from the pool
+    // on its behalf: O(1) by chaddr, no second pool update
+    IPLease *offer = lease_table_find(&shard->offers, ip, chaddr);
+    if (offer != NULL)
+    {
+        remove_offer(shard, offer);
+    }
+    else if (!ip_pool_take(pool, ntohl(ip.s_addr)))
+    {
+        // A repeated REQUEST for an address the client already holds
+        // (its ACK was lost) extends the lease instead of failing
+        IPLease *held = lease_table_find(&shard->table, ip, chaddr);
+        if (held != NULL)
+        {
+            held->lease_expiration = lease_expiration;
+            timer_wheel_schedule(&shard->timers, &held->timer, held->lease_expiration);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return held != NULL ? LEASE_OK : LEASE_TAKEN;
+    }
+
+    IPLease *lease = lease_table_insert(&shard->table, ip, chaddr, lease_start, lease_expiration);
+    if (lease != NULL)
+        timer_wheel_schedule(&shard->timers, &lease->timer, lease->lease_expiration);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (lease == NULL)
+    {
+        ip_pool_release(pool, ntohl(ip.s_addr));
+        return LEASE_NO_MEMORY;
+    }
+    return LEASE_OK;
+}
+
+int lease_store_grant(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16], time_t now, uint32_t lease_time)
+{
+    return insert_lease(store, ip, chaddr, now, now + lease_time);
+}
+
+int lease_store_restore(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16],
+                        time_t lease_start, time_t lease_expiration)
+{
+    return insert_lease(store, ip, chaddr, lease_start, lease_expiration);
+}
+
+int lease_store_renew(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16], time_t now, uint32_t lease_time)
+{
+    LeaseShard *shard = lease_store_shard(store, chaddr);
+    shard_lock(shard);
+    IPLease *lease = lease_table_find(&shard->table, ip, chaddr);
+    if (lease != NULL)
+    {
+        lease->lease_expiration = now + lease_time;
+        timer_wheel_schedule(&shard->timers, &lease->timer, lease->lease_expiration);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return lease != NULL ? LEASE_OK : LEASE_NOT_FOUND;
+}
+
+int lease_store_release(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16])
+{
+    LeaseShard *shard = lease_store_shard(store, chaddr);
+    shard_lock(shard);
+    IPLease *lease = lease_table_find(&shard->table, ip, chaddr);
+    if (lease != NULL)
+    {
+        timer_wheel_cancel(&shard->timers, &lease->timer);
+        lease_table_remove(&shard->table, lease);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (lease == NULL)
+        return LEASE_NOT_FOUND;
+    release_address(store, ip);
+    return LEASE_OK;
+}
+
+void lease_store_decline_key(struct in_addr ip, uint8_t key[16])
+{
+    memset(key, 0xff, 12);
+    memcpy(key + 12, &ip.s_addr, 4);
+}
+
+int lease_store_decline(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16], time_t now, uint32_t ttl)
+{
+    IPPool *pool = lease_store_pool(store, ip);
+    if (pool == NULL)
+        return LEASE_OUT_OF_RANGE;
+
+    LeaseShard *shard = lease_store_shard(store, chaddr);
+    shard_lock(shard);
+    IPLease *lease = lease_table_find(&shard->table, ip, chaddr);
+    if (lease != NULL)
+    {
+        timer_wheel_cancel(&shard->timers, &lease->timer);
+        lease_table_remove(&shard->table, lease);
+    }
+    else if ((lease = lease_table_find(&shard->offers, ip, chaddr)) != NULL)
+    {
+        remove_offer(shard, lease);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (lease == NULL)
+        return LEASE_NOT_FOUND;
+
+    // The pool bit was never cleared, so nobody can take the address
+    // while it changes owner
+    uint8_t key[16];
+    lease_store_decline_key(ip, key);
+    shard = lease_store_shard(store, key);
+    shard_lock(shard);
+    lease = lease_table_insert(&shard->table, ip, key, now, now + ttl);
+    if (lease != NULL)
+        timer_wheel_schedule(&shard->timers, &lease->timer, lease->lease_expiration);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (lease == NULL)
+    {
+        ip_pool_release(pool, ntohl(ip.s_addr));
+        return LEASE_NO_MEMORY;
+    }
+    return LEASE_OK;
+}
+
+typedef struct
+{
+    LeaseStore *store;
+    LeaseShard *shard;
+    lease_fn fn;
+    void *arg;
+    uint32_t expired;
+} ExpireContext;
+
+static void expire_one(TimerEntry *entry, void *arg)
+{
+    ExpireContext *ctx = arg;
+    IPLease *lease = timer_container_of(entry, IPLease, timer);
+    if (ctx->fn != NULL)
+        ctx->fn(lease, ctx->arg);
+    release_address(ctx->store, lease->ip);
+    lease_table_remove(&ctx->shard->table, lease);
+    ctx->expired++;
+}
+
+// An offer nobody requested in time: the address goes back to the pool
+static void expire_offer(TimerEntry *entry, void *arg)
+{
+    ExpireContext *ctx = arg;
+    IPLease *offer = timer_container_of(entry, IPLease, timer);
+    release_address(ctx->store, offer->ip);
+    lease_table_remove(&ctx->shard->offers, offer);
+}
+
+uint32_t lease_store_expire(LeaseStore *store, time_t now, int budget, lease_fn fn, void *arg)
+{
+    ExpireContext ctx = {store, NULL, fn, arg, 0};
+    for (uint32_t i = 0; i < store->nshards; i++)
+    {
+        ctx.shard = &store->shards[i];
+        // Each lock hold advances a single wheel, so it stays within
+        // 'budget' units of work: leases first, then offers
+        int leases = 1, offers = 1;
+        while (leases || offers)
+        {
+            shard_lock(ctx.shard);
+            if (leases)
+                leases = timer_wheel_advance(&ctx.shard->timers, now, budget, expire_one, &ctx);
+            else
+                offers = timer_wheel_advance(&ctx.shard->offer_timers, now, budget, expire_offer, &ctx);
+            pthread_mutex_unlock(&ctx.shard->lock);
+        }
+    }
+    return ctx.expired;
+}
+
+void lease_store_foreach(LeaseStore *store, lease_fn fn, void *arg)
+{
+    for (uint32_t i = 0; i < store->nshards; i++)
+    {
+        LeaseShard *shard = &store->shards[i];
+        shard_lock(shard);
+        for (uint32_t j = 0; j < shard->table.used; j++)
+        {
+            IPLease *lease = lease_table_slot(&shard->table, j);
+            if (lease->in_use)
+                fn(lease, arg);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void lease_store_lock_wait(LeaseStore *store, Histogram *into)
+{
+    for (uint32_t i = 0; i < store->nshards; i++)
+    {
+        LeaseShard *shard = &store->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        histogram_merge(into, &shard->lock_wait);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
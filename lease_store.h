@@ -0,0 +1,132 @@
+#ifndef LEASE_STORE_H
+#define LEASE_STORE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "histogram.h"
+#include "ip_pool.h"
+#include "lease_table.h"
+#include "timer_wheel.h"
+
+#define LEASE_SHARDS 16
+#define LEASE_SHARDS_MAX 64
+#define LEASE_STORE_EXPECTED 65536 // Initial table size; tables grow past it
+
+#define LEASE_OK 0
+#define LEASE_OUT_OF_RANGE -1
+#define LEASE_TAKEN -2
+#define LEASE_NOT_FOUND -3
+#define LEASE_NO_MEMORY -4
+#define LEASE_EXHAUSTED -5
+
+// One partition of the lease state. Clients map to a shard by chaddr
+// hash, so handlers for different clients rarely share a lock.
+typedef struct
+{
+    pthread_mutex_t lock;
+    LeaseTable table;
+    TimerWheel timers;
+    LeaseTable offers;       // Addresses offered and held until REQUEST or TTL
+    TimerWheel offer_timers;
+    Histogram lock_wait; // Nanoseconds waited per acquisition, 0 if uncontended
+} __attribute__((aligned(64))) LeaseShard;
+
+// Inclusive address range, host byte order
+typedef struct
+{
+    uint32_t first;
+    uint32_t last;
+} IPRange;
+
+// Sharded lease state. Address ownership is decided by the atomic pool
+// bitmaps, which every shard shares, so two shards can never grant the
+// same address. There is one pool per configured range, sorted by
+// address, so the pool owning an address is found by binary search.
+typedef struct
+{
+    IPPool *pools;
+    uint32_t npools;
+    uint32_t nshards;
+    LeaseShard *shards;
+} LeaseStore;
+
+typedef void (*lease_fn)(const IPLease *lease, void *arg);
+
+int lease_store_init(LeaseStore *store, uint32_t first, uint32_t last, uint32_t nshards, time_t now);
+
+// 'ranges' must be sorted and must not overlap
+int lease_store_init_ranges(LeaseStore *store, const IPRange *ranges, uint32_t nranges,
+                            uint32_t nshards, time_t now);
+void lease_store_destroy(LeaseStore *store);
+
+LeaseShard *lease_store_shard(LeaseStore *store, const uint8_t chaddr[16]);
+int lease_store_in_range(LeaseStore *store, struct in_addr ip);
+
+// Pool holding 'ip', or NULL
+IPPool *lease_store_pool(LeaseStore *store, struct in_addr ip);
+
+// Lowest free address, without reserving it
+int lease_store_find_free(LeaseStore *store, struct in_addr *ip);
+
+// Same, limited to pools [first_pool, first_pool + npools)
+int lease_store_find_free_in(LeaseStore *store, uint32_t first_pool, uint32_t npools, struct in_addr *ip);
+
+// Take an address out of the pools for good (a static reservation).
+// LEASE_OUT_OF_RANGE if no pool holds it, LEASE_TAKEN if already taken.
+int lease_store_exclude(LeaseStore *store, struct in_addr ip);
+
+// Addresses in every pool, and how many of them are free
+void lease_store_usage(LeaseStore *store, uint64_t *size, uint64_t *free_count);
+
+// Reserve an address in pools [first_pool, first_pool + npools) for an
+// OFFER, held for 'ttl' seconds. The reservation is taken from the pool
+// bitmap like a lease, so concurrent DISCOVERs never get the same
+// address. A client has at most one pending offer: asking again returns
+// the same address with a fresh TTL. A client already holding a lease in
+// those pools is offered that address, with nothing reserved. Returns LEASE_OK, LEASE_EXHAUSTED
+// or LEASE_NO_MEMORY.
+int lease_store_offer(LeaseStore *store, uint32_t first_pool, uint32_t npools, const uint8_t chaddr[16],
+                      time_t now, uint32_t ttl, struct in_addr *ip);
+
+// Pending offers across every shard
+uint32_t lease_store_offer_count(LeaseStore *store);
+
+// Each returns LEASE_OK or one of the LEASE_* error codes. A grant for
+// the address offered to the same client turns the reservation into the
+// lease; a grant for an address the client already holds extends it.
+int lease_store_grant(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16], time_t now, uint32_t lease_time);
+int lease_store_renew(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16], time_t now, uint32_t lease_time);
+int lease_store_release(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16]);
+
+// Key that owns a declined address while it is quarantined: the address
+// in the last four bytes behind a marker no hardware address or client
+// identifier uses, so quarantined addresses spread over the shards
+void lease_store_decline_key(struct in_addr ip, uint8_t key[16]);
+
+// The client found 'ip' in use on the network (DHCPDECLINE). Its lease or
+// pending offer is dropped, but the address stays out of the pool, held
+// by lease_store_decline_key() until 'now + ttl' and then expired like
+// any lease. Returns LEASE_OK, LEASE_OUT_OF_RANGE, LEASE_NOT_FOUND if the
+// client holds no such address, or LEASE_NO_MEMORY.
+int lease_store_decline(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16], time_t now, uint32_t ttl);
+
+// Insert a lease with explicit times, as read back from persistent storage
+int lease_store_restore(LeaseStore *store, struct in_addr ip, const uint8_t chaddr[16],
+                        time_t lease_start, time_t lease_expiration);
+
+// Expire every lease and pending offer due at 'now'. Each shard lock is
+// held for at most 'budget' expirations (or cascades) at a time. 'fn' (may be NULL) sees each lease
+// just before it is removed (offers are not reported). Returns the
+// number of leases expired.
+uint32_t lease_store_expire(LeaseStore *store, time_t now, int budget, lease_fn fn, void *arg);
+
+// Visit every active lease, one shard lock at a time
+void lease_store_foreach(LeaseStore *store, lease_fn fn, void *arg);
+
+// Add the lock wait times of every shard to 'into'
+void lease_store_lock_wait(LeaseStore *store, Histogram *into);
+
+#endif
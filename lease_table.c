@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lease_table.h"
+
+static uint32_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+uint32_t lease_hash_mac(const uint8_t chaddr[16])
+{
+    uint64_t a, b;
+    memcpy(&a, chaddr, 8);
+    memcpy(&b, chaddr + 8, 8);
+    return mix64(a ^ (b * UINT64_C(0x9e3779b97f4a7c15)));
+}
+
+static uint32_t hash_ip(struct in_addr ip)
+{
+    return mix64(ip.s_addr);
+}
+
+static int alloc_buckets(LeaseTable *table, uint32_t nbuckets)
+{
+    uint32_t *mac = malloc(nbuckets * sizeof(uint32_t));
+    uint32_t *ip = malloc(nbuckets * sizeof(uint32_t));
+    if (mac == NULL || ip == NULL)
+    {
+        free(mac);
+        free(ip);
+        return -1;
+    }
+    memset(mac, 0xff, nbuckets * sizeof(uint32_t));
+    memset(ip, 0xff, nbuckets * sizeof(uint32_t));
+
+    free(table->mac_buckets);
+    free(table->ip_buckets);
+    table->mac_buckets = mac;
+    table->ip_buckets = ip;
+    table->bucket_mask = nbuckets - 1;
+    return 0;
+}
+
+static void link_slot(LeaseTable *table, uint32_t idx)
+{
+    IPLease *lease = lease_table_slot(table, idx);
+    uint32_t mb = lease_hash_mac(lease->chaddr) & table->bucket_mask;
+    uint32_t ib = hash_ip(lease->ip) & table->bucket_mask;
+    lease->next_mac = table->mac_buckets[mb];
+    table->mac_buckets[mb] = idx;
+    lease->next_ip = table->ip_buckets[ib];
+    table->ip_buckets[ib] = idx;
+}
+
+static int grow_buckets(LeaseTable *table)
+{
+    if (alloc_buckets(table, (table->bucket_mask + 1) * 2) < 0)
+        return -1;
+    for (uint32_t i = 0; i < table->used; i++)
+    {
+        if (lease_table_slot(table, i)->in_use)
+            link_slot(table, i);
+    }
+    return 0;
+}
+
+int lease_table_init(LeaseTable *table, uint32_t expected)
+{
+    memset(table, 0, sizeof(*table));
+    table->free_head = LEASE_NONE;
+
+    uint32_t nbuckets = 16;
+    while (nbuckets < expected && nbuckets < (UINT32_C(1) << 31))
+        nbuckets <<= 1;
+    return alloc_buckets(table, nbuckets);
+}
+
+void lease_table_destroy(LeaseTable *table)
+{
+    for (uint32_t i = 0; i < table->nchunks; i++)
+        free(table->chunks[i]);
+    free(table->chunks);
+    free(table->mac_buckets);
+    free(table->ip_buckets);
+    memset(table, 0, sizeof(*table));
+}
+
+IPLease *lease_table_find_ip(LeaseTable *table, struct in_addr ip)
+{
+    uint32_t idx = table->ip_buckets[hash_ip(ip) & table->bucket_mask];
+    while (idx != LEASE_NONE)
+    {
+        IPLease *lease = lease_table_slot(table, idx);
+        if (lease->ip.s_addr == ip.s_addr)
+            return lease;
+        idx = lease->next_ip;
+    }
+    return NULL;
+}
+
+IPLease *lease_table_find(LeaseTable *table, struct in_addr ip, const uint8_t chaddr[16])
+{
+    IPLease *lease = lease_table_find_ip(table, ip);
+    if (lease != NULL && memcmp(lease->chaddr, chaddr, 16) == 0)
+        return lease;
+    return NULL;
+}
+
+IPLease *lease_table_find_mac(LeaseTable *table, const uint8_t chaddr[16])
+{
+    uint32_t idx = table->mac_buckets[lease_hash_mac(chaddr) & table->bucket_mask];
+    while (idx != LEASE_NONE)
+    {
+        IPLease *lease = lease_table_slot(table, idx);
+        if (memcmp(lease->chaddr, chaddr, 16) == 0)
+            return lease;
+        idx = lease->next_mac;
+    }
+    return NULL;
+}
+
+IPLease *lease_table_insert(LeaseTable *table, struct in_addr ip, const uint8_t chaddr[16],
+                            time_t lease_start, time_t lease_expiration)
+{
+    if (table->count >= table->bucket_mask + 1 && grow_buckets(table) < 0)
+        return NULL;
+
+    uint32_t idx = table->free_head;
+    if (idx != LEASE_NONE)
+    {
+        table->free_head = lease_table_slot(table, idx)->next_mac;
+    }
+    else
+    {
+        if (table->used == table->capacity)
+        {
+            IPLease **chunks = realloc(table->chunks, (table->nchunks + 1) * sizeof(IPLease *));
+            if (chunks == NULL)
+                return NULL;
+            table->chunks = chunks;
+            chunks[table->nchunks] = malloc(LEASE_CHUNK_SIZE * sizeof(IPLease));
+            if (chunks[table->nchunks] == NULL)
+                return NULL;
+            table->nchunks++;
+            table->capacity += LEASE_CHUNK_SIZE;
+        }
+        idx = table->used++;
+    }
+
+    IPLease *lease = lease_table_slot(table, idx);
+    lease->ip = ip;
+    lease->lease_start = lease_start;
+    lease->lease_expiration = lease_expiration;
+    memcpy(lease->chaddr, chaddr, 16);
+    lease->in_use = 1;
+    timer_entry_init(&lease->timer);
+    link_slot(table, idx);
+    table->count++;
+    return lease;
+}
+
+void lease_table_remove(LeaseTable *table, IPLease *lease)
+{
+    // Find the slot index through the chaddr chain that must contain it
+    uint32_t *link = &table->mac_buckets[lease_hash_mac(lease->chaddr) & table->bucket_mask];
+    while (lease_table_slot(table, *link) != lease)
+        link = &lease_table_slot(table, *link)->next_mac;
+    uint32_t idx = *link;
+    *link = lease->next_mac;
+
+    link = &table->ip_buckets[hash_ip(lease->ip) & table->bucket_mask];
+    while (*link != idx)
+        link = &lease_table_slot(table, *link)->next_ip;
+    *link = lease->next_ip;
+
+    lease->in_use = 0;
+    lease->next_mac = table->free_head;
+    table->free_head = idx;
+    table->count--;
+}
@@ -0,0 +1,61 @@
+#ifndef LEASE_TABLE_H
+#define LEASE_TABLE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "timer_wheel.h"
+
+#define LEASE_NONE UINT32_MAX
+#define LEASE_CHUNK_SHIFT 12
+#define LEASE_CHUNK_SIZE (1u << LEASE_CHUNK_SHIFT)
+
+typedef struct
+{
+    struct in_addr ip;
+    time_t lease_start;
+    time_t lease_expiration;
+    uint8_t chaddr[16];
+    TimerEntry timer;  // Expiry timer, linked while the lease is active
+    uint32_t next_mac; // Next slot in the same chaddr bucket (or free list)
+    uint32_t next_ip;  // Next slot in the same IP bucket
+    uint8_t in_use;
+} IPLease;
+
+// Lease store: slots live in fixed-size chunks so they never move, and
+// two chained hash indexes (chaddr and IP) point into them, so every
+// lookup is O(1).
+typedef struct
+{
+    IPLease **chunks;
+    uint32_t nchunks;
+    uint32_t capacity;  // Slots allocated
+    uint32_t used;      // Slots ever handed out (high-water mark)
+    uint32_t count;     // Live leases
+    uint32_t free_head; // Recycled slots
+    uint32_t *mac_buckets;
+    uint32_t *ip_buckets;
+    uint32_t bucket_mask;
+} LeaseTable;
+
+int lease_table_init(LeaseTable *table, uint32_t expected);
+void lease_table_destroy(LeaseTable *table);
+
+uint32_t lease_hash_mac(const uint8_t chaddr[16]);
+
+IPLease *lease_table_find_ip(LeaseTable *table, struct in_addr ip);
+IPLease *lease_table_find(LeaseTable *table, struct in_addr ip, const uint8_t chaddr[16]);
+IPLease *lease_table_find_mac(LeaseTable *table, const uint8_t chaddr[16]);
+
+static inline IPLease *lease_table_slot(const LeaseTable *table, uint32_t idx)
+{
+    return &table->chunks[idx >> LEASE_CHUNK_SHIFT][idx & (LEASE_CHUNK_SIZE - 1)];
+}
+
+// Returned pointers stay valid until the lease is removed.
+IPLease *lease_table_insert(LeaseTable *table, struct in_addr ip, const uint8_t chaddr[16],
+                            time_t lease_start, time_t lease_expiration);
+void lease_table_remove(LeaseTable *table, IPLease *lease);
+
+#endif
@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "dhcp.h"
+#include "dhcp_options.h"
+#include "histogram.h"
+#include "loadgen.h"
+
+#define LOADGEN_BUFFER 1024
+#define TIMEOUT_SCAN_NS 10000000 // Check for lost replies every 10 ms
+#define MAX_BURST 256            // Messages sent per loop iteration
+
+const char *loadgen_type_names[LOADGEN_TYPES] = {"DISCOVER", "REQUEST", "RENEW", "RELEASE"};
+
+// Virtual client states. INIT, OFFERED and BOUND clients wait in the
+// ready queue for their next send; the others wait for a reply.
+enum
+{
+    VC_INIT,
+    VC_SELECTING,
+    VC_OFFERED,
+    VC_REQUESTING,
+    VC_BOUND,
+    VC_RENEWING
+};
+
+typedef struct
+{
+    uint8_t state;
+    uint32_t renewals_left;
+    uint32_t xid;
+    uint32_t yiaddr;
+    struct in_addr server_id;
+    struct sockaddr_in server; // Server that made the offer, for renewals
+    uint64_t sent_ns;
+    uint64_t discover_ns; // Start of the current acquisition
+} VirtualClient;
+
+typedef struct
+{
+    const LoadgenConfig *config;
+    int sockfd;
+    VirtualClient *clients;
+    uint32_t *ready; // Ring of client indexes, one slot per client
+    uint32_t ready_head;
+    uint32_t ready_count;
+    uint32_t next_xid;
+    LoadgenResult *result;
+} Loadgen;
+
+static const uint8_t parameter_list[] = {DHO_SUBNET_MASK, DHO_ROUTER, DHO_DNS_SERVER};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void push_ready(Loadgen *lg, uint32_t idx)
+{
+    uint32_t n = lg->config->clients;
+    lg->ready[(lg->ready_head + lg->ready_count) % n] = idx;
+    lg->ready_count++;
+}
+
+static uint32_t pop_ready(Loadgen *lg)
+{
+    uint32_t idx = lg->ready[lg->ready_head];
+    lg->ready_head = (lg->ready_head + 1) % lg->config->clients;
+    lg->ready_count--;
+    return idx;
+}
+
+// Locally administered MAC 02:00:<index>
+static void client_mac(uint32_t idx, uint8_t chaddr[16])
+{
+    memset(chaddr, 0, 16);
+    chaddr[0] = 0x02;
+    uint32_t be = htonl(idx);
+    memcpy(&chaddr[2], &be, 4);
+}
+
+// Send the next message of client 'idx'. Returns -1 if the socket is full.
+static int send_next(Loadgen *lg, uint32_t idx)
+{
+    VirtualClient *vc = &lg->clients[idx];
+    const struct sockaddr_in *dest = &lg->config->server;
+    DHCPMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op = 1;
+    msg.htype = 1;
+    msg.hlen = 6;
+    client_mac(idx, msg.chaddr);
+
+    int type;
+    uint8_t next_state;
+    uint8_t *p;
+    vc->xid = lg->next_xid++;
+    if (vc->state == VC_INIT)
+    {
+        type = LOADGEN_DISCOVER;
+        next_state = VC_SELECTING;
+        p = dhcp_begin_options(&msg, DHCPDISCOVER);
+        p = dhcp_put_option(p, DHO_PARAMETER_LIST, sizeof(parameter_list), parameter_list);
+        if (lg->config->rapid_commit)
+            p = dhcp_put_option(p, DHO_RAPID_COMMIT, 0, NULL);
+    }
+    else if (vc->state == VC_OFFERED)
+    {
+        type = LOADGEN_REQUEST;
+        next_state = VC_REQUESTING;
+        p = dhcp_begin_options(&msg, DHCPREQUEST);
+        p = dhcp_put_option(p, DHO_REQUESTED_IP, 4, &vc->yiaddr);
+        p = dhcp_put_option(p, DHO_SERVER_ID, 4, &vc->server_id);
+        p = dhcp_put_option(p, DHO_PARAMETER_LIST, sizeof(parameter_list), parameter_list);
+    }
+    else if (vc->renewals_left > 0)
+    {
+        type = LOADGEN_RENEW;
+        next_state = VC_RENEWING;
+        msg.ciaddr = vc->yiaddr;
+        dest = &vc->server;
+        p = dhcp_begin_options(&msg, DHCPREQUEST);
+        p = dhcp_put_option(p, DHO_PARAMETER_LIST, sizeof(parameter_list), parameter_list);
+    }
+    else
+    {
+        type = LOADGEN_RELEASE;
+        next_state = VC_INIT;
+        msg.ciaddr = vc->yiaddr;
+        p = dhcp_begin_options(&msg, DHCPRELEASE);
+        p = dhcp_put_option(p, DHO_SERVER_ID, 4, &vc->server_id);
+    }
+    *p++ = DHO_END;
+    msg.xid = htonl(vc->xid);
+
+    if (sendto(lg->sockfd, &msg, dhcp_message_length(&msg, p), 0, (const struct sockaddr *)dest, sizeof(*dest)) < 0)
+    {
+        if (errno != EAGAIN && errno != ENOBUFS)
+            perror("Error sending");
+        return -1;
+    }
+    vc->state = next_state;
+    vc->sent_ns = now_ns();
+    if (type == LOADGEN_DISCOVER)
+        vc->discover_ns = vc->sent_ns;
+    if (type == LOADGEN_DISCOVER || type == LOADGEN_REQUEST)
+        lg->result->lease_packets++;
+    lg->result->types[type].sent++;
+    lg->result->total_sent++;
+
+    // RELEASE has no reply; the client starts over right away
+    if (next_state == VC_INIT)
+        push_ready(lg, idx);
+    return 0;
+}
+
+static void handle_reply(Loadgen *lg, const uint8_t *packet, size_t len, const struct sockaddr_in *from)
+{
+    DHCPOptions opts;
+    const DHCPMessage *msg = (const DHCPMessage *)packet;
+    if (dhcp_parse_options(packet, len, &opts) < 0 || msg->op != 2)
+    {
+        lg->result->stray++;
+        return;
+    }
+
+    uint32_t idx;
+    memcpy(&idx, &msg->chaddr[2], 4);
+    idx = ntohl(idx);
+    if (idx >= lg->config->clients || lg->clients[idx].xid != ntohl(msg->xid))
+    {
+        lg->result->stray++;
+        return;
+    }
+
+    VirtualClient *vc = &lg->clients[idx];
+    int type;
+    uint8_t expected;
+    int rapid = 0;
+    if (vc->state == VC_SELECTING)
+    {
+        // With Rapid Commit the server may skip straight to the ACK
+        type = LOADGEN_DISCOVER;
+        rapid = opts.message_type == DHCPACK && dhcp_option_present(&opts, DHO_RAPID_COMMIT);
+        expected = rapid ? DHCPACK : DHCPOFFER;
+    }
+    else if (vc->state == VC_REQUESTING || vc->state == VC_RENEWING)
+    {
+        type = vc->state == VC_REQUESTING ? LOADGEN_REQUEST : LOADGEN_RENEW;
+        expected = DHCPACK;
+    }
+    else
+    {
+        lg->result->stray++;
+        return;
+    }
+
+    if (opts.message_type == DHCPNAK)
+    {
+        lg->result->types[type].naks++;
+        vc->state = VC_INIT;
+        push_ready(lg, idx);
+        return;
+    }
+    if (opts.message_type != expected)
+    {
+        lg->result->stray++;
+        return;
+    }
+
+    LoadgenTypeStats *stats = &lg->result->types[type];
+    uint64_t now = now_ns();
+    stats->replies++;
+    histogram_record(&stats->latency, now - vc->sent_ns);
+    if (type != LOADGEN_RENEW)
+        lg->result->lease_packets++;
+
+    // A lease is acquired by the ACK to the REQUEST, or to the DISCOVER
+    // with Rapid Commit
+    if (type == LOADGEN_REQUEST || rapid)
+    {
+        lg->result->leases++;
+        histogram_record(&lg->result->acquire_latency, now - vc->discover_ns);
+    }
+
+    if (vc->state == VC_SELECTING)
+    {
+        vc->yiaddr = msg->yiaddr;
+        vc->server = *from;
+        if (!dhcp_option_addr(&opts, DHO_SERVER_ID, &vc->server_id))
+            vc->server_id = from->sin_addr;
+    }
+    if (vc->state == VC_SELECTING && !rapid)
+        vc->state = VC_OFFERED;
+    else
+    {
+        vc->renewals_left = vc->state == VC_RENEWING ? vc->renewals_left - 1 : lg->config->renewals;
+        vc->state = VC_BOUND;
+    }
+    push_ready(lg, idx);
+}
+
+// Clients whose reply did not arrive in time start over from DISCOVER
+static void expire_waiting(Loadgen *lg, uint64_t now)
+{
+    uint64_t timeout = (uint64_t)lg->config->timeout_ms * 1000000;
+    for (uint32_t i = 0; i < lg->config->clients; i++)
+    {
+        VirtualClient *vc = &lg->clients[i];
+        if (vc->state != VC_SELECTING && vc->state != VC_REQUESTING && vc->state != VC_RENEWING)
+            continue;
+        if (now - vc->sent_ns < timeout)
+            continue;
+
+        int type = vc->state == VC_SELECTING ? LOADGEN_DISCOVER : vc->state == VC_REQUESTING ? LOADGEN_REQUEST : LOADGEN_RENEW;
+        lg->result->types[type].timeouts++;
+        vc->state = VC_INIT;
+        push_ready(lg, i);
+    }
+}
+
+void loadgen_print(const LoadgenConfig *config, const LoadgenResult *result)
+{
+    double seconds = result->seconds;
+    printf("\n%u clients, %.1f s, %s\n", config->clients, seconds, config->rate ? "rate-limited" : "maximum rate");
+    printf("%-9s %10s %10s %9s %7s %11s %9s %9s %9s\n",
+           "type", "sent", "replies", "timeouts", "naks", "replies/s", "p50 us", "p99 us", "p999 us");
+    for (int t = 0; t < LOADGEN_TYPES; t++)
+    {
+        const LoadgenTypeStats *s = &result->types[t];
+        printf("%-9s %10llu %10llu %9llu %7llu %11.0f %9.1f %9.1f %9.1f\n", loadgen_type_names[t],
+               (unsigned long long)s->sent, (unsigned long long)s->replies,
+               (unsigned long long)s->timeouts, (unsigned long long)s->naks,
+               (t == LOADGEN_RELEASE ? s->sent : s->replies) / seconds,
+               histogram_percentile(&s->latency, 50) / 1e3,
+               histogram_percentile(&s->latency, 99) / 1e3,
+               histogram_percentile(&s->latency, 99.9) / 1e3);
+    }
+    printf("Total %.0f messages/s sent, %llu stray replies\n", result->total_sent / seconds,
+           (unsigned long long)result->stray);
+    if (result->leases > 0)
+        printf("Leases %.0f/s, %.2f packets each, DISCOVER to ACK p50 %.1f us, p99 %.1f us\n",
+               result->leases / seconds, (double)result->lease_packets / result->leases,
+               histogram_percentile(&result->acquire_latency, 50) / 1e3,
+               histogram_percentile(&result->acquire_latency, 99) / 1e3);
+}
+
+int loadgen_run(const LoadgenConfig *config, LoadgenResult *result)
+{
+    Loadgen lg;
+    memset(&lg, 0, sizeof(lg));
+    memset(result, 0, sizeof(*result));
+    lg.config = config;
+    lg.result = result;
+    lg.clients = calloc(config->clients, sizeof(VirtualClient));
+    lg.ready = malloc(config->clients * sizeof(uint32_t));
+    if (config->clients == 0 || lg.clients == NULL || lg.ready == NULL)
+    {
+        fprintf(stderr, "Error: cannot allocate %u clients\n", config->clients);
+        return -1;
+    }
+    for (int t = 0; t < LOADGEN_TYPES; t++)
+        histogram_init(&result->types[t].latency);
+    histogram_init(&result->acquire_latency);
+
+    lg.sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (lg.sockfd < 0)
+    {
+        perror("Error creating socket");
+        return -1;
+    }
+    int enable = 1;
+    int buffer_size = 4 << 20;
+    setsockopt(lg.sockfd, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+    setsockopt(lg.sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(lg.sockfd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(config->client_port);
+    local.sin_addr.s_addr = INADDR_ANY;
+    if (bind(lg.sockfd, (struct sockaddr *)&local, sizeof(local)) < 0)
+    {
+        perror("Error binding socket");
+        close(lg.sockfd);
+        return -1;
+    }
+
+    srand(time(NULL) ^ getpid());
+    lg.next_xid = ((uint32_t)rand() << 16) | 1;
+    for (uint32_t i = 0; i < config->clients; i++)
+        push_ready(&lg, i);
+
+    uint8_t buffer[LOADGEN_BUFFER] __attribute__((aligned(8)));
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)config->duration * 1000000000;
+    uint64_t next_scan = start + TIMEOUT_SCAN_NS;
+    uint64_t now = start;
+    while (now < end)
+    {
+        // Messages allowed so far by the rate, or every ready client
+        uint64_t budget = lg.ready_count;
+        if (config->rate)
+        {
+            uint64_t allowed = (now - start) * config->rate / 1000000000 + 1;
+            budget = allowed > result->total_sent ? allowed - result->total_sent : 0;
+        }
+        if (budget > MAX_BURST)
+            budget = MAX_BURST;
+        while (budget-- > 0 && lg.ready_count > 0)
+        {
+            uint32_t idx = pop_ready(&lg);
+            if (send_next(&lg, idx) < 0)
+            {
+                push_ready(&lg, idx);
+                break;
+            }
+        }
+
+        int busy = lg.ready_count > 0 && !config->rate;
+        struct pollfd pfd = {lg.sockfd, POLLIN, 0};
+        poll(&pfd, 1, busy ? 0 : 1);
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t len;
+        while ((len = recvfrom(lg.sockfd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len)) > 0)
+        {
+            handle_reply(&lg, buffer, len, &from);
+            from_len = sizeof(from);
+        }
+
+        now = now_ns();
+        if (now >= next_scan)
+        {
+            expire_waiting(&lg, now);
+            next_scan = now + TIMEOUT_SCAN_NS;
+        }
+    }
+
+    result->seconds = (now - start) / 1e9;
+    close(lg.sockfd);
+    free(lg.clients);
+    free(lg.ready);
+    return 0;
+}
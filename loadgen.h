@@ -0,0 +1,60 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "histogram.h"
+
+enum
+{
+    LOADGEN_DISCOVER,
+    LOADGEN_REQUEST,
+    LOADGEN_RENEW,
+    LOADGEN_RELEASE,
+    LOADGEN_TYPES
+};
+
+extern const char *loadgen_type_names[LOADGEN_TYPES];
+
+typedef struct
+{
+    struct sockaddr_in server; // Where DISCOVER/REQUEST/RELEASE go
+    uint16_t client_port;      // 0 = any
+    uint32_t clients;          // Virtual clients
+    uint32_t rate;             // Messages per second, 0 = as fast as replies arrive
+    uint32_t duration;         // Seconds
+    uint32_t renewals;         // Renewals per lease before releasing it
+    uint32_t timeout_ms;       // Reply timeout before starting over
+    int rapid_commit;          // Ask for Rapid Commit (option 80) in DISCOVER
+} LoadgenConfig;
+
+typedef struct
+{
+    uint64_t sent;
+    uint64_t replies;
+    uint64_t timeouts;
+    uint64_t naks;
+    Histogram latency; // Nanoseconds from send to reply
+} LoadgenTypeStats;
+
+typedef struct
+{
+    double seconds;
+    uint64_t total_sent;
+    uint64_t stray; // Replies that match no waiting client
+    LoadgenTypeStats types[LOADGEN_TYPES];
+    uint64_t leases;           // Addresses acquired, renewals not counted
+    uint64_t lease_packets;    // DISCOVERs, REQUESTs and their replies
+    Histogram acquire_latency; // DISCOVER sent to ACK received
+} LoadgenResult;
+
+// Drive 'clients' virtual clients through DORA, renew and release cycles
+// from a single socket, collecting counts and latencies per message type.
+// Each client has its own MAC and a fresh xid per exchange.
+int loadgen_run(const LoadgenConfig *config, LoadgenResult *result);
+
+// Throughput and p50/p99/p999 latency per message type
+void loadgen_print(const LoadgenConfig *config, const LoadgenResult *result);
+
+#endif
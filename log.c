@@ -0,0 +1,214 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+typedef struct
+{
+    uint8_t level;
+    uint8_t length;
+    char text[LOG_LINE_MAX];
+} LogEntry;
+
+// Single producer (the owning thread), single consumer (the logger).
+// head and tail live on separate cache lines.
+typedef struct
+{
+    uint64_t head;
+    uint64_t dropped;
+    char pad1[48];
+    uint64_t tail;
+    uint64_t reported; // Drops already reported by the logger
+    char pad2[48];
+    LogEntry entries[LOG_RING_SIZE];
+} LogRing;
+
+int log_level = LOG_LEVEL_INFO;
+
+static FILE *log_out;
+static LogRing *rings[LOG_MAX_THREADS];
+static uint32_t nrings;
+static __thread LogRing *thread_ring;
+static __thread int thread_unregistered; // Ran out of ring slots
+static int wake_fd = -1;   // The idle logger blocks reading it
+static int logger_idle;    // Set by the logger before it blocks
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+int log_parse_level(const char *name)
+{
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if (strcmp(name, level_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static LogRing *register_thread(void)
+{
+    if (thread_unregistered)
+        return NULL;
+    LogRing *ring = aligned_alloc(64, sizeof(LogRing));
+    if (ring == NULL)
+        return NULL;
+    memset(ring, 0, offsetof(LogRing, entries));
+
+    uint32_t idx = __atomic_fetch_add(&nrings, 1, __ATOMIC_ACQ_REL);
+    if (idx >= LOG_MAX_THREADS)
+    {
+        free(ring);
+        thread_unregistered = 1;
+        return NULL;
+    }
+    STORE(&rings[idx], ring);
+    thread_ring = ring;
+    return ring;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    va_list args;
+    LogRing *ring = thread_ring;
+    if (ring == NULL && log_out != NULL)
+        ring = register_thread();
+    if (ring == NULL)
+    {
+        // No logger running (or no ring for this thread): write directly
+        va_start(args, fmt);
+        vfprintf(log_out != NULL ? log_out : stderr, fmt, args);
+        va_end(args);
+        fputc('\n', log_out != NULL ? log_out : stderr);
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - LOAD(&ring->tail) == LOG_RING_SIZE)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogEntry *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    va_start(args, fmt);
+    int len = vsnprintf(entry->text, LOG_LINE_MAX, fmt, args);
+    va_end(args);
+    if (len < 0)
+        len = 0;
+    entry->length = len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1;
+    entry->level = level;
+    STORE(&ring->head, head + 1);
+
+    // Only one writer wakes the logger, and only if it found every ring
+    // empty; the fence pairs with the one in logger_thread
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logger_idle, __ATOMIC_RELAXED) && __atomic_exchange_n(&logger_idle, 0, __ATOMIC_ACQ_REL))
+    {
+        // Cannot fail: the counter is read back long before it could overflow
+        uint64_t one = 1;
+        (void)write(wake_fd, &one, sizeof(one));
+    }
+}
+
+// Write out everything queued in one ring. Returns the entries written.
+static uint64_t drain(LogRing *ring)
+{
+    uint64_t tail = ring->tail;
+    uint64_t head = LOAD(&ring->head);
+    for (uint64_t i = tail; i < head; i++)
+    {
+        LogEntry *entry = &ring->entries[i & (LOG_RING_SIZE - 1)];
+        fwrite(entry->text, 1, entry->length, log_out);
+        fputc('\n', log_out);
+    }
+    STORE(&ring->tail, head);
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported)
+    {
+        fprintf(log_out, "log: %llu messages dropped\n", (unsigned long long)(dropped - ring->reported));
+        ring->reported = dropped;
+    }
+    return head - tail;
+}
+
+static uint64_t drain_all(void)
+{
+    uint64_t written = 0;
+    uint32_t n = LOAD(&nrings);
+    for (uint32_t i = 0; i < n && i < LOG_MAX_THREADS; i++)
+    {
+        LogRing *ring = LOAD(&rings[i]);
+        if (ring != NULL)
+            written += drain(ring);
+    }
+    return written;
+}
+
+// Drains while there is work; when every ring is empty it announces that
+// it is idle, checks once more and blocks until a writer wakes it
+static void *logger_thread(void *arg)
+{
+    while (1)
+    {
+        if (drain_all() > 0)
+        {
+            fflush(log_out);
+            continue;
+        }
+        __atomic_store_n(&logger_idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (drain_all() > 0)
+        {
+            __atomic_store_n(&logger_idle, 0, __ATOMIC_RELAXED);
+            fflush(log_out);
+            continue;
+        }
+        // A wakeup left over from a writer that saw the flag late only
+        // costs one extra pass
+        uint64_t count;
+        (void)read(wake_fd, &count, sizeof(count));
+    }
+    return NULL;
+}
+
+int log_init(FILE *out, int level)
+{
+    pthread_t tid;
+    log_level = level;
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0)
+        return -1;
+    log_out = out;
+    if (pthread_create(&tid, NULL, logger_thread, NULL) != 0)
+    {
+        log_out = NULL;
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+uint64_t log_dropped(void)
+{
+    uint64_t total = 0;
+    uint32_t n = LOAD(&nrings);
+    for (uint32_t i = 0; i < n && i < LOG_MAX_THREADS; i++)
+    {
+        LogRing *ring = LOAD(&rings[i]);
+        if (ring != NULL)
+            total += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return total;
+}
@@ -0,0 +1,61 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#define LOG_RING_SIZE 1024 // Entries per thread, a power of two
+#define LOG_LINE_MAX 120
+#define LOG_MAX_THREADS 512
+
+extern int log_level;
+
+// Asynchronous logging. Each thread formats into its own single-producer
+// ring, without locks; a logger thread drains every ring to 'out' and,
+// when all are empty, sleeps until the next message wakes it (the only
+// system call a writer may make). When a ring is full the message is dropped and counted, and
+// the logger reports the count. Order is kept per thread, not globally.
+int log_init(FILE *out, int level);
+
+// Parse "error", "warn", "info" or "debug". Returns -1 if unknown.
+int log_parse_level(const char *name);
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Messages below the level cost only the comparison
+#define log_at(level, ...)                  \
+    do                                      \
+    {                                       \
+        if ((level) <= log_level)           \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// For errors that can repeat per packet: at most one message every
+// 'seconds' from each call site on each thread
+#define log_every(level, seconds, ...)                     \
+    do                                                     \
+    {                                                      \
+        static __thread time_t log_last_;                  \
+        time_t log_now_ = time(NULL);                      \
+        if ((level) <= log_level && log_now_ - log_last_ >= (seconds)) \
+        {                                                  \
+            log_last_ = log_now_;                          \
+            log_write((level), __VA_ARGS__);               \
+        }                                                  \
+    } while (0)
+
+// Messages dropped so far because a ring was full
+uint64_t log_dropped(void);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define COMMAND_TIMEOUT_MS 100
+
+static const char *message_names[METRIC_MESSAGE_TYPES] = {
+    "other", "discover", "offer", "request", "decline", "ack", "nak", "release", "inform"};
+
+static const char *outcome_names[METRIC_OUTCOMES] = {
+    "offered", "acked", "renewed", "released", "no_free_ip", "out_of_range", "already_leased",
+    "renew_failed", "release_unknown", "other_server", "store_error", "malformed", "no_subnet", "retransmit",
+    "rebooted", "rapid_commit", "declined", "decline_unknown", "informed"};
+
+static const double quantiles[] = {50, 90, 99, 99.9, 99.99};
+
+void metrics_init(WorkerMetrics *metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    histogram_init(&metrics->latency);
+}
+
+static void write_quantiles(FILE *out, const char *name, const Histogram *h)
+{
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+        fprintf(out, "%s{quantile=\"%g\"} %.3f\n", name, quantiles[i] / 100, histogram_percentile(h, quantiles[i]) / 1e3);
+    fprintf(out, "%s_max %.3f\n", name, h->max / 1e3);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)h->count);
+}
+
+void metrics_write(FILE *out, const WorkerMetrics *workers, int nworkers, LeaseStore *store)
+{
+    uint64_t received[METRIC_MESSAGE_TYPES] = {0};
+    uint64_t outcomes[METRIC_OUTCOMES] = {0};
+    uint64_t replies = 0;
+    uint64_t naks = 0;
+    uint64_t journal_errors = 0;
+    Histogram *latency = malloc(sizeof(Histogram));
+    Histogram *lock_wait = malloc(sizeof(Histogram));
+    if (latency == NULL || lock_wait == NULL)
+    {
+        free(latency);
+        free(lock_wait);
+        return;
+    }
+    histogram_init(latency);
+    histogram_init(lock_wait);
+
+    for (int w = 0; w < nworkers; w++)
+    {
+        const WorkerMetrics *m = &workers[w];
+        uint64_t worker_received = 0;
+        for (int i = 0; i < METRIC_MESSAGE_TYPES; i++)
+        {
+            uint64_t n = LOAD(&m->received[i]);
+            received[i] += n;
+            worker_received += n;
+        }
+        for (int i = 0; i < METRIC_OUTCOMES; i++)
+            outcomes[i] += LOAD(&m->outcomes[i]);
+        replies += LOAD(&m->replies);
+        naks += LOAD(&m->naks);
+        journal_errors += LOAD(&m->journal_errors);
+        histogram_merge(latency, &m->latency);
+        fprintf(out, "dhcp_worker_received_total{worker=\"%d\"} %llu\n", w, (unsigned long long)worker_received);
+    }
+    lease_store_lock_wait(store, lock_wait);
+
+    for (int i = 0; i < METRIC_MESSAGE_TYPES; i++)
+        fprintf(out, "dhcp_received_total{type=\"%s\"} %llu\n", message_names[i], (unsigned long long)received[i]);
+    for (int i = 0; i < METRIC_OUTCOMES; i++)
+        fprintf(out, "dhcp_outcome_total{outcome=\"%s\"} %llu\n", outcome_names[i], (unsigned long long)outcomes[i]);
+    fprintf(out, "dhcp_replies_total %llu\n", (unsigned long long)replies);
+    fprintf(out, "dhcp_naks_total %llu\n", (unsigned long long)naks);
+    fprintf(out, "dhcp_journal_errors_total %llu\n", (unsigned long long)journal_errors);
+
+    write_quantiles(out, "dhcp_reply_latency_us", latency);
+    write_quantiles(out, "dhcp_lock_wait_us", lock_wait);
+    fprintf(out, "dhcp_lock_contended_total %llu\n", (unsigned long long)(lock_wait->count - lock_wait->buckets[0]));
+
+    uint64_t size, free_count;
+    lease_store_usage(store, &size, &free_count);
+    fprintf(out, "dhcp_pool_size %llu\n", (unsigned long long)size);
+    fprintf(out, "dhcp_pool_free %llu\n", (unsigned long long)free_count);
+    fprintf(out, "dhcp_pending_offers %u\n", lease_store_offer_count(store));
+    fprintf(out, "dhcp_pool_utilization %.4f\n", size ? (double)(size - free_count) / size : 0.0);
+
+    free(latency);
+    free(lock_wait);
+}
+
+typedef struct
+{
+    int listenfd;
+    metrics_fn fn;
+    void *arg;
+} MetricsServer;
+
+// First line sent by the client, or "" if it sends nothing
+static void read_command(int fd, char *command, size_t size)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    ssize_t n = 0;
+    if (poll(&pfd, 1, COMMAND_TIMEOUT_MS) > 0)
+        n = read(fd, command, size - 1);
+    command[n > 0 ? n : 0] = '\0';
+    command[strcspn(command, "\r\n")] = '\0';
+}
+
+static void *metrics_thread(void *arg)
+{
+    MetricsServer *server = arg;
+    char command[64];
+    while (1)
+    {
+        int fd = accept(server->listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        read_command(fd, command, sizeof(command));
+        FILE *out = fdopen(fd, "w");
+        if (out == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        // A client that hangs up early only makes the writes fail (EPIPE)
+        server->fn(out, command, server->arg);
+        fclose(out);
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *path, metrics_fn fn, void *arg)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    MetricsServer *server = malloc(sizeof(MetricsServer));
+    if (server == NULL)
+        return -1;
+    server->fn = fn;
+    server->arg = arg;
+    server->listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listenfd < 0)
+    {
+        free(server);
+        return -1;
+    }
+
+    unlink(path);
+    pthread_t tid;
+    if (bind(server->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server->listenfd, 16) < 0 ||
+        pthread_create(&tid, NULL, metrics_thread, server) != 0)
+    {
+        close(server->listenfd);
+        free(server);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "histogram.h"
+#include "lease_store.h"
+
+#define METRIC_MESSAGE_TYPES 9 // DHCP message types 1-8; 0 counts anything else
+
+// What a handler did with a message
+enum
+{
+    METRIC_OFFERED,
+    METRIC_ACKED,
+    METRIC_RENEWED,
+    METRIC_RELEASED,
+    METRIC_NO_FREE_IP,
+    METRIC_OUT_OF_RANGE,
+    METRIC_ALREADY_LEASED,
+    METRIC_RENEW_FAILED,
+    METRIC_RELEASE_UNKNOWN,
+    METRIC_OTHER_SERVER, // REQUEST naming another server
+    METRIC_STORE_ERROR,
+    METRIC_MALFORMED,
+    METRIC_NO_SUBNET, // Relayed from a network with no subnet configured
+    METRIC_RETRANSMIT, // Answered from the reply cache
+    METRIC_REBOOTED,   // INIT-REBOOT REQUEST confirmed
+    METRIC_RAPID_COMMIT, // DISCOVER answered with an ACK
+    METRIC_DECLINED,     // Address quarantined after a DECLINE
+    METRIC_DECLINE_UNKNOWN,
+    METRIC_INFORMED,     // INFORM answered with configuration only
+    METRIC_OUTCOMES
+};
+
+// Counters of one worker thread. Only the owner writes them, with plain
+// increments published by relaxed stores, so the hot path has no atomic
+// read-modify-write and no shared cache lines.
+typedef struct
+{
+    uint64_t received[METRIC_MESSAGE_TYPES];
+    uint64_t outcomes[METRIC_OUTCOMES];
+    uint64_t replies;
+    uint64_t naks; // Replies telling the client to start over
+    uint64_t journal_errors; // Passes whose replies were dropped: the journal failed
+    Histogram latency; // Nanoseconds from receive to send
+} __attribute__((aligned(64))) WorkerMetrics;
+
+static inline void metrics_count(uint64_t *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+void metrics_init(WorkerMetrics *metrics);
+
+// Plain-text exposition of every worker's counters merged, latency and
+// lock-wait percentiles, and pool gauges
+void metrics_write(FILE *out, const WorkerMetrics *workers, int nworkers, LeaseStore *store);
+
+// Serve 'fn' on a UNIX stream socket at 'path' from a background thread.
+// The first line a client sends (if any, within 100 ms) is passed as
+// 'command'; the client receives fn's output and the connection closes.
+// The process must ignore SIGPIPE: a client may hang up mid-reply.
+typedef void (*metrics_fn)(FILE *out, const char *command, void *arg);
+int metrics_serve(const char *path, metrics_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "packet_ring.h"
+#include "dhcp.h"
+
+#define ETH_HEADER 14
+#define IP_HEADER 20 // Replies carry no IP options
+#define UDP_HEADER 8
+#define FRAME_HEADERS (ETH_HEADER + IP_HEADER + UDP_HEADER)
+
+// Frames start this far into a transmit slot (PACKET_TX_HAS_OFF): the
+// smallest offset the kernel accepts, plus 2 so the IP header and the
+// DHCP payload behind it are 4-byte aligned
+#define TX_OFFSET (TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) + 2)
+
+static inline uint32_t load_acquire(const uint32_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(uint32_t *p, uint32_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// IPv4, UDP, not a later fragment, destination port 'port'
+static int attach_filter(int fd, int port)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HEADER + 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, ETH_HEADER + 6),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, ETH_HEADER),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, ETH_HEADER + 2),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)port, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int packet_ring_mute_socket(int sockfd)
+{
+    struct sock_filter code[] = {BPF_STMT(BPF_RET | BPF_K, 0)};
+    struct sock_fprog prog = {.len = 1, .filter = code};
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+// MAC of the interface, and its IPv4 address if it has one
+static int interface_addresses(PacketRing *ring, const char *ifname)
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) < 0)
+        return -1;
+    memcpy(ring->mac, ifr.ifr_hwaddr.sa_data, 6);
+
+    // Needs an AF_INET socket
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+        return -1;
+    if (ioctl(sockfd, SIOCGIFADDR, &ifr) == 0)
+        ring->source = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+    close(sockfd);
+    return 0;
+}
+
+int packet_ring_open(PacketRing *ring, const char *ifname, int port, struct in_addr source, int fanout_group)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    ring->port = htons(port);
+    ring->source = source;
+    ring->rx_left = -1;
+    ring->ifindex = if_nametoindex(ifname);
+    if (ring->ifindex == 0)
+        return -1;
+
+    // Protocol 0 receives nothing until the filter is in place and bind()
+    // names the real one
+    ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (ring->fd < 0)
+        return -1;
+
+    int version = TPACKET_V3;
+    struct tpacket_req3 rx_req = {
+        .tp_block_size = PACKET_RING_BLOCK_SIZE,
+        .tp_block_nr = PACKET_RING_BLOCKS,
+        .tp_frame_size = PACKET_RING_FRAME_SIZE,
+        .tp_frame_nr = PACKET_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE * PACKET_RING_BLOCKS,
+        .tp_retire_blk_tov = PACKET_RING_BLOCK_TIMEOUT_MS,
+    };
+    // Transmit frames are fixed size; blocks only group them
+    struct tpacket_req3 tx_req = {
+        .tp_block_size = PACKET_RING_BLOCK_SIZE,
+        .tp_block_nr = PACKET_RING_TX_FRAMES * PACKET_RING_FRAME_SIZE / PACKET_RING_BLOCK_SIZE,
+        .tp_frame_size = PACKET_RING_FRAME_SIZE,
+        .tp_frame_nr = PACKET_RING_TX_FRAMES,
+    };
+    int enable = 1;
+    if (attach_filter(ring->fd, port) < 0 ||
+        setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+        setsockopt(ring->fd, SOL_PACKET, PACKET_TX_HAS_OFF, &enable, sizeof(enable)) < 0 ||
+        setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) < 0 ||
+        setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) < 0 ||
+        interface_addresses(ring, ifname) < 0)
+        goto fail;
+
+    // Our own replies would otherwise come back through the filter when
+    // the server port is also the client port; packet_ring_next() skips
+    // them as well on kernels without this option
+    setsockopt(ring->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &enable, sizeof(enable));
+
+    size_t rx_size = (size_t)rx_req.tp_block_size * rx_req.tp_block_nr;
+    ring->map_size = rx_size + (size_t)tx_req.tp_block_size * tx_req.tp_block_nr;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+    if (ring->map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        goto fail;
+    }
+    ring->rx_ring = ring->map;
+    ring->tx_ring = ring->map + rx_size;
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    addr.sll_ifindex = ring->ifindex;
+    if (bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+
+    int fanout = (fanout_group & 0xffff) | (PACKET_FANOUT_HASH << 16);
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0)
+        goto fail;
+    return 0;
+
+fail:;
+    int saved = errno;
+    packet_ring_close(ring);
+    errno = saved;
+    return -1;
+}
+
+void packet_ring_close(PacketRing *ring)
+{
+    if (ring->map != NULL)
+        munmap(ring->map, ring->map_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->map = NULL;
+    ring->fd = -1;
+}
+
+static struct tpacket_block_desc *rx_block(PacketRing *ring, unsigned int i)
+{
+    return (struct tpacket_block_desc *)(ring->rx_ring + (size_t)i * PACKET_RING_BLOCK_SIZE);
+}
+
+int packet_ring_wait(PacketRing *ring)
+{
+    ring->stats.rx_calls++;
+    if (ring->rx_left > 0)
+        return 0;
+    // A finished block is released by packet_ring_next(); look past it
+    unsigned int next = ring->rx_left == 0 ? (ring->rx_block + 1) % PACKET_RING_BLOCKS : ring->rx_block;
+    if (load_acquire(&rx_block(ring, next)->hdr.bh1.block_status) & TP_STATUS_USER)
+        return 0;
+
+    struct pollfd pfd = {.fd = ring->fd, .events = POLLIN | POLLERR};
+    while (poll(&pfd, 1, -1) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+// Checks a frame from the ring and fills 'packet' from it
+static int parse_frame(struct tpacket3_hdr *hdr, RawPacket *packet)
+{
+    const struct sockaddr_ll *ll = (const struct sockaddr_ll *)((uint8_t *)hdr + TPACKET_ALIGN(sizeof(*hdr)));
+    if (ll->sll_pkttype == PACKET_OUTGOING)
+        return 0;
+
+    uint8_t *eth = (uint8_t *)hdr + hdr->tp_mac;
+    uint8_t *ip = eth + ETH_HEADER;
+    size_t caplen = hdr->tp_snaplen;
+    if (caplen < FRAME_HEADERS)
+        return 0;
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    if (ihl < IP_HEADER || caplen < ETH_HEADER + ihl + UDP_HEADER)
+        return 0;
+
+    uint8_t *udp = ip + ihl;
+    size_t udp_len = (udp[4] << 8) | udp[5];
+    size_t captured = caplen - ETH_HEADER - ihl;
+    if (udp_len < UDP_HEADER)
+        return 0;
+    if (udp_len > captured)
+        udp_len = captured;
+
+    packet->data = udp + UDP_HEADER;
+    packet->len = udp_len - UDP_HEADER;
+    memcpy(packet->src_mac, eth + 6, 6);
+    memset(&packet->addr, 0, sizeof(packet->addr));
+    packet->addr.sin_family = AF_INET;
+    memcpy(&packet->addr.sin_addr, ip + 12, 4);
+    memcpy(&packet->addr.sin_port, udp, 2);
+    return 1;
+}
+
+int packet_ring_next(PacketRing *ring, RawPacket *packet)
+{
+    while (1)
+    {
+        if (ring->rx_left == 0)
+        {
+            // Every packet of the block has been handled: give it back
+            store_release(&rx_block(ring, ring->rx_block)->hdr.bh1.block_status, TP_STATUS_KERNEL);
+            ring->rx_block = (ring->rx_block + 1) % PACKET_RING_BLOCKS;
+            ring->rx_left = -1;
+        }
+        if (ring->rx_left < 0)
+        {
+            struct tpacket_block_desc *block = rx_block(ring, ring->rx_block);
+            if (!(load_acquire(&block->hdr.bh1.block_status) & TP_STATUS_USER))
+                return 0;
+            ring->rx_left = block->hdr.bh1.num_pkts;
+            ring->rx_next = (uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+            continue;
+        }
+
+        struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)ring->rx_next;
+        ring->rx_next += hdr->tp_next_offset;
+        ring->rx_left--;
+        if (parse_frame(hdr, packet))
+        {
+            ring->stats.rx_packets++;
+            return 1;
+        }
+    }
+}
+
+static struct tpacket3_hdr *tx_frame(PacketRing *ring, unsigned int i)
+{
+    return (struct tpacket3_hdr *)(ring->tx_ring + (size_t)i * PACKET_RING_FRAME_SIZE);
+}
+
+uint8_t *packet_ring_tx_buffer(PacketRing *ring)
+{
+    struct tpacket3_hdr *hdr = tx_frame(ring, ring->tx_frame);
+    if (load_acquire(&hdr->tp_status) != TP_STATUS_AVAILABLE)
+        return NULL;
+    return (uint8_t *)hdr + TX_OFFSET + FRAME_HEADERS;
+}
+
+static uint32_t checksum_add(uint32_t sum, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+    if (len & 1)
+        sum += data[len - 1] << 8;
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+void packet_ring_tx_add(PacketRing *ring, size_t len, const RawPacket *request)
+{
+    static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    struct tpacket3_hdr *hdr = tx_frame(ring, ring->tx_frame);
+    uint8_t *eth = (uint8_t *)hdr + TX_OFFSET;
+    uint8_t *ip = eth + ETH_HEADER;
+    uint8_t *udp = ip + IP_HEADER;
+    const DHCPMessage *reply = (const DHCPMessage *)(udp + UDP_HEADER);
+    const DHCPMessage *message = (const DHCPMessage *)request->data;
+
+    // A sender with an address (relay agent or bound client) gets the reply
+    // where it came from, as on the socket path. A client still without
+    // one is reached at chaddr, unless it asked for broadcast or there is
+    // no address to send to. The request's flag counts: OFFER templates
+    // always carry the broadcast flag for the socket path.
+    const uint8_t *dst_mac = request->src_mac;
+    uint32_t dst_ip = request->addr.sin_addr.s_addr;
+    if (dst_ip == 0)
+    {
+        if ((ntohs(message->flags) & 0x8000) || reply->yiaddr == 0 || message->htype != 1 || message->hlen != 6)
+        {
+            dst_mac = broadcast_mac;
+            dst_ip = INADDR_BROADCAST;
+        }
+        else
+        {
+            dst_mac = reply->chaddr;
+            dst_ip = reply->yiaddr;
+        }
+    }
+
+    memcpy(eth, dst_mac, 6);
+    memcpy(eth + 6, ring->mac, 6);
+    put16(eth + 12, ETH_P_IP);
+
+    put16(ip + 0, 0x4500);
+    put16(ip + 2, IP_HEADER + UDP_HEADER + len);
+    put16(ip + 4, 0);      // Identification: never fragmented
+    put16(ip + 6, 0x4000); // Don't fragment
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    put16(ip + 10, 0);
+    memcpy(ip + 12, &ring->source, 4);
+    memcpy(ip + 16, &dst_ip, 4);
+    uint16_t ip_sum = checksum_fold(checksum_add(0, ip, IP_HEADER));
+    memcpy(ip + 10, &ip_sum, 2);
+
+    memcpy(udp, &ring->port, 2);
+    memcpy(udp + 2, &request->addr.sin_port, 2);
+    put16(udp + 4, UDP_HEADER + len);
+    put16(udp + 6, 0);
+    // Pseudo header: addresses, protocol and UDP length
+    uint32_t sum = checksum_add(0, ip + 12, 8) + IPPROTO_UDP + UDP_HEADER + len;
+    uint16_t udp_sum = checksum_fold(checksum_add(sum, udp, UDP_HEADER + len));
+    if (udp_sum == 0)
+        udp_sum = 0xffff;
+    memcpy(udp + 6, &udp_sum, 2);
+
+    hdr->tp_len = FRAME_HEADERS + len;
+    hdr->tp_snaplen = hdr->tp_len;
+    hdr->tp_mac = TX_OFFSET;
+    hdr->tp_next_offset = 0;
+    store_release(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+
+    ring->tx_frame = (ring->tx_frame + 1) % PACKET_RING_TX_FRAMES;
+    ring->tx_pending++;
+}
+
+int packet_ring_flush(PacketRing *ring)
+{
+    if (ring->tx_pending == 0)
+        return 0;
+    int pending = ring->tx_pending;
+    ring->tx_pending = 0;
+    // Blocks until the kernel has taken every frame marked for sending
+    if (send(ring->fd, NULL, 0, 0) < 0)
+    {
+        ring->stats.tx_errors += pending;
+        return -1;
+    }
+    ring->stats.tx_calls++;
+    ring->stats.tx_packets += pending;
+    return pending;
+}
+
+void packet_ring_tx_discard(PacketRing *ring)
+{
+    // The kernel only looks at the frames on send(), so they can still be
+    // taken back
+    for (; ring->tx_pending > 0; ring->tx_pending--)
+    {
+        ring->tx_frame = (ring->tx_frame + PACKET_RING_TX_FRAMES - 1) % PACKET_RING_TX_FRAMES;
+        store_release(&tx_frame(ring, ring->tx_frame)->tp_status, TP_STATUS_AVAILABLE);
+    }
+}
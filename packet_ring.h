@@ -0,0 +1,84 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "batch_io.h"
+
+#define PACKET_RING_BLOCK_SIZE (1 << 18) // Receive block handed over as a whole
+#define PACKET_RING_BLOCKS 16
+#define PACKET_RING_BLOCK_TIMEOUT_MS 1 // A partly filled block is retired after this
+#define PACKET_RING_FRAME_SIZE 2048    // One outgoing frame
+#define PACKET_RING_TX_FRAMES 512
+
+// A UDP datagram read straight off the wire. 'data' points into a receive
+// block that goes back to the kernel once every packet in it was read.
+typedef struct
+{
+    uint8_t *data; // UDP payload
+    size_t len;
+    uint8_t src_mac[6];
+    struct sockaddr_in addr; // IP source and UDP source port
+} RawPacket;
+
+// An AF_PACKET socket with mmap'd TPACKET_V3 receive and transmit rings on
+// one interface. A classic BPF filter lets only IPv4 UDP to the server
+// port into the ring; replies are written as whole Ethernet frames and go
+// out together with one send(). One instance per worker thread; the
+// workers' sockets share the interface through a fanout group.
+typedef struct
+{
+    int fd;
+    int ifindex;
+    uint8_t mac[6];
+    struct in_addr source; // IP source of replies
+    uint16_t port;         // Server port, network order
+
+    uint8_t *map;
+    size_t map_size;
+
+    uint8_t *rx_ring;
+    unsigned int rx_block; // Block being read, or next to become ready
+    int rx_left;           // Packets not yet read in it, -1 until it is ready
+    uint8_t *rx_next;
+
+    uint8_t *tx_ring;
+    unsigned int tx_frame;   // Next frame to fill
+    unsigned int tx_pending; // Frames filled since the last flush
+
+    BatchIOStats stats;
+} PacketRing;
+
+// Open a ring on 'ifname' for UDP to 'port'. Replies come from the
+// interface's MAC and IPv4 address, or 'source' if it has none. Rings opened with the same 'fanout_group'
+// split the traffic by flow hash.
+int packet_ring_open(PacketRing *ring, const char *ifname, int port, struct in_addr source, int fanout_group);
+void packet_ring_close(PacketRing *ring);
+
+// Block until a receive block is ready
+int packet_ring_wait(PacketRing *ring);
+
+// Next datagram: 1 if there is one, 0 when no ready block is left
+int packet_ring_next(PacketRing *ring, RawPacket *packet);
+
+// Room for the DHCP payload of the next reply, or NULL if every transmit
+// frame is still waiting to go out
+uint8_t *packet_ring_tx_buffer(PacketRing *ring);
+
+// Wrap the reply in that buffer in UDP, IP and Ethernet headers addressed
+// as RFC 2131 4.1 asks for 'request', and queue it
+void packet_ring_tx_add(PacketRing *ring, size_t len, const RawPacket *request);
+
+// Hand the queued frames to the kernel. Returns the number sent.
+int packet_ring_flush(PacketRing *ring);
+
+// Give the queued frames back unsent
+void packet_ring_tx_discard(PacketRing *ring);
+
+// Keep a UDP socket bound but have it drop everything, so the port stays
+// taken and the kernel sends no ICMP errors for what the ring handles
+int packet_ring_mute_socket(int sockfd);
+
+#endif
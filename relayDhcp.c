@@ -1,137 +1,543 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <ifaddrs.h>
+#include <net/if.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "dhcp.h"
+#include "dhcp_options.h"
+#include "batch_io.h"
+#include "relay_upstream.h"
+#include "transaction_table.h"
+#include "log.h"
 
 #define BUFFER_SIZE 1024
-#define DHCP_SERVER_PORT 69
+#define DHCP_SERVER_PORT 67
 #define DHCP_RELAY_PORT 67
+#define DHCP_CLIENT_PORT 68
+#define MAX_HOPS 16 // RFC 1542: drop requests relayed more often than this
+#define MAX_INTERFACES 64
+#define MAX_WORKERS 64
+#define BATCH_SIZE 32 // Datagrams per recvmmsg()/sendmmsg()
+#define TRANSACTION_SLOTS 65536
+#define TRANSACTION_TTL_NS 10000000000ULL // How long replies to a request are expected
+#define STATS_INTERVAL 10                 // Seconds between reports
+
+// An interface the relay serves; its address goes into giaddr
+typedef struct
+{
+    int ifindex;
+    char name[IF_NAMESIZE];
+    struct in_addr addr;
+} RelayInterface;
 
+// Written only by the worker, stored atomically for the reporter
 typedef struct
 {
-    uint8_t op;
-    uint8_t htype;
-    uint8_t hlen;
-    uint8_t hops;
-    uint32_t xid;
-    uint16_t secs;
-    uint16_t flags;
-    uint32_t ciaddr;
-    uint32_t yiaddr;
-    uint32_t siaddr;
-    uint32_t giaddr;
-    uint8_t chaddr[16];
-    uint8_t sname[64];
-    uint8_t file[128];
-    uint8_t options[312];
-} DHCPMessage;
-
-void relay_dhcp_message(int from_socket, int to_socket, struct sockaddr_in *from_addr, struct sockaddr_in *to_addr)
+    uint64_t requests; // Relayed to a server
+    uint64_t replies;  // Relayed to a client
+    uint64_t dropped;
+    uint64_t unmatched; // Replies with no transaction, routed by their flags
+    BatchIOStats io;
+} RelayCounters;
+
+// A thread with its own SO_REUSEPORT socket on the relay port. Requests
+// go out to the servers from that socket too, so server replies come
+// back to whichever worker the kernel picks; the transaction table is
+// shared for that reason.
+typedef struct
 {
-    char buffer[BUFFER_SIZE];
-    socklen_t addr_len = sizeof(struct sockaddr_in);
+    pthread_t thread;
+    int sockfd;
+    UpstreamStats *upstream_stats; // RELAY_MAX_UPSTREAMS entries
+    RelayCounters counters;
+} RelayWorker;
+
+RelayInterface interfaces[MAX_INTERFACES];
+int interface_count = 0;
+UpstreamSet upstreams;
+UpstreamStats *upstream_stats; // All workers', contiguous for the reporter
+TransactionTable transactions;
+
+RelayWorker *workers;
+int worker_count = 1;
+unsigned int batch_size = BATCH_SIZE;
+int listen_port = DHCP_RELAY_PORT;
+int client_port = DHCP_CLIENT_PORT;
+int stats_interval = STATS_INTERVAL;
 
-    ssize_t recv_len = recvfrom(from_socket, buffer, BUFFER_SIZE, 0, (struct sockaddr *)from_addr, &addr_len);
-    if (recv_len < 0)
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void count(uint64_t *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+// Serve the interfaces named in 'names' (comma separated), or every
+// interface with an IPv4 address when NULL
+static int load_interfaces(const char *names)
+{
+    struct ifaddrs *list;
+    if (getifaddrs(&list) < 0)
     {
-        perror("Error receiving data");
-        return;
+        perror("getifaddrs");
+        return -1;
     }
 
-    DHCPMessage *dhcp_msg = (DHCPMessage *)buffer;
+    for (struct ifaddrs *ifa = list; ifa != NULL; ifa = ifa->ifa_next)
+    {
+        if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET)
+            continue;
+        if (names != NULL)
+        {
+            // Whole-word match in the list
+            size_t len = strlen(ifa->ifa_name);
+            const char *p = names;
+            int found = 0;
+            while ((p = strstr(p, ifa->ifa_name)) != NULL)
+            {
+                if ((p == names || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))
+                {
+                    found = 1;
+                    break;
+                }
+                p += len;
+            }
+            if (!found)
+                continue;
+        }
+
+        int ifindex = if_nametoindex(ifa->ifa_name);
+        int known = 0;
+        for (int i = 0; i < interface_count; i++)
+            known |= interfaces[i].ifindex == ifindex;
+        if (known || interface_count == MAX_INTERFACES)
+            continue; // First address of each interface
 
-    // Increment the hops field
-    dhcp_msg->hops++;
+        RelayInterface *iface = &interfaces[interface_count++];
+        memset(iface, 0, sizeof(*iface));
+        iface->ifindex = ifindex;
+        snprintf(iface->name, sizeof(iface->name), "%s", ifa->ifa_name);
+        iface->addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+    }
+    freeifaddrs(list);
+    return interface_count > 0 ? 0 : -1;
+}
 
-    // If this is a request from a client, set the giaddr field
-    if (dhcp_msg->op == 1 && dhcp_msg->giaddr == 0)
+static RelayInterface *interface_by_index(int ifindex)
+{
+    for (int i = 0; i < interface_count; i++)
     {
-        struct in_addr relay_ip;
-        inet_pton(AF_INET, "192.168.182.129", &relay_ip); // Replace with your relay's IP
-        dhcp_msg->giaddr = relay_ip.s_addr;
+        if (interfaces[i].ifindex == ifindex)
+            return &interfaces[i];
     }
+    return NULL;
+}
 
-    // Print information about the received message
-    printf("Received DHCP message from %s:%d\n",
-           inet_ntoa(from_addr->sin_addr), ntohs(from_addr->sin_port));
+static RelayInterface *interface_by_addr(uint32_t addr)
+{
+    for (int i = 0; i < interface_count; i++)
+    {
+        if (interfaces[i].addr.s_addr == addr)
+            return &interfaces[i];
+    }
+    return NULL;
+}
 
-    // Forward the message
-    ssize_t sent_len = sendto(to_socket, buffer, recv_len, 0, (struct sockaddr *)to_addr, sizeof(*to_addr));
-    if (sent_len < 0)
+// Client to server, in place in the receive ring: count the hop, stamp
+// giaddr with the address of the interface the request arrived on, and
+// queue it for the server it names or else a healthy one
+static void relay_request(RelayWorker *worker, BatchIO *io, uint8_t *data, size_t len,
+                          const struct sockaddr_in *from, int ifindex, uint64_t now)
+{
+    DHCPMessage *msg = (DHCPMessage *)data;
+    RelayInterface *iface = interface_by_index(ifindex);
+    if (iface == NULL || msg->hops >= MAX_HOPS)
     {
-        perror("Error sending data");
+        count(&worker->counters.dropped);
         return;
     }
 
-    printf("Relayed DHCP message to %s:%d\n",
-           inet_ntoa(to_addr->sin_addr), ntohs(to_addr->sin_port));
+    msg->hops++;
+    // A relay closer to the client already set it
+    if (msg->giaddr == 0)
+        msg->giaddr = iface->addr.s_addr;
+
+    // RELEASE and DECLINE are never answered
+    DHCPOptions opts;
+    int parsed = dhcp_parse_options(data, len, &opts) == 0;
+    int expect_reply = !parsed || (opts.message_type != DHCPRELEASE && opts.message_type != DHCPDECLINE);
+
+    // A REQUEST after an OFFER, a RELEASE or a DECLINE names its server,
+    // and no other will take it. If that is none of ours by address, every
+    // server gets a copy, as on a shared segment; only the named one
+    // answers, so none is expected to.
+    struct in_addr server_id;
+    uint32_t targets;
+    if (parsed && dhcp_option_addr(&opts, DHO_SERVER_ID, &server_id))
+    {
+        targets = upstream_with_addr(&upstreams, server_id);
+        if (targets == 0)
+            targets = (1u << upstreams.count) - 1;
+    }
+    else
+    {
+        targets = 1u << upstream_select(&upstreams, msg->chaddr, now);
+    }
+    int single = (targets & (targets - 1)) == 0;
+
+    int upstream = -1;
+    for (int i = 0; i < upstreams.count; i++)
+    {
+        if (!(targets & (1u << i)))
+            continue;
+        // Copies may outnumber the batch: send what is queued first
+        if (batch_io_tx_add(io, data, len, &upstreams.upstreams[i].addr) < 0)
+        {
+            batch_io_flush(io, worker->sockfd);
+            batch_io_tx_add(io, data, len, &upstreams.upstreams[i].addr);
+        }
+        upstream_sent(&upstreams, i, worker->upstream_stats, now, expect_reply && single);
+        upstream = i;
+    }
+    count(&worker->counters.requests);
+    if (!expect_reply)
+        return;
+
+    // Remember where the client is, for the replies
+    RelayTransaction txn;
+    memset(&txn, 0, sizeof(txn));
+    txn.xid = msg->xid;
+    memcpy(txn.chaddr, msg->chaddr, 16);
+    txn.source = *from;
+    txn.ifindex = ifindex;
+    txn.upstream = single ? upstream : -1;
+    txn.sent_ns = now;
+    transaction_table_insert(&transactions, &txn, now);
 }
 
-int main(int argc, char *argv[])
+// Server to client, in place, out of the interface the request came in
+// on. A sender that had an address (a client renewing, or a relay before
+// this one) gets the reply where it sent from. Otherwise, as RFC 1542
+// says: to ciaddr when the client has one, broadcast when the client
+// asked for it (or has no address yet), else to yiaddr. A reply whose
+// transaction is gone is still delivered that way if giaddr is one of
+// ours.
+static void relay_reply(RelayWorker *worker, BatchIO *io, uint8_t *data, size_t len,
+                        const struct sockaddr_in *from, uint64_t now)
 {
-    int client_socket, server_socket;
-    struct sockaddr_in relay_addr, server_addr, client_addr;
+    DHCPMessage *msg = (DHCPMessage *)data;
+    RelayTransaction txn;
+    int known = transaction_table_take(&transactions, msg->xid, msg->chaddr, now, &txn);
+    RelayInterface *iface;
+    if (known)
+    {
+        iface = interface_by_index(txn.ifindex);
+    }
+    else
+    {
+        iface = interface_by_addr(msg->giaddr);
+        count(&worker->counters.unmatched);
+    }
+    if (iface == NULL)
+    {
+        count(&worker->counters.dropped);
+        return;
+    }
 
-    // Create sockets
-    client_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    server_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (client_socket < 0 || server_socket < 0)
+    int upstream = upstream_find(&upstreams, from);
+    if (upstream >= 0)
     {
-        perror("Error creating socket");
-        exit(1);
+        // A request copied to every server is timed against whichever answers
+        uint64_t latency = known && (txn.upstream == upstream || txn.upstream < 0) ? now - txn.sent_ns : 0;
+        upstream_replied(&upstreams, upstream, worker->upstream_stats, latency);
     }
 
-    // Configure relay address
-    memset(&relay_addr, 0, sizeof(relay_addr));
-    relay_addr.sin_family = AF_INET;
-    relay_addr.sin_addr.s_addr = INADDR_ANY;
-    relay_addr.sin_port = htons(DHCP_RELAY_PORT);
+    struct sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(client_port);
+    if (known && txn.source.sin_addr.s_addr != INADDR_ANY)
+        dest = txn.source;
+    else if (msg->ciaddr != 0)
+        dest.sin_addr.s_addr = msg->ciaddr;
+    else if ((ntohs(msg->flags) & 0x8000) || msg->yiaddr == 0)
+        dest.sin_addr.s_addr = INADDR_BROADCAST;
+    else
+        dest.sin_addr.s_addr = msg->yiaddr;
 
-    // Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(DHCP_SERVER_PORT);
-    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+    // Leave through the client's interface, whatever the routing table says
+    batch_io_tx_add_via(io, data, len, &dest, iface->ifindex, iface->addr);
+    count(&worker->counters.replies);
+}
 
-    // Bind client socket
-    if (bind(client_socket, (struct sockaddr *)&relay_addr, sizeof(relay_addr)) < 0)
+// Receive a batch, edit each datagram where it landed in the ring, and
+// send them all on with one sendmmsg(): nothing is copied in user space
+// and nothing is logged per packet
+static void *relay_worker(void *arg)
+{
+    RelayWorker *worker = arg;
+    BatchIO io;
+    if (batch_io_init(&io, batch_size, 0, BUFFER_SIZE) < 0)
     {
-        perror("Error binding client socket");
+        fprintf(stderr, "Error: cannot allocate batch buffers\n");
         exit(1);
     }
 
-    printf("DHCP Relay is running...\n");
+    while (1)
+    {
+        int n = batch_io_recv(&io, worker->sockfd);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+                log_error("Error receiving data: %s", strerror(errno));
+            continue;
+        }
+
+        uint64_t now = now_ns();
+        for (int i = 0; i < n; i++)
+        {
+            uint8_t *data = batch_io_rx_data(&io, i);
+            size_t len = batch_io_rx_len(&io, i);
+            // Requests are only taken from interfaces the relay serves,
+            // which IP_PKTINFO tells apart
+            if (len >= DHCP_HEADER_SIZE && data[0] == 1)
+                relay_request(worker, &io, data, len, batch_io_rx_addr(&io, i), batch_io_rx_ifindex(&io, i), now);
+            else if (len >= DHCP_HEADER_SIZE && data[0] == 2)
+                relay_reply(worker, &io, data, len, batch_io_rx_addr(&io, i), now);
+            else
+                count(&worker->counters.dropped);
+        }
+        batch_io_flush(&io, worker->sockfd);
+        batch_io_stats_publish(&worker->counters.io, &io.stats);
+    }
+    return NULL;
+}
+
+static void report(double seconds)
+{
+    static RelayCounters last;
+    static UpstreamStats last_upstreams[RELAY_MAX_UPSTREAMS];
+    static uint64_t last_evicted;
+    RelayCounters total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < worker_count; i++)
+    {
+        RelayCounters *c = &workers[i].counters;
+        total.requests += __atomic_load_n(&c->requests, __ATOMIC_RELAXED);
+        total.replies += __atomic_load_n(&c->replies, __ATOMIC_RELAXED);
+        total.dropped += __atomic_load_n(&c->dropped, __ATOMIC_RELAXED);
+        total.unmatched += __atomic_load_n(&c->unmatched, __ATOMIC_RELAXED);
+        BatchIOStats io;
+        batch_io_stats_load(&c->io, &io);
+        total.io.rx_packets += io.rx_packets;
+        total.io.rx_calls += io.rx_calls;
+        total.io.tx_packets += io.tx_packets;
+        total.io.tx_calls += io.tx_calls;
+    }
+    uint64_t evicted = __atomic_load_n(&transactions.evicted, __ATOMIC_RELAXED);
 
-    fd_set readfds;
-    int max_fd = (client_socket > server_socket) ? client_socket : server_socket;
+    uint64_t rx_calls = total.io.rx_calls - last.io.rx_calls;
+    uint64_t tx_calls = total.io.tx_calls - last.io.tx_calls;
+    printf("Relay: %.0f requests/s, %.0f replies/s, %llu dropped, %llu unmatched, %llu transactions evicted, "
+           "%.1f datagrams per recvmmsg, %.1f per sendmmsg\n",
+           (total.requests - last.requests) / seconds, (total.replies - last.replies) / seconds,
+           (unsigned long long)(total.dropped - last.dropped), (unsigned long long)(total.unmatched - last.unmatched),
+           (unsigned long long)(evicted - last_evicted),
+           rx_calls ? (double)(total.io.rx_packets - last.io.rx_packets) / rx_calls : 0.0,
+           tx_calls ? (double)(total.io.tx_packets - last.io.tx_packets) / tx_calls : 0.0);
+    upstream_report(&upstreams, upstream_stats, worker_count, last_upstreams, stdout, seconds);
+    fflush(stdout);
+    last = total;
+    last_evicted = evicted;
+}
 
-    while (1)
+// Every worker binds the relay port with SO_REUSEPORT and the kernel
+// spreads the clients across them
+static int open_socket(int port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        perror("Error creating socket");
+        exit(1);
+    }
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
     {
-        FD_ZERO(&readfds);
-        FD_SET(client_socket, &readfds);
-        FD_SET(server_socket, &readfds);
+        perror("Error setting SO_REUSEPORT");
+        exit(1);
+    }
+    if (setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &enable, sizeof(enable)) < 0)
+    {
+        perror("Error setting IP_PKTINFO");
+        exit(1);
+    }
 
-        int activity = select(max_fd + 1, &readfds, NULL, NULL, NULL);
-        if (activity < 0)
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("Error binding socket");
+        exit(1);
+    }
+    return fd;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-i iface,...] [-m rr|hash] [-w workers] [-b batch_size] [-p port] [-c client_port]\n"
+                    "       [-t transactions] [-s stats_interval] [-l error|warn|info|debug] server[:port]...\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *interface_names = NULL;
+    BalanceMode mode = BALANCE_ROUND_ROBIN;
+    int level = LOG_LEVEL_INFO;
+    uint32_t transaction_slots = TRANSACTION_SLOTS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:m:w:b:p:c:t:s:l:")) != -1)
+    {
+        switch (opt)
         {
-            perror("select error");
-            exit(1);
+        case 'i':
+            interface_names = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "rr") == 0)
+                mode = BALANCE_ROUND_ROBIN;
+            else if (strcmp(optarg, "hash") == 0)
+                mode = BALANCE_HASH;
+            else
+                usage(argv[0]);
+            break;
+        case 'w':
+            worker_count = atoi(optarg);
+            if (worker_count < 1 || worker_count > MAX_WORKERS)
+                usage(argv[0]);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size < 1 || batch_size > 1024)
+                usage(argv[0]);
+            break;
+        case 'p':
+            listen_port = atoi(optarg);
+            break;
+        case 'c':
+            client_port = atoi(optarg);
+            break;
+        case 't':
+            transaction_slots = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+        case 'l':
+            level = log_parse_level(optarg);
+            if (level < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
         }
+    }
 
-        if (FD_ISSET(client_socket, &readfds))
+    upstream_set_init(&upstreams, mode);
+    for (int i = optind; i < argc; i++)
+    {
+        if (upstream_add(&upstreams, argv[i], DHCP_SERVER_PORT) < 0)
         {
-            relay_dhcp_message(client_socket, server_socket, &client_addr, &server_addr);
+            fprintf(stderr, "Invalid server address: %s\n", argv[i]);
+            usage(argv[0]);
         }
+    }
+    if (upstreams.count == 0)
+        usage(argv[0]);
 
-        if (FD_ISSET(server_socket, &readfds))
+    if (load_interfaces(interface_names) < 0)
+    {
+        fprintf(stderr, "Error: no interface with an IPv4 address to serve\n");
+        exit(1);
+    }
+    if (transaction_table_init(&transactions, transaction_slots, TRANSACTION_TTL_NS) < 0)
+    {
+        perror("Error allocating the transaction table");
+        exit(1);
+    }
+    if (log_init(stdout, level) < 0)
+    {
+        perror("Failed to create logger thread");
+        exit(1);
+    }
+
+    for (int i = 0; i < interface_count; i++)
+        printf("Interface %s: giaddr %s\n", interfaces[i].name, inet_ntoa(interfaces[i].addr));
+    for (int i = 0; i < upstreams.count; i++)
+        printf("Server %s:%d\n", inet_ntoa(upstreams.upstreams[i].addr.sin_addr),
+               ntohs(upstreams.upstreams[i].addr.sin_port));
+    printf("DHCP Relay is running (%s balancing, %d workers, batches of %u)...\n",
+           mode == BALANCE_HASH ? "hash" : "round-robin", worker_count, batch_size);
+    fflush(stdout);
+
+    workers = calloc(worker_count, sizeof(RelayWorker));
+    upstream_stats = calloc((size_t)worker_count * RELAY_MAX_UPSTREAMS, sizeof(UpstreamStats));
+    if (workers == NULL || upstream_stats == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        workers[i].sockfd = open_socket(listen_port);
+        workers[i].upstream_stats = &upstream_stats[i * RELAY_MAX_UPSTREAMS];
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, relay_worker, &workers[i]) != 0)
         {
-            relay_dhcp_message(server_socket, client_socket, &server_addr, &client_addr);
+            perror("Failed to create worker thread");
+            exit(1);
         }
     }
 
-    close(client_socket);
-    close(server_socket);
-    return 0;
+    // One tick per second for health checks and reports
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    struct itimerspec tick = {{1, 0}, {1, 0}};
+    timerfd_settime(timer_fd, 0, &tick, NULL);
+    int ticks = 0;
+    while (1)
+    {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+            continue;
+        upstream_check(&upstreams, now_ns());
+        ticks += (int)expirations;
+        if (stats_interval > 0 && ticks >= stats_interval)
+        {
+            report(ticks);
+            ticks = 0;
+        }
+    }
 }
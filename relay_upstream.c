@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "relay_upstream.h"
+#include "log.h"
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+void upstream_set_init(UpstreamSet *set, BalanceMode mode)
+{
+    memset(set, 0, sizeof(*set));
+    set->mode = mode;
+}
+
+int upstream_add(UpstreamSet *set, const char *text, int default_port)
+{
+    if (set->count == RELAY_MAX_UPSTREAMS)
+        return -1;
+
+    char host[INET_ADDRSTRLEN];
+    int port = default_port;
+    const char *colon = strchr(text, ':');
+    size_t len = colon != NULL ? (size_t)(colon - text) : strlen(text);
+    if (len >= sizeof(host))
+        return -1;
+    memcpy(host, text, len);
+    host[len] = '\0';
+    if (colon != NULL)
+    {
+        port = atoi(colon + 1);
+        if (port < 1 || port > 65535)
+            return -1;
+    }
+
+    Upstream *upstream = &set->upstreams[set->count];
+    memset(upstream, 0, sizeof(*upstream));
+    upstream->addr.sin_family = AF_INET;
+    upstream->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &upstream->addr.sin_addr) != 1)
+        return -1;
+    upstream->up = 1;
+    set->count++;
+    return 0;
+}
+
+static uint32_t hash_chaddr(const uint8_t chaddr[16])
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    for (int i = 0; i < 16; i++)
+        h = (h ^ chaddr[i]) * 16777619u;
+    return h;
+}
+
+// A down server is tried again once per probe interval; the worker that
+// wins the exchange sends the probe
+static int usable(Upstream *upstream, uint64_t now_ns)
+{
+    if (LOAD(&upstream->up))
+        return 1;
+    uint64_t last = LOAD(&upstream->last_probe_ns);
+    if (now_ns < last + UPSTREAM_PROBE_NS)
+        return 0;
+    return __atomic_compare_exchange_n(&upstream->last_probe_ns, &last, now_ns, 0, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED);
+}
+
+int upstream_select(UpstreamSet *set, const uint8_t chaddr[16], uint64_t now_ns)
+{
+    uint32_t first;
+    if (set->mode == BALANCE_HASH)
+        first = hash_chaddr(chaddr) % set->count;
+    else
+        first = __atomic_fetch_add(&set->next, 1, __ATOMIC_RELAXED) % set->count;
+
+    // Walk on from the first choice, so with hashing only the clients of
+    // a failed server move
+    for (int i = 0; i < set->count; i++)
+    {
+        int index = (first + i) % set->count;
+        if (usable(&set->upstreams[index], now_ns))
+            return index;
+    }
+    return first;
+}
+
+uint32_t upstream_with_addr(const UpstreamSet *set, struct in_addr addr)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < set->count; i++)
+    {
+        if (set->upstreams[i].addr.sin_addr.s_addr == addr.s_addr)
+            mask |= 1u << i;
+    }
+    return mask;
+}
+
+int upstream_find(const UpstreamSet *set, const struct sockaddr_in *from)
+{
+    // Servers sharing an address differ by port; a server answering from
+    // another port still counts
+    int same_host = -1;
+    for (int i = 0; i < set->count; i++)
+    {
+        const Upstream *upstream = &set->upstreams[i];
+        if (upstream->addr.sin_addr.s_addr != from->sin_addr.s_addr)
+            continue;
+        if (upstream->addr.sin_port == from->sin_port)
+            return i;
+        if (same_host < 0)
+            same_host = i;
+    }
+    return same_host;
+}
+
+void upstream_sent(UpstreamSet *set, int index, UpstreamStats *stats, uint64_t now_ns, int expect_reply)
+{
+    STORE(&stats[index].forwarded, stats[index].forwarded + 1);
+    if (!expect_reply)
+        return;
+    uint64_t none = 0;
+    __atomic_compare_exchange_n(&set->upstreams[index].oldest_unanswered_ns, &none, now_ns, 0, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+}
+
+void upstream_replied(UpstreamSet *set, int index, UpstreamStats *stats, uint64_t latency_ns)
+{
+    Upstream *upstream = &set->upstreams[index];
+    STORE(&stats[index].replies, stats[index].replies + 1);
+    STORE(&upstream->oldest_unanswered_ns, 0);
+    if (!LOAD(&upstream->up))
+        STORE(&upstream->up, 1);
+    if (latency_ns > 0)
+        histogram_record(&stats[index].latency, latency_ns);
+}
+
+void upstream_check(UpstreamSet *set, uint64_t now_ns)
+{
+    for (int i = 0; i < set->count; i++)
+    {
+        Upstream *upstream = &set->upstreams[i];
+        uint64_t oldest = LOAD(&upstream->oldest_unanswered_ns);
+        // A worker may have stamped it after 'now_ns' was read
+        if (LOAD(&upstream->up) && oldest != 0 && oldest < now_ns && now_ns - oldest > UPSTREAM_TIMEOUT_NS)
+        {
+            STORE(&upstream->last_probe_ns, now_ns);
+            STORE(&upstream->up, 0);
+            char name[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &upstream->addr.sin_addr, name, sizeof(name));
+            log_warn("Upstream %s:%d is not answering, failing over", name, ntohs(upstream->addr.sin_port));
+        }
+    }
+}
+
+void upstream_report(const UpstreamSet *set, const UpstreamStats *stats, int nworkers, UpstreamStats *last,
+                     FILE *out, double seconds)
+{
+    static UpstreamStats now;
+    static Histogram interval;
+    for (int i = 0; i < set->count; i++)
+    {
+        memset(&now, 0, sizeof(now));
+        for (int w = 0; w < nworkers; w++)
+        {
+            const UpstreamStats *s = &stats[w * RELAY_MAX_UPSTREAMS + i];
+            now.forwarded += LOAD(&s->forwarded);
+            now.replies += LOAD(&s->replies);
+            histogram_merge(&now.latency, &s->latency);
+        }
+
+        interval = now.latency;
+        histogram_subtract(&interval, &last[i].latency);
+        const Upstream *upstream = &set->upstreams[i];
+        fprintf(out, "Upstream %s:%d %s: %.0f requests/s, %.0f replies/s, latency p50 %.1f us, p99 %.1f us\n",
+                inet_ntoa(upstream->addr.sin_addr), ntohs(upstream->addr.sin_port),
+                LOAD(&upstream->up) ? "up" : "down", (now.forwarded - last[i].forwarded) / seconds,
+                (now.replies - last[i].replies) / seconds, histogram_percentile(&interval, 50) / 1e3,
+                histogram_percentile(&interval, 99) / 1e3);
+        last[i] = now;
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef RELAY_UPSTREAM_H
+#define RELAY_UPSTREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "histogram.h"
+
+#define RELAY_MAX_UPSTREAMS 16
+#define UPSTREAM_TIMEOUT_NS 3000000000ULL // Unanswered this long = down
+#define UPSTREAM_PROBE_NS 5000000000ULL   // A down server gets one request this often
+
+typedef enum
+{
+    BALANCE_ROUND_ROBIN,
+    BALANCE_HASH // By chaddr, so a client keeps talking to the same server
+} BalanceMode;
+
+// A DHCP server the relay forwards to. Shared by all workers: a server's
+// replies may reach any of them, so its health is tracked in one place,
+// with atomic loads and stores.
+typedef struct
+{
+    struct sockaddr_in addr;
+    int up;
+    uint64_t oldest_unanswered_ns; // Oldest request sent since the last reply, 0 if none
+    uint64_t last_probe_ns;
+} Upstream;
+
+typedef struct
+{
+    Upstream upstreams[RELAY_MAX_UPSTREAMS];
+    int count;
+    BalanceMode mode;
+    uint32_t next; // Round-robin position
+} UpstreamSet;
+
+// Traffic to one server. Each worker keeps its own array of
+// RELAY_MAX_UPSTREAMS and is its only writer; fields are stored
+// atomically so the reporter may read them at any time.
+typedef struct
+{
+    uint64_t forwarded;
+    uint64_t replies;
+    Histogram latency; // Request to reply, nanoseconds
+} UpstreamStats;
+
+void upstream_set_init(UpstreamSet *set, BalanceMode mode);
+
+// "a.b.c.d" or "a.b.c.d:port"
+int upstream_add(UpstreamSet *set, const char *text, int default_port);
+
+// Index of the server for a request from 'chaddr'. Down servers are
+// skipped, except for one probe per interval across all workers; with
+// every server down the balancer's first choice is used anyway. Only for
+// messages that name no server: see upstream_with_addr().
+int upstream_select(UpstreamSet *set, const uint8_t chaddr[16], uint64_t now_ns);
+
+// The servers at 'addr' (any port), one bit per index; 0 if none. A
+// message carrying a server identifier must reach that server, whatever
+// the balancer would pick: the others ignore it.
+uint32_t upstream_with_addr(const UpstreamSet *set, struct in_addr addr);
+
+// Index of the server whose address is 'from', or -1
+int upstream_find(const UpstreamSet *set, const struct sockaddr_in *from);
+
+// 'expect_reply' is 0 for messages the server need not answer (RELEASE,
+// DECLINE, a copy of a REQUEST meant for another server): they do not
+// count towards marking it down.
+void upstream_sent(UpstreamSet *set, int index, UpstreamStats *stats, uint64_t now_ns, int expect_reply);
+
+// 'latency_ns' is 0 when the request it answers is not known
+void upstream_replied(UpstreamSet *set, int index, UpstreamStats *stats, uint64_t latency_ns);
+
+// Mark servers that stopped answering as down. Called from one thread.
+void upstream_check(UpstreamSet *set, uint64_t now_ns);
+
+// One line per server covering the last 'seconds'. 'stats' holds
+// RELAY_MAX_UPSTREAMS entries for each of 'nworkers' workers; 'last'
+// holds RELAY_MAX_UPSTREAMS totals kept between calls, zeroed before the
+// first.
+void upstream_report(const UpstreamSet *set, const UpstreamStats *stats, int nworkers, UpstreamStats *last,
+                     FILE *out, double seconds);
+
+#endif
@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "reply_cache.h"
+#include "lease_table.h"
+
+int reply_cache_init(ReplyCache *cache, uint32_t slots, uint64_t ttl_ns)
+{
+    memset(cache, 0, sizeof(*cache));
+    uint32_t n = 1;
+    while (n < slots && n < (UINT32_C(1) << 30))
+        n <<= 1;
+    cache->entries = calloc(n, sizeof(ReplyCacheEntry));
+    if (cache->entries == NULL)
+        return -1;
+    cache->mask = n - 1;
+    cache->ttl_ns = ttl_ns;
+    return 0;
+}
+
+void reply_cache_destroy(ReplyCache *cache)
+{
+    free(cache->entries);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static ReplyCacheEntry *slot(ReplyCache *cache, const uint8_t key[16], uint32_t xid, uint8_t message_type)
+{
+    uint32_t h = lease_hash_mac(key) ^ (xid * 0x9e3779b1u) ^ message_type;
+    return &cache->entries[h & cache->mask];
+}
+
+size_t reply_cache_get(ReplyCache *cache, const uint8_t key[16], uint32_t xid, uint8_t message_type,
+                       uint64_t now_ns, DHCPMessage *reply)
+{
+    ReplyCacheEntry *entry = slot(cache, key, xid, message_type);
+    if (entry->length == 0 || entry->xid != xid || entry->message_type != message_type ||
+        memcmp(entry->key, key, 16) != 0 || now_ns - entry->stored_ns > cache->ttl_ns)
+        return 0;
+    memcpy(reply, &entry->reply, entry->length);
+    return entry->length;
+}
+
+void reply_cache_put(ReplyCache *cache, const uint8_t key[16], uint32_t xid, uint8_t message_type,
+                     uint64_t now_ns, const DHCPMessage *reply, size_t length)
+{
+    if (length == 0 || length > sizeof(DHCPMessage))
+        return;
+    ReplyCacheEntry *entry = slot(cache, key, xid, message_type);
+    memcpy(entry->key, key, 16);
+    entry->xid = xid;
+    entry->message_type = message_type;
+    entry->length = (uint16_t)length;
+    entry->stored_ns = now_ns;
+    memcpy(&entry->reply, reply, length);
+}
+
+void reply_cache_clear(ReplyCache *cache)
+{
+    for (uint32_t i = 0; i <= cache->mask; i++)
+        cache->entries[i].length = 0;
+}
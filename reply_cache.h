@@ -0,0 +1,45 @@
+#ifndef REPLY_CACHE_H
+#define REPLY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dhcp.h"
+
+// A reply already sent, kept so a retransmitted request gets the same
+// bytes back without running the handler again
+typedef struct
+{
+    uint8_t key[16]; // Client key (option 61 or chaddr)
+    uint32_t xid;
+    uint8_t message_type;
+    uint16_t length; // 0 = empty slot
+    uint64_t stored_ns;
+    DHCPMessage reply;
+} ReplyCacheEntry;
+
+// Direct-mapped cache of recent replies, one per worker, so lookups need
+// no lock. A colliding entry simply replaces the older one.
+typedef struct
+{
+    ReplyCacheEntry *entries;
+    uint32_t mask;
+    uint64_t ttl_ns;
+} ReplyCache;
+
+// 'slots' is rounded up to a power of two
+int reply_cache_init(ReplyCache *cache, uint32_t slots, uint64_t ttl_ns);
+void reply_cache_destroy(ReplyCache *cache);
+
+// Copy the reply stored for (key, xid, message_type) into 'reply' and
+// return its length, or 0 if there is none younger than the TTL
+size_t reply_cache_get(ReplyCache *cache, const uint8_t key[16], uint32_t xid, uint8_t message_type,
+                       uint64_t now_ns, DHCPMessage *reply);
+
+void reply_cache_put(ReplyCache *cache, const uint8_t key[16], uint32_t xid, uint8_t message_type,
+                     uint64_t now_ns, const DHCPMessage *reply, size_t length);
+
+// Forget every reply, e.g. ACKs whose lease change never reached disk
+void reply_cache_clear(ReplyCache *cache);
+
+#endif
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "reservations.h"
+
+#define RESERVATION_LINE_MAX 256
+#define BUCKET_LOAD 4           // Average reservations per bucket on the first try
+#define SEED_LIMIT (1u << 20)   // Seeds tried for one bucket before using smaller buckets
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+    return x;
+}
+
+// Map a 32-bit hash onto [0, n) without a division
+static uint32_t reduce(uint32_t hash, uint32_t n)
+{
+    return (uint32_t)(((uint64_t)hash * n) >> 32);
+}
+
+static uint32_t bucket_of(const ReservationTable *table, uint64_t mac)
+{
+    return reduce((uint32_t)(mix64(mac) >> 32), table->nbuckets);
+}
+
+static uint32_t slot_of(const ReservationTable *table, uint64_t mac, uint32_t seed)
+{
+    return reduce((uint32_t)mix64(mac + (seed + UINT64_C(1)) * UINT64_C(0x9e3779b97f4a7c15)), table->count);
+}
+
+uint64_t reservation_mac(const uint8_t chaddr[16])
+{
+    uint64_t mac = 0;
+    for (int i = 0; i < 6; i++)
+        mac = mac << 8 | chaddr[i];
+    return mac;
+}
+
+const Reservation *reservation_table_find(const ReservationTable *table, uint64_t mac)
+{
+    if (table->count == 0)
+        return NULL;
+    const Reservation *entry = &table->entries[slot_of(table, mac, table->seeds[bucket_of(table, mac)])];
+    return entry->mac == mac ? entry : NULL;
+}
+
+typedef struct
+{
+    uint32_t bucket;
+    uint32_t size;
+} BucketSize;
+
+static int compare_bucket_size(const void *a, const void *b)
+{
+    const BucketSize *x = a, *y = b;
+    return x->size != y->size ? (x->size < y->size) - (x->size > y->size) : (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+// Find a seed for every bucket, largest buckets first while most slots
+// are still free. 0 on success, -1 if some bucket exhausted SEED_LIMIT.
+static int place(ReservationTable *table, const Reservation *list)
+{
+    uint32_t n = table->count, nb = table->nbuckets;
+    uint32_t *start = calloc(nb + 1, sizeof(uint32_t));
+    uint32_t *members = malloc(n * sizeof(uint32_t));
+    BucketSize *order = malloc(nb * sizeof(BucketSize));
+    uint8_t *taken = calloc(n, 1);
+    uint32_t slots[64];
+    int result = -1;
+    if (start == NULL || members == NULL || order == NULL || taken == NULL)
+        goto out;
+
+    // Group the reservations by bucket
+    for (uint32_t i = 0; i < n; i++)
+        start[bucket_of(table, list[i].mac) + 1]++;
+    for (uint32_t b = 0; b < nb; b++)
+    {
+        order[b].bucket = b;
+        order[b].size = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t b = bucket_of(table, list[i].mac);
+        members[start[b] + --order[b].size] = i;
+    }
+    for (uint32_t b = 0; b < nb; b++)
+        order[b].size = start[b + 1] - start[b];
+    qsort(order, nb, sizeof(BucketSize), compare_bucket_size);
+
+    for (uint32_t o = 0; o < nb && order[o].size > 0; o++)
+    {
+        uint32_t b = order[o].bucket, size = order[o].size;
+        if (size > sizeof(slots) / sizeof(slots[0]))
+            goto out;
+        uint32_t seed;
+        for (seed = 0; seed < SEED_LIMIT; seed++)
+        {
+            uint32_t k;
+            for (k = 0; k < size; k++)
+            {
+                slots[k] = slot_of(table, list[members[start[b] + k]].mac, seed);
+                if (taken[slots[k]])
+                    break;
+                uint32_t j = 0;
+                while (j < k && slots[j] != slots[k])
+                    j++;
+                if (j < k)
+                    break;
+            }
+            if (k == size)
+                break;
+        }
+        if (seed == SEED_LIMIT)
+            goto out;
+
+        table->seeds[b] = seed;
+        for (uint32_t k = 0; k < size; k++)
+        {
+            taken[slots[k]] = 1;
+            table->entries[slots[k]] = list[members[start[b] + k]];
+        }
+    }
+    result = 0;
+
+out:
+    free(start);
+    free(members);
+    free(order);
+    free(taken);
+    return result;
+}
+
+static int compare_mac(const void *a, const void *b)
+{
+    const Reservation *x = a, *y = b;
+    return (x->mac > y->mac) - (x->mac < y->mac);
+}
+
+static int compare_ip(const void *a, const void *b)
+{
+    uint32_t x = ntohl(((const Reservation *)a)->ip.s_addr), y = ntohl(((const Reservation *)b)->ip.s_addr);
+    return (x > y) - (x < y);
+}
+
+// Reject a MAC or address given twice, which the hash cannot tell apart
+static int check_duplicates(const Reservation *list, uint32_t count)
+{
+    char text[INET_ADDRSTRLEN];
+    Reservation *sorted = malloc(count * sizeof(Reservation));
+    if (sorted == NULL)
+        return -1;
+    memcpy(sorted, list, count * sizeof(Reservation));
+
+    int result = 0;
+    qsort(sorted, count, sizeof(Reservation), compare_mac);
+    for (uint32_t i = 1; i < count && result == 0; i++)
+    {
+        if (sorted[i].mac == sorted[i - 1].mac)
+        {
+            fprintf(stderr, "Error: MAC %012llx reserved twice\n", (unsigned long long)sorted[i].mac);
+            result = -1;
+        }
+    }
+    qsort(sorted, count, sizeof(Reservation), compare_ip);
+    for (uint32_t i = 1; i < count && result == 0; i++)
+    {
+        if (sorted[i].ip.s_addr == sorted[i - 1].ip.s_addr)
+        {
+            inet_ntop(AF_INET, &sorted[i].ip, text, sizeof(text));
+            fprintf(stderr, "Error: address %s reserved twice\n", text);
+            result = -1;
+        }
+    }
+    free(sorted);
+    return result;
+}
+
+int reservation_table_build(ReservationTable *table, const Reservation *list, uint32_t count)
+{
+    memset(table, 0, sizeof(*table));
+    if (count == 0)
+        return 0;
+    if (check_duplicates(list, count) < 0)
+        return -1;
+
+    table->count = count;
+    table->entries = calloc(count, sizeof(Reservation));
+    if (table->entries == NULL)
+        return -1;
+
+    // Smaller buckets are easier to place; fall back to them in the
+    // unlikely case a large one finds no seed
+    for (uint32_t load = BUCKET_LOAD; load > 0; load--)
+    {
+        free(table->seeds);
+        table->nbuckets = (count + load - 1) / load;
+        table->seeds = calloc(table->nbuckets, sizeof(uint32_t));
+        if (table->seeds == NULL)
+            break;
+        if (place(table, list) == 0)
+            return 0;
+    }
+    reservation_table_destroy(table);
+    return -1;
+}
+
+void reservation_table_destroy(ReservationTable *table)
+{
+    free(table->entries);
+    free(table->seeds);
+    memset(table, 0, sizeof(*table));
+}
+
+static int parse_mac(const char *text, uint64_t *mac)
+{
+    unsigned int b[6];
+    char end;
+    if (text == NULL || sscanf(text, "%2x:%2x:%2x:%2x:%2x:%2x%c", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6)
+        return -1;
+    *mac = 0;
+    for (int i = 0; i < 6; i++)
+        *mac = *mac << 8 | b[i];
+    return 0;
+}
+
+int reservation_table_load(ReservationTable *table, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    Reservation *list = NULL;
+    uint32_t count = 0, capacity = 0;
+    char line[RESERVATION_LINE_MAX];
+    int lineno = 0;
+    const char *error = NULL;
+    while (error == NULL && fgets(line, sizeof(line), file) != NULL)
+    {
+        lineno++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char *save;
+        char *mac = strtok_r(line, " \t\r\n", &save);
+        if (mac == NULL)
+            continue;
+        char *addr = strtok_r(NULL, " \t\r\n", &save);
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            Reservation *grown = realloc(list, capacity * sizeof(Reservation));
+            if (grown == NULL)
+            {
+                error = "out of memory";
+                break;
+            }
+            list = grown;
+        }
+        Reservation *r = &list[count];
+        if (parse_mac(mac, &r->mac) < 0)
+            error = "expected a MAC address";
+        else if (addr == NULL || inet_pton(AF_INET, addr, &r->ip) != 1)
+            error = "expected an address";
+        else if (strtok_r(NULL, " \t\r\n", &save) != NULL)
+            error = "unexpected text after the address";
+        else
+            count++;
+    }
+    fclose(file);
+
+    if (error != NULL)
+    {
+        fprintf(stderr, "%s:%d: %s\n", path, lineno, error);
+        free(list);
+        return -1;
+    }
+    int result = reservation_table_build(table, list, count);
+    free(list);
+    return result;
+}
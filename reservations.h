@@ -0,0 +1,43 @@
+#ifndef RESERVATIONS_H
+#define RESERVATIONS_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// A fixed address for one hardware address
+typedef struct
+{
+    uint64_t mac; // Ethernet address in the low 48 bits
+    struct in_addr ip;
+} Reservation;
+
+// Reservations indexed by a minimal perfect hash built once at startup
+// (hash and displace): the MAC picks a bucket, the bucket's seed rehashes
+// it to a slot of 'entries', which holds exactly 'count' reservations.
+// A lookup reads one seed and compares one entry. The table is never
+// modified after it is built, so workers read it without locks.
+typedef struct
+{
+    Reservation *entries;
+    uint32_t *seeds; // Displacement seed per bucket
+    uint32_t count;
+    uint32_t nbuckets;
+} ReservationTable;
+
+// Build from 'count' reservations. Fails if a MAC or an address appears
+// twice.
+int reservation_table_build(ReservationTable *table, const Reservation *list, uint32_t count);
+
+// Read "mac address" lines ('#' starts a comment) and build the table.
+// Errors are printed with the file and line.
+int reservation_table_load(ReservationTable *table, const char *path);
+
+void reservation_table_destroy(ReservationTable *table);
+
+// Pack the first six bytes of chaddr
+uint64_t reservation_mac(const uint8_t chaddr[16]);
+
+// Reservation for 'mac', or NULL
+const Reservation *reservation_table_find(const ReservationTable *table, uint64_t mac);
+
+#endif
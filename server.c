@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -6,466 +7,919 @@
 #include <time.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "dhcp.h"
+#include "dhcp_options.h"
+#include "dhcp_reply.h"
+#include "lease_store.h"
+#include "lease_db.h"
+#include "batch_io.h"
+#include "uring_io.h"
+#include "packet_ring.h"
+#include "metrics.h"
+#include "log.h"
+#include "subnet.h"
+#include "reply_cache.h"
+#include "reservations.h"
 
 #define BUFFER_SIZE 1024
 #define DHCP_SERVER_PORT 67
 #define CIDR_NOTATION "192.17.0.1/32"
 #define LEASE_TIME 20 // 5 seconds for testing purposes
 #define DNS_SERVER "8.8.8.8"
+#define EXPIRE_BATCH 256 // Leases expired per shard lock acquisition
+#define MAX_BATCH_SIZE 1024
+#define URING_BUFFERS 512 // Receive buffers per worker ring
+#define IO_STATS_INTERVAL 10 // Seconds between batched I/O reports
+#define MAX_WORKERS 256
+#define SNAPSHOT_RECORDS 100000 // Journal records that trigger a snapshot
+#define SNAPSHOT_INTERVAL 300   // Seconds between snapshots while leases change
+#define OFFER_TTL 10            // Seconds an offered address stays reserved
+#define DECLINE_TTL 600         // Seconds a declined address stays out of the pool
+#define REPLY_CACHE_SLOTS 1024  // Recent replies kept per worker
+#define REPLY_CACHE_TTL 4       // Seconds a reply answers retransmissions
 
 typedef struct
 {
-    uint8_t op;
-    uint8_t htype;
-    uint8_t hlen;
-    uint8_t hops;
-    uint32_t xid;
-    uint16_t secs;
-    uint16_t flags;
-    uint32_t ciaddr;
-    uint32_t yiaddr;
-    uint32_t siaddr;
-    uint32_t giaddr;
-    uint8_t chaddr[16];
-    uint8_t sname[64];
-    uint8_t file[128];
-    uint8_t options[312];
-} DHCPMessage;
+    int id;
+    int sockfd;
+    int cpu; // CPU the worker is pinned to, or -1
+    BatchIOStats io_stats; // Published by the worker, see batch_io_stats_publish()
+    PacketRing *packet_ring; // -R: raw frames instead of the socket
+    WorkerMetrics *metrics;
+    ReplyCache reply_cache;
+} Worker;
 
-typedef struct
-{
-    struct in_addr ip;
-    time_t lease_start;
-    time_t lease_expiration;
-    uint8_t chaddr[16];
-} IPLease;
+LeaseStore lease_store;
+LeaseDB lease_db;
+const char *lease_db_dir = NULL; // NULL = leases are not persisted
 
-IPLease ip_leases[256];
-int lease_count = 0;
+// Last journal record written by this worker that its reply depends on
+static __thread uint64_t commit_seq;
 
-struct in_addr network_address;
-struct in_addr subnet_mask;
-struct in_addr broadcast_address;
-struct in_addr default_gateway;
-struct in_addr ip_range_start;
-struct in_addr ip_range_end;
+// Counters of the worker running on this thread
+static __thread WorkerMetrics *metrics;
 
-// Agregar un mutex global para proteger el acceso a recursos compartidos
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// Replies recently sent by the worker running on this thread
+static __thread ReplyCache *reply_cache;
 
-void initialize_network()
+static void count_outcome(int outcome)
+{
+    metrics_count(&metrics->outcomes[outcome]);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+Worker *workers;
+WorkerMetrics *worker_metrics; // One per worker, contiguous for the scraper
+const char *metrics_path = NULL; // UNIX socket for metrics and admin commands
+int worker_count = 0;  // 0 = one per online CPU
+int reuseport_mode = 0; // One SO_REUSEPORT socket per worker
+int worker_cpus[MAX_WORKERS];
+int worker_cpu_count = 0;
+unsigned int batch_size = 1; // 1 = one recvfrom()/sendto() per packet
+unsigned int flush_timeout_us = 0;
+int uring_mode = 0; // io_uring backend instead of recvmmsg()/sendmmsg()
+const char *raw_interface = NULL; // -R: serve this interface through a packet ring
+int server_port = DHCP_SERVER_PORT;
+uint32_t pool_size = 10; // Addresses handed out, starting at network + 2
+uint32_t offer_ttl = OFFER_TTL;
+uint32_t decline_ttl = DECLINE_TTL;
+int rapid_commit = 0; // -k: Rapid Commit on the subnet built without -f
+
+SubnetConfig subnets;
+ReservationTable reservations;
+const char *reservations_path = NULL; // -H: fixed addresses by MAC
+const char *config_path = NULL; // NULL = one subnet built from CIDR_NOTATION and -n
+
+// Without a configuration file: the address in CIDR_NOTATION is the
+// server's own, the next one the gateway, and pool_size addresses follow.
+// The prefix is widened until the subnet holds the whole range.
+static void default_subnet(void)
 {
     char ip_str[16];
     int prefix_len;
-    sscanf(CIDR_NOTATION, "%[^/]/%d", ip_str, &prefix_len);
+    sscanf(CIDR_NOTATION, "%15[^/]/%d", ip_str, &prefix_len);
     if (prefix_len > 32)
     {
         fprintf(stderr, "Error: CIDR prefix length cannot be greater than 32.\n");
         exit(1);
     }
+    inet_pton(AF_INET, ip_str, &subnets.server_id);
+
+    uint32_t server = ntohl(subnets.server_id.s_addr);
+    uint32_t first = server + 2;
+    uint32_t last = first + pool_size - 1;
+    if (prefix_len > 24)
+        prefix_len = 24;
+    while (prefix_len > 0 && ((server ^ last) >> (32 - prefix_len)) != 0)
+        prefix_len--;
+
+    Subnet *subnet = subnet_config_add(&subnets, server, prefix_len);
+    if (subnet == NULL || subnet_add_range(subnet, first, last) < 0)
+    {
+        fprintf(stderr, "Error: cannot allocate the subnet.\n");
+        exit(1);
+    }
+    subnet->lease_time = LEASE_TIME;
+    subnet->router.s_addr = htonl(server + 1);
+    inet_aton(DNS_SERVER, &subnet->dns_server);
+    subnet->rapid_commit = rapid_commit;
+}
 
-    inet_pton(AF_INET, ip_str, &network_address);
+void initialize_network()
+{
+    char net[INET_ADDRSTRLEN], first[INET_ADDRSTRLEN], last[INET_ADDRSTRLEN];
 
-    uint32_t mask = 0xffffffff << (32 - prefix_len);
-    subnet_mask.s_addr = htonl(mask);
+    subnet_config_init(&subnets);
+    if (config_path == NULL)
+        default_subnet();
+    else if (subnet_config_load(&subnets, config_path) < 0)
+        exit(1);
+    if (subnet_config_finish(&subnets) < 0)
+        exit(1);
 
-    broadcast_address.s_addr = network_address.s_addr | ~subnet_mask.s_addr;
+    // One pool per range, in the same order as the subnets
+    uint32_t nranges;
+    IPRange *ranges = subnet_config_ranges(&subnets, &nranges);
+    if (ranges == NULL || lease_store_init_ranges(&lease_store, ranges, nranges, LEASE_SHARDS, time(NULL)) < 0)
+    {
+        fprintf(stderr, "Error: cannot allocate the lease store.\n");
+        exit(1);
+    }
+    free(ranges);
 
-    // Calculate default gateway (first usable IP in the network)
-    default_gateway.s_addr = htonl(ntohl(network_address.s_addr) + 1);
+    // Reserved addresses are never handed out dynamically, even to their
+    // owner on another subnet
+    if (reservations_path != NULL)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (reservation_table_load(&reservations, reservations_path) < 0)
+            exit(1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        for (uint32_t i = 0; i < reservations.count; i++)
+        {
+            if (lease_store_exclude(&lease_store, reservations.entries[i].ip) == LEASE_TAKEN)
+            {
+                fprintf(stderr, "Error: reserved address %s is taken twice\n", inet_ntoa(reservations.entries[i].ip));
+                exit(1);
+            }
+        }
+        printf("Reservations: %u from %s, table built in %.1f ms\n", reservations.count, reservations_path,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
 
-    // Calculate IP range (10 IPs for testing)
-    ip_range_start.s_addr = htonl(ntohl(network_address.s_addr) + 2);
-    ip_range_end.s_addr = htonl(ntohl(ip_range_start.s_addr) + 9);
+    printf("Server Identifier: %s\n", inet_ntoa(subnets.server_id));
+    for (uint32_t i = 0; i < subnets.count; i++)
+    {
+        Subnet *subnet = &subnets.subnets[i];
+        struct in_addr addr = {htonl(subnet->network)};
+        inet_ntop(AF_INET, &addr, net, sizeof(net));
+        uint64_t size = 0;
+        for (uint32_t r = 0; r < subnet->nranges; r++)
+            size += (uint64_t)subnet->ranges[r].last - subnet->ranges[r].first + 1;
+        printf("Subnet %s/%d: %llu addresses in %u ranges, lease %u s, router %s",
+               net, subnet->prefix_len, (unsigned long long)size, subnet->nranges, subnet->lease_time,
+               inet_ntoa(subnet->router));
+        if (subnet->ifindex != 0)
+            printf(", interface %s", subnet->interface);
+        if (subnet->rapid_commit)
+            printf(", rapid commit");
+        printf("\n");
+        if (subnet->nranges > 0)
+        {
+            addr.s_addr = htonl(subnet->ranges[0].first);
+            inet_ntop(AF_INET, &addr, first, sizeof(first));
+            addr.s_addr = htonl(subnet->ranges[subnet->nranges - 1].last);
+            inet_ntop(AF_INET, &addr, last, sizeof(last));
+            printf("  IP Range: %s - %s\n", first, last);
+        }
+    }
+}
 
-    printf("Network: %s\n", inet_ntoa(network_address));
-    printf("Subnet Mask: %s\n", inet_ntoa(subnet_mask));
-    printf("Broadcast: %s\n", inet_ntoa(broadcast_address));
-    printf("Default Gateway: %s\n", inet_ntoa(default_gateway));
-    printf("IP Range Start: %s\n", inet_ntoa(ip_range_start));
-    printf("IP Range End: %s\n", inet_ntoa(ip_range_end));
+// Journal a lease change; the reply is held back until it is on disk
+static void journal_lease(uint32_t type, struct in_addr ip, const uint8_t key[16], time_t start, time_t expiration)
+{
+    if (lease_db_dir != NULL)
+        commit_seq = lease_db_append(&lease_db, type, ip, key, start, expiration);
 }
 
-int is_ip_in_range(struct in_addr ip)
+// Returns -1 if the changes never reached disk: the replies built on them
+// must not go out, and the client retries
+static int commit_journal(void)
 {
-    return (ntohl(ip.s_addr) >= ntohl(ip_range_start.s_addr) && ntohl(ip.s_addr) <= ntohl(ip_range_end.s_addr));
+    if (commit_seq == 0)
+        return 0;
+    int ret = lease_db_wait(&lease_db, commit_seq);
+    commit_seq = 0;
+    if (ret < 0)
+    {
+        // Nor may a retransmission get the cached ACK
+        reply_cache_clear(reply_cache);
+        metrics_count(&metrics->journal_errors);
+        log_every(LOG_LEVEL_ERROR, 10, "Lease journal failed (%s), dropping replies", strerror(errno));
+    }
+    return ret;
 }
 
-struct in_addr get_available_ip()
+// Each handler builds its reply in 'reply' and returns the number of
+// bytes to send, or 0 when the message gets no answer.
+// Parameter request list of the client, or NULL to send every option
+static const uint8_t *requested_params(const DHCPOptions *opts, uint8_t *len)
 {
-    struct in_addr ip = ip_range_start;
-    for (uint32_t i = 0; i <= ntohl(ip_range_end.s_addr) - ntohl(ip_range_start.s_addr); i++)
+    return dhcp_option_get(opts, DHO_PARAMETER_LIST, len);
+}
+
+// The client's reserved address, if it has one on 'subnet'
+static const Reservation *reservation_for(const DHCPMessage *msg, const Subnet *subnet)
+{
+    if (reservations.count == 0 || msg->hlen != 6)
+        return NULL;
+    const Reservation *fixed = reservation_table_find(&reservations, reservation_mac(msg->chaddr));
+    if (fixed == NULL || !subnet_contains(subnet, ntohl(fixed->ip.s_addr)))
+        return NULL;
+    return fixed;
+}
+
+size_t handle_dhcp_discover(DHCPMessage *msg, const DHCPOptions *opts, const uint8_t client_key[16],
+                            Subnet *subnet, struct sockaddr_in *client_addr, DHCPMessage *reply)
+{
+    // A static reservation needs no lease state. Otherwise the address is
+    // reserved until the REQUEST or the TTL, so a burst of DISCOVERs gets
+    // distinct addresses.
+    struct in_addr available_ip;
+    const Reservation *fixed = reservation_for(msg, subnet);
+    if (fixed != NULL)
+    {
+        available_ip = fixed->ip;
+    }
+    else
     {
-        ip.s_addr = htonl(ntohl(ip_range_start.s_addr) + i);
-        int available = 1;
-        for (int j = 0; j < lease_count; j++)
+        int status = lease_store_offer(&lease_store, subnet->first_pool, subnet->nranges, client_key,
+                                       time(NULL), offer_ttl, &available_ip);
+        if (status == LEASE_EXHAUSTED)
         {
-            if (ip_leases[j].ip.s_addr == ip.s_addr)
-            {
-                available = 0;
-                break;
-            }
+            log_warn("No available IP addresses");
+            count_outcome(METRIC_NO_FREE_IP);
+            return 0;
+        }
+        if (status != LEASE_OK)
+        {
+            log_error("Offer table full");
+            count_outcome(METRIC_STORE_ERROR);
+            return 0;
         }
-        if (available)
-            return ip;
     }
-    ip.s_addr = INADDR_NONE;
-    return ip;
+
+    uint8_t prl_len = 0;
+    const uint8_t *prl = requested_params(opts, &prl_len);
+
+    // Rapid Commit: the address just reserved is leased right away and the
+    // ACK stands in for OFFER, REQUEST and ACK (RFC 4039)
+    if (subnet->rapid_commit && dhcp_option_present(opts, DHO_RAPID_COMMIT))
+    {
+        time_t now = time(NULL);
+        if (fixed != NULL || lease_store_grant(&lease_store, available_ip, client_key, now, subnet->lease_time) == LEASE_OK)
+        {
+            if (fixed == NULL)
+                journal_lease(LEASE_DB_GRANT, available_ip, client_key, now, now + subnet->lease_time);
+            size_t len = reply_template_build(&subnet->rapid_ack, msg, available_ip.s_addr, prl, prl_len, reply);
+            count_outcome(METRIC_RAPID_COMMIT);
+            log_info("Sent DHCP ACK (rapid commit) to %s", inet_ntoa(client_addr->sin_addr));
+            return len;
+        }
+    }
+
+    size_t len = reply_template_build(&subnet->offer, msg, available_ip.s_addr, prl, prl_len, reply);
+    count_outcome(METRIC_OFFERED);
+    log_info("Sent DHCP OFFER to %s", inet_ntoa(client_addr->sin_addr));
+    return len;
 }
 
-void handle_dhcp_discover(int sockfd, DHCPMessage *msg, struct sockaddr_in *client_addr)
+// DHCPNAK: the client drops the address it asked for and starts over
+static size_t build_nak(DHCPMessage *msg, Subnet *subnet, DHCPMessage *reply)
 {
-    struct in_addr available_ip = get_available_ip();
-    if (available_ip.s_addr == INADDR_NONE)
+    metrics_count(&metrics->naks);
+    return reply_template_build(&subnet->nak, msg, 0, NULL, 0, reply);
+}
+
+size_t handle_dhcp_request(DHCPMessage *msg, const DHCPOptions *opts, const uint8_t client_key[16],
+                           Subnet *subnet, struct sockaddr_in *client_addr, DHCPMessage *reply)
+{
+    // A client answering another server's offer names that server. One
+    // rebooting with a cached lease (INIT-REBOOT) names none. Either way,
+    // a client that cannot have the address is told at once instead of
+    // retransmitting until it gives up (RFC 2131 4.3.2).
+    struct in_addr server_id;
+    int rebooting = !dhcp_option_addr(opts, DHO_SERVER_ID, &server_id);
+    if (!rebooting && server_id.s_addr != subnets.server_id.s_addr)
     {
-        printf("No available IP addresses\n");
-        return;
+        log_info("REQUEST addressed to server %s, ignoring", inet_ntoa(server_id));
+        count_outcome(METRIC_OTHER_SERVER);
+        return 0;
     }
 
-    DHCPMessage offer_msg;
-    memset(&offer_msg, 0, sizeof(offer_msg));
-    offer_msg.op = 2; // BOOTREPLY
-    offer_msg.htype = msg->htype;
-    offer_msg.hlen = msg->hlen;
-    offer_msg.xid = msg->xid;
-    memcpy(offer_msg.chaddr, msg->chaddr, 16);
-    offer_msg.yiaddr = available_ip.s_addr;
-    offer_msg.flags = htons(0x8000); // Broadcast flag
-
-    // Set DHCP options
-    uint8_t *options = offer_msg.options;
-    options[0] = 0x63; // Magic cookie
-    options[1] = 0x82;
-    options[2] = 0x53;
-    options[3] = 0x63;
+    // Option 50 carries the address; older clients put it in yiaddr
+    struct in_addr requested_ip;
+    if (!dhcp_option_addr(opts, DHO_REQUESTED_IP, &requested_ip) || requested_ip.s_addr == 0)
+        requested_ip.s_addr = msg->yiaddr;
 
-    options[4] = 53; // DHCP Message Type
-    options[5] = 1;  // Length
-    options[6] = 2;  // DHCPOFFER
+    // A client with a reservation gets that address and no other; asking
+    // for another one sends it back to DISCOVER
+    const Reservation *fixed = reservation_for(msg, subnet);
+    if (fixed != NULL && fixed->ip.s_addr != requested_ip.s_addr)
+    {
+        log_info("REQUEST for %s from a client with a reservation", inet_ntoa(requested_ip));
+        count_outcome(METRIC_OUT_OF_RANGE);
+        return build_nak(msg, subnet, reply);
+    }
 
-    options[7] = 51; // IP Address Lease Time
-    options[8] = 4;  // Length
-    uint32_t lease_time = htonl(LEASE_TIME);
-    memcpy(&options[9], &lease_time, 4);
+    // The address must belong to the subnet the client is on
+    if (fixed == NULL && (!subnet_contains(subnet, ntohl(requested_ip.s_addr)) || !lease_store_in_range(&lease_store, requested_ip)))
+    {
+        log_warn("Requested IP out of range %s", inet_ntoa(requested_ip));
+        count_outcome(METRIC_OUT_OF_RANGE);
+        return build_nak(msg, subnet, reply);
+    }
 
-    options[13] = 1; // Subnet Mask
-    options[14] = 4; // Length
-    memcpy(&options[15], &subnet_mask, 4);
+    time_t now = time(NULL);
+    int status = fixed != NULL ? LEASE_OK : lease_store_grant(&lease_store, requested_ip, client_key, now, subnet->lease_time);
+    if (status == LEASE_TAKEN)
+    {
+        log_warn("IP already leased");
+        count_outcome(METRIC_ALREADY_LEASED);
+        return build_nak(msg, subnet, reply);
+    }
+    if (status != LEASE_OK)
+    {
+        log_error("Lease table full");
+        count_outcome(METRIC_STORE_ERROR);
+        return 0;
+    }
+    if (fixed == NULL)
+        journal_lease(LEASE_DB_GRANT, requested_ip, client_key, now, now + subnet->lease_time);
+
+    uint8_t prl_len = 0;
+    const uint8_t *prl = requested_params(opts, &prl_len);
+    size_t len = reply_template_build(&subnet->ack, msg, requested_ip.s_addr, prl, prl_len, reply);
+    count_outcome(rebooting ? METRIC_REBOOTED : METRIC_ACKED);
+    log_info("Sent DHCP ACK to %s", inet_ntoa(client_addr->sin_addr));
+    return len;
+}
 
-    options[19] = 6; // DNS Server
-    options[20] = 4; // Length
-    struct in_addr dns_server;
-    inet_aton(DNS_SERVER, &dns_server);
-    memcpy(&options[21], &dns_server, 4);
+void handle_dhcp_release(DHCPMessage *msg, const uint8_t client_key[16])
+{
+    struct in_addr released_ip;
+    released_ip.s_addr = msg->ciaddr ? msg->ciaddr : msg->yiaddr;
 
-    options[25] = 3; // Router (Default Gateway)
-    options[26] = 4; // Length
-    memcpy(&options[27], &default_gateway, 4);
+    log_debug("Releasing IP: %s", inet_ntoa(released_ip));
 
-    options[31] = 255; // End option
+    if (lease_store_release(&lease_store, released_ip, client_key) == LEASE_OK)
+    {
+        journal_lease(LEASE_DB_RELEASE, released_ip, client_key, 0, 0);
+        log_info("Released IP: %s", inet_ntoa(released_ip));
+        count_outcome(METRIC_RELEASED);
+        return;
+    }
+    count_outcome(METRIC_RELEASE_UNKNOWN);
+    log_warn("IP not found for release: %s", inet_ntoa(released_ip));
+}
 
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = client_addr->sin_port;
-    dest_addr.sin_addr = client_addr->sin_addr;
+size_t handle_dhcp_renew(DHCPMessage *msg, const DHCPOptions *opts, const uint8_t client_key[16],
+                         Subnet *subnet, DHCPMessage *reply)
+{
+    struct in_addr client_ip;
+    client_ip.s_addr = msg->ciaddr; // Cambiado de msg->yiaddr a msg->ciaddr
 
-    ssize_t sent_len = sendto(sockfd, &offer_msg, sizeof(offer_msg), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+    // The lease carries its own subnet, whichever way the renewal arrived
+    Subnet *lease_subnet = subnet_find(&subnets, ntohl(client_ip.s_addr));
 
-    if (sent_len < 0)
+    // Renew the lease; a reserved address has none to extend
+    time_t now = time(NULL);
+    int renewed = 0;
+    if (lease_subnet != NULL)
     {
-        perror("Error sending DHCP OFFER");
+        const Reservation *fixed = reservation_for(msg, lease_subnet);
+        if (fixed != NULL)
+            renewed = fixed->ip.s_addr == client_ip.s_addr;
+        else if (lease_store_renew(&lease_store, client_ip, client_key, now, lease_subnet->lease_time) == LEASE_OK)
+        {
+            journal_lease(LEASE_DB_RENEW, client_ip, client_key, now, now + lease_subnet->lease_time);
+            renewed = 1;
+        }
     }
-    else
+    if (renewed)
     {
-        printf("Sent DHCP OFFER to %s\n", inet_ntoa(dest_addr.sin_addr));
+        // Send DHCPACK
+        uint8_t prl_len = 0;
+        const uint8_t *prl = requested_params(opts, &prl_len);
+        size_t len = reply_template_build(&lease_subnet->ack, msg, client_ip.s_addr, prl, prl_len, reply);
+        log_info("Renewed lease for IP: %s", inet_ntoa(client_ip));
+        count_outcome(METRIC_RENEWED);
+        return len;
     }
+    // No such lease (it expired, or the server lost it): the client
+    // starts over now rather than retrying until the lease runs out
+    count_outcome(METRIC_RENEW_FAILED);
+    log_warn("Renewal failed for IP: %s", inet_ntoa(client_ip));
+    return build_nak(msg, lease_subnet != NULL ? lease_subnet : subnet, reply);
 }
 
-void handle_dhcp_request(int sockfd, DHCPMessage *msg, struct sockaddr_in *client_addr)
+// DHCPDECLINE: the client found the address already in use. It is kept
+// out of the pool for decline_ttl so nobody else is handed it meanwhile.
+void handle_dhcp_decline(DHCPMessage *msg, const DHCPOptions *opts, const uint8_t client_key[16])
 {
-    struct in_addr requested_ip;
-    requested_ip.s_addr = msg->yiaddr;
-
-    if (!is_ip_in_range(requested_ip))
+    struct in_addr server_id, declined_ip;
+    if (dhcp_option_addr(opts, DHO_SERVER_ID, &server_id) && server_id.s_addr != subnets.server_id.s_addr)
     {
-        printf("Requested IP out of range %s\n", inet_ntoa(requested_ip));
+        count_outcome(METRIC_OTHER_SERVER);
         return;
     }
+    if (!dhcp_option_addr(opts, DHO_REQUESTED_IP, &declined_ip))
+        declined_ip.s_addr = msg->ciaddr;
 
-    for (int i = 0; i < lease_count; i++)
+    time_t now = time(NULL);
+    if (lease_store_decline(&lease_store, declined_ip, client_key, now, decline_ttl) == LEASE_OK)
     {
-        if (ip_leases[i].ip.s_addr == requested_ip.s_addr)
-        {
-            printf("IP already leased\n");
-            return;
-        }
+        uint8_t key[16];
+        lease_store_decline_key(declined_ip, key);
+        journal_lease(LEASE_DB_RELEASE, declined_ip, client_key, 0, 0);
+        journal_lease(LEASE_DB_GRANT, declined_ip, key, now, now + decline_ttl);
+        log_warn("IP %s declined, quarantined for %u s", inet_ntoa(declined_ip), decline_ttl);
+        count_outcome(METRIC_DECLINED);
+        return;
     }
+    count_outcome(METRIC_DECLINE_UNKNOWN);
+    log_warn("Decline for IP not leased to the client: %s", inet_ntoa(declined_ip));
+}
 
-    ip_leases[lease_count].ip = requested_ip;
-    ip_leases[lease_count].lease_start = time(NULL);
-    ip_leases[lease_count].lease_expiration = time(NULL) + LEASE_TIME;
-    memcpy(ip_leases[lease_count].chaddr, msg->chaddr, 16);
-    lease_count++;
+// DHCPINFORM: a host with a configured address asks only for the other
+// parameters. Nothing is leased; the ACK goes back to ciaddr.
+size_t handle_dhcp_inform(DHCPMessage *msg, const DHCPOptions *opts, Subnet *subnet, DHCPMessage *reply)
+{
+    Subnet *own = subnet_find(&subnets, ntohl(msg->ciaddr));
+    if (own != NULL)
+        subnet = own;
+
+    uint8_t prl_len = 0;
+    const uint8_t *prl = requested_params(opts, &prl_len);
+    size_t len = reply_template_build(&subnet->inform, msg, 0, prl, prl_len, reply);
+    reply->ciaddr = msg->ciaddr;
+    count_outcome(METRIC_INFORMED);
+    return len;
+}
 
-    DHCPMessage ack_msg;
-    memset(&ack_msg, 0, sizeof(ack_msg));
-    ack_msg.op = 2; // BOOTREPLY
-    ack_msg.htype = msg->htype;
-    ack_msg.hlen = msg->hlen;
-    ack_msg.xid = msg->xid;
-    memcpy(ack_msg.chaddr, msg->chaddr, 16);
-    ack_msg.yiaddr = requested_ip.s_addr;
+typedef struct
+{
+    FILE *out;
+    time_t now;
+} LeaseDump;
 
-    // Set DHCP options
-    uint8_t *options = ack_msg.options;
-    bzero(options, sizeof(ack_msg.options));
-    options[0] = 0x63; // Magic cookie
-    options[1] = 0x82;
-    options[2] = 0x53;
-    options[3] = 0x63;
+static void print_lease(const IPLease *lease, void *arg)
+{
+    LeaseDump *dump = arg;
+    char mac_str[18];
+    snprintf(mac_str, sizeof(mac_str), "%02x:%02x:%02x:%02x:%02x:%02x",
+             lease->chaddr[0], lease->chaddr[1], lease->chaddr[2],
+             lease->chaddr[3], lease->chaddr[4], lease->chaddr[5]);
 
-    options[4] = 53; // DHCP Message Type
-    options[5] = 1;  // Length
-    options[6] = 5;  // DHCPACK
+    time_t remaining = lease->lease_expiration - dump->now;
 
-    options[7] = 51; // IP Address Lease Time
-    options[8] = 4;  // Length
-    uint32_t lease_time = htonl(LEASE_TIME);
-    memcpy(&options[9], &lease_time, 4);
+    fprintf(dump->out, "IP: %s, MAC: %s, Expires in: %ld seconds\n",
+            inet_ntoa(lease->ip), mac_str, remaining);
+}
 
-    options[13] = 1; // Subnet Mask
-    options[14] = 4; // Length
-    memcpy(&options[15], &subnet_mask, 4);
+// Admin command. Leases are formatted into memory while each shard is
+// locked and written out afterwards, so a slow reader cannot stall the
+// workers.
+void print_active_leases(FILE *out)
+{
+    char *text = NULL;
+    size_t len = 0;
+    LeaseDump dump = {open_memstream(&text, &len), time(NULL)};
+    if (dump.out == NULL)
+        return;
+    fprintf(dump.out, "\n--- Active IP Leases ---\n");
+    lease_store_foreach(&lease_store, print_lease, &dump);
+    fprintf(dump.out, "------------------------\n\n");
+    fclose(dump.out);
+    fwrite(text, 1, len, out);
+    free(text);
+}
 
-    options[19] = 6; // DNS Server
-    options[20] = 4; // Length
-    struct in_addr dns_server;
-    inet_aton(DNS_SERVER, &dns_server);
-    memcpy(&options[21], &dns_server, 4);
+// 'ifindex' is the interface the message arrived on, or 0 if unknown
+size_t process_dhcp_message(const uint8_t *packet, size_t len, struct sockaddr_in *client_addr, int ifindex,
+                            DHCPMessage *reply)
+{
+    // The options are indexed in place; handlers read them from 'packet'
+    DHCPOptions opts;
+    DHCPMessage *dhcp_msg = (DHCPMessage *)packet;
+    if (dhcp_parse_options(packet, len, &opts) < 0 || dhcp_msg->op != 1)
+    {
+        log_warn("Malformed DHCP message from %s", inet_ntoa(client_addr->sin_addr));
+        count_outcome(METRIC_MALFORMED);
+        return 0;
+    }
+    metrics_count(&metrics->received[opts.message_type < METRIC_MESSAGE_TYPES ? opts.message_type : 0]);
 
-    options[25] = 3; // Router (Default Gateway)
-    options[26] = 4; // Length
-    memcpy(&options[27], &default_gateway, 4);
+    uint8_t client_key[16];
+    dhcp_client_key(dhcp_msg, &opts, client_key);
+
+    // A retransmission (same client, xid and type) gets the bytes sent the
+    // first time, without touching the lease store
+    uint64_t now = now_ns();
+    size_t reply_len = reply_cache_get(reply_cache, client_key, dhcp_msg->xid, opts.message_type, now, reply);
+    if (reply_len > 0)
+    {
+        count_outcome(METRIC_RETRANSMIT);
+        return reply_len;
+    }
 
-    options[31] = 255; // End option
+    struct in_addr giaddr = {dhcp_msg->giaddr};
+    Subnet *subnet = subnet_select(&subnets, giaddr, ifindex);
+    if (subnet == NULL)
+    {
+        log_warn("No subnet configured for relay %s", inet_ntoa(giaddr));
+        count_outcome(METRIC_NO_SUBNET);
+        return 0;
+    }
 
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = client_addr->sin_port;
-    dest_addr.sin_addr = client_addr->sin_addr;
+    // Lease state is locked per shard inside the lease store, so workers
+    // handle different clients in parallel.
+    switch (opts.message_type)
+    {
+    case DHCPDISCOVER:
+        reply_len = handle_dhcp_discover(dhcp_msg, &opts, client_key, subnet, client_addr, reply);
+        break;
+    case DHCPRELEASE:
+        handle_dhcp_release(dhcp_msg, client_key);
+        return 0;
+    case DHCPDECLINE:
+        handle_dhcp_decline(dhcp_msg, &opts, client_key);
+        return 0;
+    case DHCPINFORM:
+        reply_len = handle_dhcp_inform(dhcp_msg, &opts, subnet, reply);
+        break;
+    case DHCPREQUEST: // New request or renewal
+        if (dhcp_msg->ciaddr != 0)
+        {
+            reply_len = handle_dhcp_renew(dhcp_msg, &opts, client_key, subnet, reply);
+        }
+        else
+        {
+            reply_len = handle_dhcp_request(dhcp_msg, &opts, client_key, subnet, client_addr, reply);
+        }
+        break;
+    default:
+        log_info("Unknown DHCP message type");
+        return 0;
+    }
 
-    sendto(sockfd, &ack_msg, sizeof(ack_msg), 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    printf("Sent DHCP ACK to %s\n", inet_ntoa(dest_addr.sin_addr));
+    reply_cache_put(reply_cache, client_key, dhcp_msg->xid, opts.message_type, now, reply, reply_len);
+    return reply_len;
 }
 
-void handle_dhcp_release(DHCPMessage *msg)
+// One recvfrom() and one sendto() per packet
+static void serve_single(Worker *worker)
 {
-    struct in_addr released_ip;
-    released_ip.s_addr = msg->yiaddr;
-
-    printf("Releasing IP: %s\n", inet_ntoa(released_ip));
+    struct sockaddr_in client_addr;
+    uint8_t buffer[BUFFER_SIZE] __attribute__((aligned(8)));
+    uint8_t control[BATCH_IO_CONTROL_SIZE] __attribute__((aligned(8)));
+    DHCPMessage reply;
+    struct iovec iov = {buffer, BUFFER_SIZE};
+    struct msghdr msg = {&client_addr, 0, &iov, 1, control, 0, 0};
+    BatchIOStats stats = {0};
 
-    for (int i = 0; i < lease_count; i++)
+    while (1)
     {
-        if (ip_leases[i].ip.s_addr == released_ip.s_addr && memcmp(ip_leases[i].chaddr, msg->chaddr, 16) == 0)
+        // Receive DHCP message, with the receiving interface when enabled
+        msg.msg_namelen = sizeof(client_addr);
+        msg.msg_controllen = sizeof(control);
+        ssize_t recv_len = recvmsg(worker->sockfd, &msg, 0);
+        if (recv_len < 0)
         {
-            printf("Releasing IP: %s\n", inet_ntoa(released_ip));
-            // Shift remaining leases down
-            for (int j = i; j < lease_count - 1; j++)
-            {
-                ip_leases[j] = ip_leases[j + 1];
-            }
-            lease_count--;
-            pthread_mutex_unlock(&mutex);
-            return;
+            log_error("Error receiving data: %s", strerror(errno));
+            continue;
         }
+        stats.rx_calls++;
+        stats.rx_packets++;
+        batch_io_stats_publish(&worker->io_stats, &stats);
+        uint64_t received_ns = now_ns();
+
+        size_t reply_len = process_dhcp_message((uint8_t *)buffer, recv_len, &client_addr,
+                                                batch_io_msg_ifindex(&msg), &reply);
+        if (commit_journal() < 0 || reply_len == 0)
+            continue;
+
+        if (sendto(worker->sockfd, &reply, reply_len, 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0)
+        {
+            log_every(LOG_LEVEL_ERROR, 10, "Error sending reply: %s", strerror(errno));
+            stats.tx_errors++;
+            batch_io_stats_publish(&worker->io_stats, &stats);
+            continue;
+        }
+        stats.tx_calls++;
+        stats.tx_packets++;
+        batch_io_stats_publish(&worker->io_stats, &stats);
+        metrics_count(&metrics->replies);
+        histogram_record(&metrics->latency, now_ns() - received_ns);
     }
-    pthread_mutex_unlock(&mutex);
-    printf("IP not found for release: %s\n", inet_ntoa(released_ip));
 }
 
-void handle_dhcp_renew(int sockfd, DHCPMessage *msg, struct sockaddr_in *client_addr)
+// Drain up to batch_size datagrams per recvmmsg() and flush all replies
+// with one sendmmsg()
+static void serve_batched(Worker *worker)
 {
-    struct in_addr client_ip;
-    client_ip.s_addr = msg->ciaddr; // Cambiado de msg->yiaddr a msg->ciaddr
+    BatchIO io;
+    if (batch_io_init(&io, batch_size, flush_timeout_us, BUFFER_SIZE) < 0)
+    {
+        fprintf(stderr, "Error: cannot allocate batch buffers\n");
+        exit(1);
+    }
 
-    for (int i = 0; i < lease_count; i++)
+    while (1)
     {
-        if (ip_leases[i].ip.s_addr == client_ip.s_addr && memcmp(ip_leases[i].chaddr, msg->chaddr, 16) == 0)
+        int n = batch_io_recv(&io, worker->sockfd);
+        if (n < 0)
         {
-            // Renew the lease
-            ip_leases[i].lease_expiration = time(NULL) + LEASE_TIME;
-
-            // Send DHCPACK
-            DHCPMessage ack_msg;
-            memset(&ack_msg, 0, sizeof(ack_msg));
-            ack_msg.op = 2; // BOOTREPLY
-            ack_msg.htype = msg->htype;
-            ack_msg.hlen = msg->hlen;
-            ack_msg.xid = msg->xid;
-            memcpy(ack_msg.chaddr, msg->chaddr, 16);
-            ack_msg.yiaddr = client_ip.s_addr;
-
-            // Set DHCP options
-            uint8_t *options = ack_msg.options;
-            options[0] = 0x63; // Magic cookie
-            options[1] = 0x82;
-            options[2] = 0x53;
-            options[3] = 0x63;
-
-            options[4] = 53; // DHCP Message Type
-            options[5] = 1;  // Length
-            options[6] = 5;  // DHCPACK
-
-            options[7] = 51; // IP Address Lease Time
-            options[8] = 4;  // Length
-            uint32_t lease_time = htonl(LEASE_TIME);
-            memcpy(&options[9], &lease_time, 4);
-
-            options[13] = 1; // Subnet Mask
-            options[14] = 4; // Length
-            memcpy(&options[15], &subnet_mask, 4);
-
-            options[19] = 6; // DNS Server
-            options[20] = 4; // Length
-            struct in_addr dns_server;
-            inet_aton(DNS_SERVER, &dns_server);
-            memcpy(&options[21], &dns_server, 4);
-
-            options[25] = 3; // Router (Default Gateway)
-            options[26] = 4; // Length
-            memcpy(&options[27], &default_gateway, 4);
-
-            options[31] = 255; // End option
-
-            sendto(sockfd, &ack_msg, sizeof(ack_msg), 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
-            printf("Renewed lease for IP: %s\n", inet_ntoa(client_ip));
-            return;
+            log_error("Error receiving data: %s", strerror(errno));
+            continue;
+        }
+        uint64_t received_ns = now_ns();
+
+        for (int i = 0; i < n; i++)
+        {
+            struct sockaddr_in *client_addr = batch_io_rx_addr(&io, i);
+            DHCPMessage *reply = (DHCPMessage *)batch_io_tx_buffer(&io);
+
+            size_t reply_len = process_dhcp_message(batch_io_rx_data(&io, i), batch_io_rx_len(&io, i), client_addr,
+                                                    batch_io_rx_ifindex(&io, i), reply);
+            if (reply_len > 0)
+                batch_io_tx_add(&io, reply, reply_len, client_addr);
+        }
+        // One durability wait covers every lease change in the batch
+        if (commit_journal() < 0)
+            batch_io_tx_discard(&io);
+        int sent = batch_io_flush(&io, worker->sockfd);
+        batch_io_stats_publish(&worker->io_stats, &io.stats);
+
+        // Every reply in the batch waited for the whole batch
+        uint64_t latency = now_ns() - received_ns;
+        for (int i = 0; i < sent; i++)
+        {
+            metrics_count(&metrics->replies);
+            histogram_record(&metrics->latency, latency);
         }
     }
-    printf("Renewal failed for IP: %s\n", inet_ntoa(client_ip));
 }
 
-void print_active_leases()
+// Multishot receives into provided buffers and replies queued as sendmsg
+// entries: one io_uring_enter() per pass submits the replies of the last
+// pass and waits for more datagrams, none is made per packet. Returns
+// only if the kernel turns out not to support it.
+static int serve_uring(Worker *worker)
 {
-    pthread_mutex_lock(&mutex);
-    printf("\n--- Active IP Leases ---\n");
-    for (int i = 0; i < lease_count; i++)
+    UringIO io;
+    if (uring_io_init(&io, worker->sockfd, URING_BUFFERS, BUFFER_SIZE) < 0)
+        return -1;
+
+    while (1)
     {
-        char mac_str[18];
-        snprintf(mac_str, sizeof(mac_str), "%02x:%02x:%02x:%02x:%02x:%02x",
-                 ip_leases[i].chaddr[0], ip_leases[i].chaddr[1], ip_leases[i].chaddr[2],
-                 ip_leases[i].chaddr[3], ip_leases[i].chaddr[4], ip_leases[i].chaddr[5]);
+        if (uring_io_wait(&io) < 0)
+        {
+            log_error("Error waiting for io_uring completions: %s", strerror(errno));
+            continue;
+        }
+        uint64_t received_ns = now_ns();
 
-        time_t remaining = ip_leases[i].lease_expiration - time(NULL);
+        UringPacket packet;
+        int ret;
+        uint32_t replies = 0;
+        while ((ret = uring_io_next(&io, &packet)) > 0)
+        {
+            // With every send slot in flight the request is dropped and the
+            // client retransmits
+            DHCPMessage *reply = (DHCPMessage *)uring_io_tx_buffer(&io);
+            if (reply == NULL)
+                continue;
+            size_t reply_len = process_dhcp_message(packet.data, packet.len, &packet.addr, packet.ifindex, reply);
+            if (reply_len > 0)
+            {
+                uring_io_tx_add(&io, reply_len, &packet.addr);
+                replies++;
+            }
+        }
+        if (ret < 0)
+        {
+            uring_io_destroy(&io);
+            return -1;
+        }
 
-        printf("IP: %s, Expires in: %ld seconds\n",
-               inet_ntoa(ip_leases[i].ip), remaining);
+        // Replies are submitted by the next wait, after the journal commit
+        if (commit_journal() < 0)
+        {
+            uring_io_tx_discard(&io);
+            replies = 0;
+        }
+        batch_io_stats_publish(&worker->io_stats, &io.stats);
+        uint64_t latency = now_ns() - received_ns;
+        for (uint32_t i = 0; i < replies; i++)
+        {
+            metrics_count(&metrics->replies);
+            histogram_record(&metrics->latency, latency);
+        }
     }
-    printf("------------------------\n\n");
-    pthread_mutex_unlock(&mutex);
 }
 
-void *handle_client(void *arg)
+// Frames straight from an mmap'd TPACKET_V3 ring: the kernel hands over
+// whole blocks of requests without a copy or a syscall per packet, and
+// replies are built as Ethernet frames so a client without an address is
+// reached at its hardware address. One send() flushes the pass.
+static void serve_raw(Worker *worker)
 {
-    int sockfd = *(int *)arg;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
-    DHCPMessage *dhcp_msg;
-
+    PacketRing *ring = worker->packet_ring;
     while (1)
     {
-        // Receive DHCP message
-        print_active_leases();
-        ssize_t recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_addr, &client_len);
-        if (recv_len < 0)
+        if (packet_ring_wait(ring) < 0)
         {
-            perror("Error receiving data");
+            log_error("Error waiting for packets: %s", strerror(errno));
             continue;
         }
+        uint64_t received_ns = now_ns();
 
-        dhcp_msg = (DHCPMessage *)buffer;
+        RawPacket packet;
+        while (packet_ring_next(ring, &packet) > 0)
+        {
+            // With every transmit frame queued the request is dropped and
+            // the client retransmits
+            DHCPMessage *reply = (DHCPMessage *)packet_ring_tx_buffer(ring);
+            if (reply == NULL)
+                continue;
+            size_t reply_len = process_dhcp_message(packet.data, packet.len, &packet.addr, ring->ifindex, reply);
+            if (reply_len > 0)
+                packet_ring_tx_add(ring, reply_len, &packet);
+        }
 
-        // Process DHCP message
-        pthread_mutex_lock(&mutex);
-        switch (dhcp_msg->options[6])
+        if (commit_journal() < 0)
+            packet_ring_tx_discard(ring);
+        int sent = packet_ring_flush(ring);
+        if (sent < 0)
+            log_every(LOG_LEVEL_ERROR, 10, "Error sending replies: %s", strerror(errno));
+        batch_io_stats_publish(&worker->io_stats, &ring->stats);
+
+        uint64_t latency = now_ns() - received_ns;
+        for (int i = 0; i < sent; i++)
         {
-        case 1: // DHCP DISCOVER
-            handle_dhcp_discover(sockfd, dhcp_msg, &client_addr);
-            break;
-        case 7: // DHCP RELEASE
-            handle_dhcp_release(dhcp_msg);
-            break;
-        case 3: // DHCP REQUEST (could be new request or renewal)
-            if (dhcp_msg->ciaddr != 0)
-            {
-                handle_dhcp_renew(sockfd, dhcp_msg, &client_addr);
-            }
-            else
-            {
-                handle_dhcp_request(sockfd, dhcp_msg, &client_addr);
-            }
-            break;
-        default:
-            printf("Unknown DHCP message type\n");
-            break;
+            metrics_count(&metrics->replies);
+            histogram_record(&metrics->latency, latency);
         }
-        pthread_mutex_unlock(&mutex);
     }
+}
 
+void *handle_client(void *arg)
+{
+    Worker *worker = arg;
+    metrics = worker->metrics;
+    reply_cache = &worker->reply_cache;
+    if (worker->packet_ring != NULL)
+        serve_raw(worker);
+    if (uring_mode && serve_uring(worker) < 0)
+        log_warn("io_uring failed (%s), worker falls back to sockets", strerror(errno));
+    if (batch_size > 1)
+        serve_batched(worker);
+    else
+        serve_single(worker);
     return NULL;
 }
 
+static void report_io_stats(void)
+{
+    BatchIOStats total = {0};
+    for (int i = 0; i < worker_count; i++)
+    {
+        BatchIOStats stats;
+        batch_io_stats_load(&workers[i].io_stats, &stats);
+        total.rx_packets += stats.rx_packets;
+        total.rx_calls += stats.rx_calls;
+        total.tx_packets += stats.tx_packets;
+        total.tx_calls += stats.tx_calls;
+        total.tx_errors += stats.tx_errors;
+    }
+    if (total.rx_calls == 0)
+        return;
+    log_info("I/O: rx %llu packets in %llu calls (%.2f/call), tx %llu packets in %llu calls (%.2f/call), %llu send errors",
+           (unsigned long long)total.rx_packets, (unsigned long long)total.rx_calls,
+           (double)total.rx_packets / total.rx_calls,
+           (unsigned long long)total.tx_packets, (unsigned long long)total.tx_calls,
+           total.tx_calls ? (double)total.tx_packets / total.tx_calls : 0.0, (unsigned long long)total.tx_errors);
+}
+
+static void report_expired(const IPLease *lease, void *arg)
+{
+    log_info("Lease expired for IP: %s", inet_ntoa(lease->ip));
+}
+
 void *lease_manager(void *arg)
 {
+    time_t last_snapshot = time(NULL);
     while (1)
     {
-        pthread_mutex_lock(&mutex);
-        time_t current_time = time(NULL);
+        // Only due leases are touched, and each shard lock is dropped every
+        // EXPIRE_BATCH leases so a mass expiry cannot stall the handlers
+        lease_store_expire(&lease_store, time(NULL), EXPIRE_BATCH, report_expired, NULL);
+
+        if ((batch_size > 1 || uring_mode || raw_interface != NULL) && time(NULL) % IO_STATS_INTERVAL == 0)
+            report_io_stats();
 
-        for (int i = 0; i < lease_count; i++)
+        // Compact the journal into a new snapshot so restarts stay fast
+        uint64_t changes = lease_db_dir != NULL ? lease_db_since_snapshot(&lease_db) : 0;
+        if (changes >= SNAPSHOT_RECORDS || (changes > 0 && time(NULL) - last_snapshot >= SNAPSHOT_INTERVAL))
         {
-            if (current_time > ip_leases[i].lease_expiration)
-            {
-                printf("Lease expired for IP: %s\n", inet_ntoa(ip_leases[i].ip));
-
-                // Remove the expired lease
-                for (int j = i; j < lease_count - 1; j++)
-                {
-                    ip_leases[j] = ip_leases[j + 1];
-                }
-                lease_count--;
-                i--; // Adjust index after removal
-            }
+            if (lease_db_snapshot(&lease_db, &lease_store) < 0)
+                log_error("Error writing lease snapshot: %s", strerror(errno));
+            last_snapshot = time(NULL);
         }
 
-        pthread_mutex_unlock(&mutex);
         sleep(1); // Check every second
     }
     return NULL;
 }
 
-int main()
+// Parse a CPU list such as "0-3,6" into worker_cpus
+static int parse_cpu_list(const char *list)
+{
+    worker_cpu_count = 0;
+    while (*list)
+    {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (worker_cpu_count == MAX_WORKERS)
+                return -1;
+            worker_cpus[worker_cpu_count++] = (int)cpu;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        list = end;
+    }
+    return worker_cpu_count > 0 ? 0 : -1;
+}
+
+static int open_server_socket(int reuseport)
 {
-    int sockfd;
     struct sockaddr_in server_addr;
 
     // Create UDP socket
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0)
     {
         perror("Error creating socket");
         exit(1);
     }
 
+    // Every worker socket binds the same port; the kernel spreads
+    // incoming datagrams across them by flow hash
+    int enable = 1;
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+        perror("Error setting SO_REUSEPORT");
+        exit(1);
+    }
+
+    // Subnets bound to an interface need to know where each datagram arrived
+    if (subnets.ninterfaces > 0 && setsockopt(sockfd, IPPROTO_IP, IP_PKTINFO, &enable, sizeof(enable)) < 0)
+    {
+        perror("Error setting IP_PKTINFO");
+        exit(1);
+    }
+
     // Configure server address
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(DHCP_SERVER_PORT);
+    server_addr.sin_port = htons(server_port);
 
     // Bind socket to address
     if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
@@ -474,32 +928,293 @@ int main()
         close(sockfd);
         exit(1);
     }
+    return sockfd;
+}
 
+// Pool gauges per subnet
+static void write_subnet_usage(FILE *out)
+{
+    char net[INET_ADDRSTRLEN];
+    for (uint32_t i = 0; i < subnets.count; i++)
+    {
+        Subnet *subnet = &subnets.subnets[i];
+        uint64_t size = 0, free_count = 0;
+        for (uint32_t r = 0; r < subnet->nranges; r++)
+        {
+            IPPool *pool = &lease_store.pools[subnet->first_pool + r];
+            size += pool->size;
+            free_count += ip_pool_free_count(pool);
+        }
+        struct in_addr addr = {htonl(subnet->network)};
+        inet_ntop(AF_INET, &addr, net, sizeof(net));
+        fprintf(out, "dhcp_subnet_pool_size{subnet=\"%s/%d\"} %llu\n", net, subnet->prefix_len, (unsigned long long)size);
+        fprintf(out, "dhcp_subnet_pool_free{subnet=\"%s/%d\"} %llu\n", net, subnet->prefix_len, (unsigned long long)free_count);
+    }
+}
+
+// Admin socket: "leases" dumps the lease table; "metrics" or no
+// command returns the metrics
+static void handle_admin(FILE *out, const char *command, void *arg)
+{
+    if (strcmp(command, "leases") == 0)
+    {
+        print_active_leases(out);
+    }
+    else if (command[0] == '\0' || strcmp(command, "metrics") == 0)
+    {
+        metrics_write(out, worker_metrics, worker_count, &lease_store);
+        write_subnet_usage(out);
+        fprintf(out, "dhcp_reservations %u\n", reservations.count);
+        fprintf(out, "dhcp_log_dropped_total %llu\n", (unsigned long long)log_dropped());
+    }
+    else
+    {
+        fprintf(out, "Unknown command: %s\n", command);
+    }
+}
+
+// Restore the leases saved by a previous run and start journaling
+static void open_lease_db(void)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (lease_db_open(&lease_db, lease_db_dir) < 0)
+    {
+        perror("Error opening lease database");
+        exit(1);
+    }
+    long loaded = lease_db_load(&lease_db, &lease_store, time(NULL));
+    if (loaded < 0 || lease_db_snapshot(&lease_db, &lease_store) < 0 || lease_db_start(&lease_db) < 0)
+    {
+        perror("Error loading lease database");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Restored %ld leases from %s in %.1f ms\n", loaded, lease_db_dir,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-w workers] [-r] [-c cpu_list] [-b batch_size] [-T flush_timeout_us] [-u] [-R interface]\n"
+                    "       [-d lease_dir] [-f config_file] [-p port] [-n pool_size] [-O offer_ttl] [-D decline_ttl] [-k] [-H hosts_file]\n"
+                    "       [-m admin_socket] [-l error|warn|info|debug]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int sockfd = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:rc:b:T:uR:d:f:p:n:O:D:kH:m:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            worker_count = atoi(optarg);
+            if (worker_count < 1 || worker_count > MAX_WORKERS)
+                usage(argv[0]);
+            break;
+        case 'r':
+            reuseport_mode = 1;
+            break;
+        case 'c':
+            if (parse_cpu_list(optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size < 1 || batch_size > MAX_BATCH_SIZE)
+                usage(argv[0]);
+            break;
+        case 'T':
+            flush_timeout_us = atoi(optarg);
+            break;
+        case 'u':
+            uring_mode = 1;
+            break;
+        case 'R':
+            raw_interface = optarg;
+            break;
+        case 'd':
+            lease_db_dir = optarg;
+            break;
+        case 'f':
+            config_path = optarg;
+            break;
+        case 'p':
+            server_port = atoi(optarg);
+            if (server_port < 1 || server_port > 65535)
+                usage(argv[0]);
+            break;
+        case 'n':
+            pool_size = strtoul(optarg, NULL, 10);
+            if (pool_size < 1 || pool_size > (1u << 24))
+                usage(argv[0]);
+            break;
+        case 'O':
+            offer_ttl = strtoul(optarg, NULL, 10);
+            if (offer_ttl < 1)
+                usage(argv[0]);
+            break;
+        case 'D':
+            decline_ttl = strtoul(optarg, NULL, 10);
+            if (decline_ttl < 1)
+                usage(argv[0]);
+            break;
+        case 'k':
+            rapid_commit = 1;
+            break;
+        case 'H':
+            reservations_path = optarg;
+            break;
+        case 'm':
+            metrics_path = optarg;
+            break;
+        case 'l':
+            log_level = log_parse_level(optarg);
+            if (log_level < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // Handlers log through per-thread rings drained by a logger thread
+    if (log_init(stdout, log_level) < 0)
+    {
+        perror("Failed to create logger thread");
+        exit(1);
+    }
+
+    int online_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (online_cpus < 1)
+        online_cpus = 1;
+    if (worker_count == 0)
+        worker_count = online_cpus < MAX_WORKERS ? online_cpus : MAX_WORKERS;
+
+    // Per-core listeners are pinned one per CPU unless a list is given
+    if (reuseport_mode && worker_cpu_count == 0)
+    {
+        for (int i = 0; i < online_cpus && i < MAX_WORKERS; i++)
+            worker_cpus[worker_cpu_count++] = i;
+    }
+
+    // Chosen once at startup; without kernel support the socket path is used
+    if (raw_interface != NULL)
+        uring_mode = 0;
+    if (uring_mode && uring_io_probe() < 0)
+    {
+        printf("io_uring is not available (%s), using sockets\n", strerror(errno));
+        uring_mode = 0;
+    }
+
+    workers = calloc(worker_count, sizeof(Worker));
+    worker_metrics = aligned_alloc(64, worker_count * sizeof(WorkerMetrics));
+    if (workers == NULL || worker_metrics == NULL)
+    {
+        perror("Error allocating workers");
+        exit(1);
+    }
+
+    // Subnets first: the sockets depend on whether any is bound to an interface
     initialize_network();
 
+    // Open every socket before starting, so a bind failure stops the server
+    if (!reuseport_mode)
+        sockfd = open_server_socket(0);
+    for (int i = 0; i < worker_count; i++)
+    {
+        workers[i].id = i;
+        workers[i].sockfd = reuseport_mode ? open_server_socket(1) : sockfd;
+        workers[i].cpu = worker_cpu_count > 0 ? worker_cpus[i % worker_cpu_count] : -1;
+        workers[i].metrics = &worker_metrics[i];
+        metrics_init(&worker_metrics[i]);
+
+        // Shorter than the offer TTL, so a cached OFFER is still reserved
+        uint32_t ttl = REPLY_CACHE_TTL < offer_ttl ? REPLY_CACHE_TTL : offer_ttl;
+        if (reply_cache_init(&workers[i].reply_cache, REPLY_CACHE_SLOTS, ttl * 1000000000ULL) < 0)
+        {
+            perror("Error allocating reply cache");
+            exit(1);
+        }
+    }
+
+    // The sockets stay bound so the port is taken and no ICMP errors go
+    // out, but requests are read from the rings only. Each process gets
+    // its own fanout group.
+    if (raw_interface != NULL)
+    {
+        for (int i = 0; i < worker_count; i++)
+        {
+            if ((i == 0 || reuseport_mode) && packet_ring_mute_socket(workers[i].sockfd) < 0)
+            {
+                perror("Error muting the server socket");
+                exit(1);
+            }
+            workers[i].packet_ring = malloc(sizeof(PacketRing));
+            if (workers[i].packet_ring == NULL ||
+                packet_ring_open(workers[i].packet_ring, raw_interface, server_port, subnets.server_id, getpid()) < 0)
+            {
+                fprintf(stderr, "Error opening packet ring on %s: %s\n", raw_interface, strerror(errno));
+                exit(1);
+            }
+        }
+    }
+
+    if (lease_db_dir != NULL)
+        open_lease_db();
+    // An admin client closing early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (metrics_path != NULL && metrics_serve(metrics_path, handle_admin, NULL) < 0)
+    {
+        perror("Error opening metrics socket");
+        exit(1);
+    }
+
     printf("DHCP server is running...\n");
 
-    pthread_t lease_manager_tid, lease_display_tid;
+    pthread_t lease_manager_tid;
     if (pthread_create(&lease_manager_tid, NULL, lease_manager, NULL) != 0)
     {
         perror("Failed to create lease manager thread");
         exit(1);
     }
 
+    printf("Workers: %d (%s)\n", worker_count, reuseport_mode ? "one SO_REUSEPORT socket each" : "shared socket");
+    if (raw_interface != NULL)
+        printf("I/O: TPACKET_V3 rings on %s, %d x %d KB receive blocks per worker\n", raw_interface,
+               PACKET_RING_BLOCKS, PACKET_RING_BLOCK_SIZE / 1024);
+    else if (uring_mode)
+        printf("I/O: io_uring, %d receive buffers per worker\n", URING_BUFFERS);
+    else if (batch_size > 1)
+        printf("Batched I/O: %u datagrams per call, %u us flush timeout\n", batch_size, flush_timeout_us);
+
     // Create threads to handle clients
-    pthread_t tid;
-    for (int i = 0; i < 3; i++)
-    { // Create 5 threads to handle clients
-        if (pthread_create(&tid, NULL, handle_client, (void *)&sockfd) != 0)
+    for (int i = 0; i < worker_count; i++)
+    {
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (workers[i].cpu >= 0)
         {
-            perror("Failed to create thread");
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(workers[i].cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+
+        int err = pthread_create(&tid, &attr, handle_client, &workers[i]);
+        pthread_attr_destroy(&attr);
+        if (err != 0)
+        {
+            fprintf(stderr, "Failed to create worker %d: %s\n", i, strerror(err));
             exit(1);
         }
     }
 
     // Wait for threads to finish (which they never will in this case)
     pthread_exit(NULL);
-
-    close(sockfd);
-    return 0;
 }
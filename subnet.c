@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include "subnet.h"
+
+#define CONFIG_LINE_MAX 256
+
+static uint32_t prefix_mask(int prefix_len)
+{
+    return prefix_len == 0 ? 0 : 0xffffffff << (32 - prefix_len);
+}
+
+void subnet_config_init(SubnetConfig *config)
+{
+    memset(config, 0, sizeof(*config));
+}
+
+void subnet_config_destroy(SubnetConfig *config)
+{
+    for (uint32_t i = 0; i < config->count; i++)
+    {
+        free(config->subnets[i].ranges);
+        free(config->subnets[i].excluded);
+    }
+    free(config->subnets);
+    free(config->networks);
+    free(config->interfaces);
+    memset(config, 0, sizeof(*config));
+}
+
+Subnet *subnet_config_add(SubnetConfig *config, uint32_t network, int prefix_len)
+{
+    if (prefix_len < 0 || prefix_len > 32)
+        return NULL;
+    if (config->count == config->capacity)
+    {
+        uint32_t capacity = config->capacity ? config->capacity * 2 : 8;
+        Subnet *subnets = realloc(config->subnets, capacity * sizeof(Subnet));
+        if (subnets == NULL)
+            return NULL;
+        config->subnets = subnets;
+        config->capacity = capacity;
+    }
+
+    Subnet *subnet = &config->subnets[config->count];
+    memset(subnet, 0, sizeof(*subnet));
+    subnet->prefix_len = prefix_len;
+    subnet->mask = prefix_mask(prefix_len);
+    subnet->network = network & subnet->mask;
+    subnet->lease_time = SUBNET_DEFAULT_LEASE_TIME;
+    subnet->order = config->count++;
+    return subnet;
+}
+
+static int add_range(IPRange **ranges, uint32_t *count, uint32_t first, uint32_t last)
+{
+    if (last < first)
+        return -1;
+    // Grow in powers of two
+    if ((*count & (*count - 1)) == 0)
+    {
+        IPRange *grown = realloc(*ranges, (*count ? *count * 2 : 1) * sizeof(IPRange));
+        if (grown == NULL)
+            return -1;
+        *ranges = grown;
+    }
+    (*ranges)[*count].first = first;
+    (*ranges)[*count].last = last;
+    (*count)++;
+    return 0;
+}
+
+int subnet_add_range(Subnet *subnet, uint32_t first, uint32_t last)
+{
+    return add_range(&subnet->ranges, &subnet->nranges, first, last);
+}
+
+int subnet_add_exclusion(Subnet *subnet, uint32_t first, uint32_t last)
+{
+    return add_range(&subnet->excluded, &subnet->nexcluded, first, last);
+}
+
+static int parse_addr(const char *text, uint32_t *ip)
+{
+    struct in_addr addr;
+    if (text == NULL || inet_pton(AF_INET, text, &addr) != 1)
+        return -1;
+    *ip = ntohl(addr.s_addr);
+    return 0;
+}
+
+// "a.b.c.d/len"
+static int parse_cidr(char *text, uint32_t *network, int *prefix_len)
+{
+    char *slash = text != NULL ? strchr(text, '/') : NULL;
+    if (slash == NULL)
+        return -1;
+    *slash = '\0';
+    char *end;
+    long len = strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || len < 0 || len > 32)
+        return -1;
+    *prefix_len = (int)len;
+    return parse_addr(text, network);
+}
+
+// One "keyword arguments..." line. Returns an error message or NULL.
+static const char *parse_line(SubnetConfig *config, Subnet **current, char *line)
+{
+    char *save;
+    char *key = strtok_r(line, " \t\r\n", &save);
+    if (key == NULL)
+        return NULL;
+    char *arg1 = strtok_r(NULL, " \t\r\n", &save);
+    char *arg2 = strtok_r(NULL, " \t\r\n", &save);
+    uint32_t a, b;
+
+    if (strcmp(key, "server-id") == 0)
+    {
+        if (parse_addr(arg1, &a) < 0)
+            return "expected an address";
+        config->server_id.s_addr = htonl(a);
+        return NULL;
+    }
+    if (strcmp(key, "subnet") == 0)
+    {
+        int prefix_len;
+        if (parse_cidr(arg1, &a, &prefix_len) < 0)
+            return "expected network/prefix";
+        *current = subnet_config_add(config, a, prefix_len);
+        return *current == NULL ? "out of memory" : NULL;
+    }
+
+    // Everything else describes the subnet declared last
+    Subnet *subnet = *current;
+    if (subnet == NULL)
+        return "option outside a subnet";
+    if (strcmp(key, "range") == 0 || strcmp(key, "exclude") == 0)
+    {
+        if (parse_addr(arg1, &a) < 0)
+            return "expected an address";
+        b = a;
+        if (arg2 != NULL && parse_addr(arg2, &b) < 0)
+            return "expected an address";
+        if (b < a)
+            return "range ends before it starts";
+        int err = key[0] == 'r' ? subnet_add_range(subnet, a, b) : subnet_add_exclusion(subnet, a, b);
+        return err < 0 ? "out of memory" : NULL;
+    }
+    if (strcmp(key, "lease-time") == 0)
+    {
+        char *end;
+        long seconds = arg1 != NULL ? strtol(arg1, &end, 10) : 0;
+        if (arg1 == NULL || *end != '\0' || seconds < 1 || seconds > 0x7fffffff)
+            return "expected a number of seconds";
+        subnet->lease_time = (uint32_t)seconds;
+        return NULL;
+    }
+    if (strcmp(key, "router") == 0 || strcmp(key, "dns") == 0)
+    {
+        if (parse_addr(arg1, &a) < 0)
+            return "expected an address";
+        if (key[0] == 'r')
+            subnet->router.s_addr = htonl(a);
+        else
+            subnet->dns_server.s_addr = htonl(a);
+        return NULL;
+    }
+    if (strcmp(key, "rapid-commit") == 0)
+    {
+        subnet->rapid_commit = 1;
+        return NULL;
+    }
+    if (strcmp(key, "interface") == 0)
+    {
+        if (arg1 == NULL || strlen(arg1) >= IF_NAMESIZE)
+            return "expected an interface name";
+        strcpy(subnet->interface, arg1);
+        subnet->ifindex = if_nametoindex(arg1);
+        return subnet->ifindex == 0 ? "unknown interface" : NULL;
+    }
+    return "unknown keyword";
+}
+
+int subnet_config_load(SubnetConfig *config, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    char line[CONFIG_LINE_MAX];
+    Subnet *current = NULL;
+    int lineno = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineno++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        const char *error = parse_line(config, &current, line);
+        if (error != NULL)
+        {
+            fprintf(stderr, "%s:%d: %s\n", path, lineno, error);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    // Replies must carry it, and no address is a sensible default
+    if (config->server_id.s_addr == 0)
+    {
+        fprintf(stderr, "%s:%d: missing server-id\n", path, lineno);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    const IPRange *x = a, *y = b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+static int compare_subnets(const void *a, const void *b)
+{
+    const Subnet *x = a, *y = b;
+    return x->network < y->network ? -1 : x->network > y->network;
+}
+
+static int compare_interfaces(const void *a, const void *b)
+{
+    const SubnetInterface *x = a, *y = b;
+    return x->ifindex - y->ifindex;
+}
+
+// Replace the ranges with what is left after removing the exclusions
+static int cut_exclusions(Subnet *subnet)
+{
+    qsort(subnet->ranges, subnet->nranges, sizeof(IPRange), compare_ranges);
+    qsort(subnet->excluded, subnet->nexcluded, sizeof(IPRange), compare_ranges);
+
+    IPRange *out = NULL;
+    uint32_t count = 0;
+    uint32_t e = 0;
+    for (uint32_t i = 0; i < subnet->nranges; i++)
+    {
+        uint64_t next = subnet->ranges[i].first; // 64 bits: may step past 255.255.255.255
+        uint32_t last = subnet->ranges[i].last;
+        while (e < subnet->nexcluded && subnet->excluded[e].last < next)
+            e++;
+        for (uint32_t j = e; j < subnet->nexcluded && subnet->excluded[j].first <= last; j++)
+        {
+            if (subnet->excluded[j].first > next && add_range(&out, &count, next, subnet->excluded[j].first - 1) < 0)
+                goto fail;
+            if ((uint64_t)subnet->excluded[j].last + 1 > next)
+                next = (uint64_t)subnet->excluded[j].last + 1;
+        }
+        if (next <= last && add_range(&out, &count, next, last) < 0)
+            goto fail;
+    }
+
+    free(subnet->ranges);
+    free(subnet->excluded);
+    subnet->ranges = out;
+    subnet->nranges = count;
+    subnet->excluded = NULL;
+    subnet->nexcluded = 0;
+    return 0;
+
+fail:
+    free(out);
+    return -1;
+}
+
+static void print_addr(char *buf, uint32_t ip)
+{
+    struct in_addr addr = {htonl(ip)};
+    inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+int subnet_config_finish(SubnetConfig *config)
+{
+    char a[INET_ADDRSTRLEN], b[INET_ADDRSTRLEN];
+    if (config->count == 0)
+    {
+        fprintf(stderr, "Error: no subnet configured\n");
+        return -1;
+    }
+
+    qsort(config->subnets, config->count, sizeof(Subnet), compare_subnets);
+    uint32_t pool = 0;
+    for (uint32_t i = 0; i < config->count; i++)
+    {
+        Subnet *subnet = &config->subnets[i];
+        print_addr(a, subnet->network);
+        if (i > 0 && subnet->network <= (config->subnets[i - 1].network | ~config->subnets[i - 1].mask))
+        {
+            fprintf(stderr, "Error: subnet %s/%d overlaps another subnet\n", a, subnet->prefix_len);
+            return -1;
+        }
+        for (uint32_t r = 0; r < subnet->nranges; r++)
+        {
+            if (!subnet_contains(subnet, subnet->ranges[r].first) || !subnet_contains(subnet, subnet->ranges[r].last))
+            {
+                print_addr(b, subnet->ranges[r].first);
+                fprintf(stderr, "Error: range starting at %s is outside subnet %s/%d\n", b, a, subnet->prefix_len);
+                return -1;
+            }
+        }
+        if (cut_exclusions(subnet) < 0)
+            return -1;
+        for (uint32_t r = 1; r < subnet->nranges; r++)
+        {
+            if (subnet->ranges[r].first <= subnet->ranges[r - 1].last)
+            {
+                fprintf(stderr, "Error: overlapping ranges in subnet %s/%d\n", a, subnet->prefix_len);
+                return -1;
+            }
+        }
+        subnet->first_pool = pool;
+        pool += subnet->nranges;
+
+        ReplyParams params;
+        params.lease_time = subnet->lease_time;
+        params.server_id = config->server_id;
+        params.subnet_mask.s_addr = htonl(subnet->mask);
+        params.dns_server = subnet->dns_server;
+        params.router = subnet->router;
+        reply_template_init(&subnet->offer, DHCPOFFER, 0x8000, &params); // Broadcast flag
+        reply_template_init(&subnet->ack, DHCPACK, 0, &params);
+        reply_template_init(&subnet->nak, DHCPNAK, 0x8000, &params); // Relays broadcast it
+        reply_template_init(&subnet->rapid_ack, DHCPACK, 0, &params);
+        reply_template_add_option(&subnet->rapid_ack, DHO_RAPID_COMMIT, 0, NULL);
+        params.lease_time = 0;
+        reply_template_init(&subnet->inform, DHCPACK, 0, &params);
+
+        if (subnet->order == 0)
+            config->fallback = subnet;
+    }
+
+    free(config->networks);
+    free(config->interfaces);
+    config->networks = malloc(config->count * sizeof(uint32_t));
+    config->interfaces = calloc(config->count, sizeof(SubnetInterface));
+    config->ninterfaces = 0;
+    if (config->networks == NULL || config->interfaces == NULL)
+        return -1;
+    for (uint32_t i = 0; i < config->count; i++)
+        config->networks[i] = config->subnets[i].network;
+
+    for (uint32_t i = 0; i < config->count; i++)
+    {
+        if (config->subnets[i].ifindex == 0)
+            continue;
+        config->interfaces[config->ninterfaces].ifindex = config->subnets[i].ifindex;
+        config->interfaces[config->ninterfaces].subnet = &config->subnets[i];
+        config->ninterfaces++;
+    }
+    qsort(config->interfaces, config->ninterfaces, sizeof(SubnetInterface), compare_interfaces);
+    for (uint32_t i = 1; i < config->ninterfaces; i++)
+    {
+        if (config->interfaces[i].ifindex == config->interfaces[i - 1].ifindex)
+        {
+            fprintf(stderr, "Error: interface %s is bound to two subnets\n", config->interfaces[i].subnet->interface);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+IPRange *subnet_config_ranges(const SubnetConfig *config, uint32_t *count)
+{
+    *count = 0;
+    for (uint32_t i = 0; i < config->count; i++)
+        *count += config->subnets[i].nranges;
+
+    IPRange *ranges = malloc((*count ? *count : 1) * sizeof(IPRange));
+    if (ranges == NULL)
+        return NULL;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < config->count; i++)
+    {
+        memcpy(&ranges[n], config->subnets[i].ranges, config->subnets[i].nranges * sizeof(IPRange));
+        n += config->subnets[i].nranges;
+    }
+    return ranges;
+}
+
+Subnet *subnet_find(const SubnetConfig *config, uint32_t ip)
+{
+    // Last subnet starting at or before ip
+    uint32_t lo = 0, hi = config->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ip < config->networks[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (lo == 0 || !subnet_contains(&config->subnets[lo - 1], ip))
+        return NULL;
+    return &config->subnets[lo - 1];
+}
+
+Subnet *subnet_select(const SubnetConfig *config, struct in_addr giaddr, int ifindex)
+{
+    if (giaddr.s_addr != 0)
+        return subnet_find(config, ntohl(giaddr.s_addr));
+
+    uint32_t lo = 0, hi = config->ninterfaces;
+    while (ifindex != 0 && lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (config->interfaces[mid].ifindex == ifindex)
+            return config->interfaces[mid].subnet;
+        if (config->interfaces[mid].ifindex < ifindex)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return config->fallback;
+}
@@ -0,0 +1,97 @@
+#ifndef SUBNET_H
+#define SUBNET_H
+
+#include <stdint.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include "dhcp_reply.h"
+#include "lease_store.h"
+
+#define SUBNET_DEFAULT_LEASE_TIME 3600
+
+// One network the server hands out addresses in
+typedef struct
+{
+    uint32_t network; // Host byte order
+    uint32_t mask;
+    int prefix_len;
+    IPRange *ranges;  // Leasable addresses, exclusions cut out, sorted
+    uint32_t nranges;
+    IPRange *excluded; // As configured, until subnet_config_finish()
+    uint32_t nexcluded;
+    uint32_t first_pool; // Lease store pool of ranges[0]
+    uint32_t lease_time;
+    struct in_addr router;
+    struct in_addr dns_server;
+    char interface[IF_NAMESIZE];
+    int ifindex; // Interface whose direct (non-relayed) clients use this subnet, 0 = none
+    uint32_t order; // Position in the configuration
+    int rapid_commit; // DISCOVER with option 80 gets the lease and an ACK at once (RFC 4039)
+    ReplyTemplate offer;
+    ReplyTemplate ack;
+    ReplyTemplate nak;
+    ReplyTemplate rapid_ack; // ACK carrying option 80
+    ReplyTemplate inform;    // ACK to an INFORM: configuration, no lease
+} Subnet;
+
+typedef struct
+{
+    int ifindex;
+    Subnet *subnet;
+} SubnetInterface;
+
+// Every subnet, sorted by network address so the subnet holding an
+// address is a binary search away. The search runs over a separate
+// array of network addresses, which stays in a few cache lines where
+// the Subnet entries (with their templates) would not. Interfaces are
+// indexed the same way.
+typedef struct
+{
+    struct in_addr server_id;
+    Subnet *subnets;
+    uint32_t *networks; // subnets[i].network, for the search
+    uint32_t count;
+    uint32_t capacity;
+    SubnetInterface *interfaces;
+    uint32_t ninterfaces;
+    Subnet *fallback; // Direct clients on an unconfigured interface
+} SubnetConfig;
+
+void subnet_config_init(SubnetConfig *config);
+void subnet_config_destroy(SubnetConfig *config);
+
+// Read a configuration file. Errors are reported on stderr with the
+// line number; a file without server-id is rejected. The result still
+// needs subnet_config_finish().
+int subnet_config_load(SubnetConfig *config, const char *path);
+
+// Add a subnet, or return NULL. The pointer is valid until the next
+// call, or until subnet_config_finish().
+Subnet *subnet_config_add(SubnetConfig *config, uint32_t network, int prefix_len);
+int subnet_add_range(Subnet *subnet, uint32_t first, uint32_t last);
+int subnet_add_exclusion(Subnet *subnet, uint32_t first, uint32_t last);
+
+// Validate, sort, cut exclusions out of the ranges and encode the reply
+// templates. Returns -1 (with a message on stderr) if the subnets overlap
+// or a range lies outside its subnet.
+int subnet_config_finish(SubnetConfig *config);
+
+// Every leasable range, in lease store pool order. Free with free().
+IPRange *subnet_config_ranges(const SubnetConfig *config, uint32_t *count);
+
+// Subnet containing 'ip' (host byte order), or NULL
+Subnet *subnet_find(const SubnetConfig *config, uint32_t ip);
+
+// Subnet for a client: the relay's network when 'giaddr' is set,
+// otherwise the one bound to the receiving interface, otherwise the
+// first subnet in the configuration. NULL if the relay's network is
+// not configured.
+Subnet *subnet_select(const SubnetConfig *config, struct in_addr giaddr, int ifindex);
+
+static inline int subnet_contains(const Subnet *subnet, uint32_t ip)
+{
+    return (ip & subnet->mask) == subnet->network;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#include "timer_wheel.h"
+
+static void list_init(TimerEntry *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static int list_empty(const TimerEntry *head)
+{
+    return head->next == head;
+}
+
+static void list_add(TimerEntry *head, TimerEntry *entry)
+{
+    entry->next = head->next;
+    entry->prev = head;
+    head->next->prev = entry;
+    head->next = entry;
+}
+
+static void list_del(TimerEntry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+// Move every entry of 'from' to the front of 'to' in O(1)
+static void list_splice(TimerEntry *from, TimerEntry *to)
+{
+    if (list_empty(from))
+        return;
+    from->prev->next = to->next;
+    to->next->prev = from->prev;
+    to->next = from->next;
+    from->next->prev = to;
+    list_init(from);
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now)
+{
+    wheel->current = now;
+    wheel->count = 0;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++)
+    {
+        for (int s = 0; s < TIMER_WHEEL_SLOTS; s++)
+            list_init(&wheel->levels[l][s]);
+    }
+    list_init(&wheel->cascade);
+}
+
+void timer_entry_init(TimerEntry *entry)
+{
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->expires = 0;
+}
+
+int timer_entry_pending(const TimerEntry *entry)
+{
+    return entry->next != NULL;
+}
+
+static void place(TimerWheel *wheel, TimerEntry *entry)
+{
+    uint64_t expires = entry->expires;
+    if (expires < wheel->current)
+        expires = wheel->current; // Already due: fire on the next advance
+
+    uint64_t delta = expires - wheel->current;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (UINT64_C(1) << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+
+    // Beyond the top level's range: park in the furthest slot and let it
+    // cascade again when reached
+    if (delta >= (UINT64_C(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+        expires = wheel->current + (UINT64_C(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    int slot = (expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    list_add(&wheel->levels[level][slot], entry);
+}
+
+void timer_wheel_schedule(TimerWheel *wheel, TimerEntry *entry, uint64_t expires)
+{
+    if (timer_entry_pending(entry))
+        timer_wheel_cancel(wheel, entry);
+    entry->expires = expires;
+    place(wheel, entry);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, TimerEntry *entry)
+{
+    if (!timer_entry_pending(entry))
+        return;
+    list_del(entry);
+    wheel->count--;
+}
+
+// Called when 'current' has just crossed a level-0 revolution: detach the
+// higher-level slots that now fall inside the lower levels' range
+static void start_cascade(TimerWheel *wheel)
+{
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        int shift = TIMER_WHEEL_BITS * level;
+        int slot = (wheel->current >> shift) & (TIMER_WHEEL_SLOTS - 1);
+        list_splice(&wheel->levels[level][slot], &wheel->cascade);
+        if (slot != 0)
+            break;
+    }
+}
+
+int timer_wheel_advance(TimerWheel *wheel, uint64_t now, int budget, timer_expire_fn fn, void *arg)
+{
+    while (1)
+    {
+        if (!list_empty(&wheel->cascade))
+        {
+            if (budget-- <= 0)
+                return 1;
+            TimerEntry *entry = wheel->cascade.next;
+            list_del(entry);
+            place(wheel, entry);
+            continue;
+        }
+
+        if (wheel->current > now)
+            return 0;
+
+        TimerEntry *slot = &wheel->levels[0][wheel->current & (TIMER_WHEEL_SLOTS - 1)];
+        if (!list_empty(slot))
+        {
+            if (budget-- <= 0)
+                return 1;
+            TimerEntry *entry = slot->next;
+            list_del(entry);
+            wheel->count--;
+            fn(entry, arg);
+            continue;
+        }
+
+        wheel->current++;
+        if ((wheel->current & (TIMER_WHEEL_SLOTS - 1)) == 0)
+            start_cascade(wheel);
+    }
+}
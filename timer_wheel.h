@@ -0,0 +1,47 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+// Intrusive timer, embedded in the object it expires
+typedef struct TimerEntry
+{
+    struct TimerEntry *next;
+    struct TimerEntry *prev;
+    uint64_t expires; // Tick (seconds) at which the timer fires
+} TimerEntry;
+
+// Hierarchical timing wheel with one-second ticks: level 0 holds the
+// next 256 seconds, each higher level covers 256 times the range of the
+// one below. Timers due later than level 0 cascade down as time passes.
+typedef struct
+{
+    uint64_t current; // Next tick to be processed
+    TimerEntry levels[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    TimerEntry cascade; // Entries detached from a higher level, not yet re-placed
+    size_t count;
+} TimerWheel;
+
+typedef void (*timer_expire_fn)(TimerEntry *entry, void *arg);
+
+#define timer_container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now);
+void timer_entry_init(TimerEntry *entry);
+int timer_entry_pending(const TimerEntry *entry);
+
+void timer_wheel_schedule(TimerWheel *wheel, TimerEntry *entry, uint64_t expires);
+void timer_wheel_cancel(TimerWheel *wheel, TimerEntry *entry);
+
+// Fire every timer due at or before 'now', doing at most 'budget' units
+// of work (one per fired or cascaded timer). Returns 1 if work remains,
+// so callers can drop their lock between batches.
+int timer_wheel_advance(TimerWheel *wheel, uint64_t now, int budget, timer_expire_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "transaction_table.h"
+
+int transaction_table_init(TransactionTable *table, uint32_t slots, uint64_t ttl_ns)
+{
+    memset(table, 0, sizeof(*table));
+    uint32_t n = TRANSACTION_PROBE;
+    while (n < slots && n < (UINT32_C(1) << 30))
+        n <<= 1;
+    table->entries = calloc(n, sizeof(RelayTransaction));
+    if (table->entries == NULL)
+        return -1;
+    table->mask = n - 1;
+    table->ttl_ns = ttl_ns;
+    for (int i = 0; i < TRANSACTION_LOCKS; i++)
+        pthread_mutex_init(&table->locks[i], NULL);
+    return 0;
+}
+
+void transaction_table_destroy(TransactionTable *table)
+{
+    for (int i = 0; i < TRANSACTION_LOCKS; i++)
+        pthread_mutex_destroy(&table->locks[i]);
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+// First slot of the bucket for (xid, chaddr)
+static uint32_t bucket(const TransactionTable *table, uint32_t xid, const uint8_t chaddr[16])
+{
+    uint32_t h = xid * 0x9e3779b1u;
+    for (int i = 0; i < 6; i++) // The hardware address is almost always Ethernet
+        h = (h ^ chaddr[i]) * 16777619u;
+    h ^= h >> 16;
+    return h & table->mask & ~(uint32_t)(TRANSACTION_PROBE - 1);
+}
+
+static pthread_mutex_t *bucket_lock(TransactionTable *table, uint32_t first)
+{
+    return &table->locks[(first / TRANSACTION_PROBE) & (TRANSACTION_LOCKS - 1)];
+}
+
+static int matches(const RelayTransaction *entry, uint32_t xid, const uint8_t chaddr[16], uint64_t now_ns)
+{
+    return entry->expires_ns > now_ns && entry->xid == xid && memcmp(entry->chaddr, chaddr, 16) == 0;
+}
+
+void transaction_table_insert(TransactionTable *table, const RelayTransaction *txn, uint64_t now_ns)
+{
+    uint32_t first = bucket(table, txn->xid, txn->chaddr);
+    pthread_mutex_t *lock = bucket_lock(table, first);
+    pthread_mutex_lock(lock);
+
+    RelayTransaction *slot = NULL;
+    for (uint32_t i = 0; i < TRANSACTION_PROBE; i++)
+    {
+        RelayTransaction *entry = &table->entries[first + i];
+        if (matches(entry, txn->xid, txn->chaddr, now_ns))
+        {
+            slot = entry;
+            break;
+        }
+        if (slot == NULL || entry->expires_ns < slot->expires_ns)
+            slot = entry;
+    }
+    if (slot->expires_ns > now_ns && !matches(slot, txn->xid, txn->chaddr, now_ns))
+        __atomic_add_fetch(&table->evicted, 1, __ATOMIC_RELAXED);
+
+    *slot = *txn;
+    slot->expires_ns = now_ns + table->ttl_ns;
+    pthread_mutex_unlock(lock);
+}
+
+int transaction_table_take(TransactionTable *table, uint32_t xid, const uint8_t chaddr[16], uint64_t now_ns,
+                           RelayTransaction *txn)
+{
+    uint32_t first = bucket(table, xid, chaddr);
+    pthread_mutex_t *lock = bucket_lock(table, first);
+    int found = 0;
+    pthread_mutex_lock(lock);
+    for (uint32_t i = 0; i < TRANSACTION_PROBE; i++)
+    {
+        RelayTransaction *entry = &table->entries[first + i];
+        if (matches(entry, xid, chaddr, now_ns))
+        {
+            *txn = *entry;
+            entry->expires_ns = 0;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return found;
+}
@@ -0,0 +1,51 @@
+#ifndef TRANSACTION_TABLE_H
+#define TRANSACTION_TABLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define TRANSACTION_PROBE 8  // Slots per bucket, all searched on a lookup
+#define TRANSACTION_LOCKS 64 // Buckets are spread over this many mutexes
+
+// A request the relay passed on, kept until it is answered or its reply
+// is no longer expected
+typedef struct
+{
+    uint32_t xid;
+    uint8_t chaddr[16];
+    uint64_t expires_ns;       // 0 = empty slot
+    struct sockaddr_in source; // Where the request came from
+    int ifindex;               // Interface it arrived on
+    int upstream;              // Index of the server it went to, -1 if to all
+    uint64_t sent_ns;
+} RelayTransaction;
+
+// Open addressing over a fixed array of 8-slot buckets, so every lookup
+// is O(1) and memory does not grow under a flood: when a bucket is full
+// the entry closest to expiry is replaced. Expired entries are reused in
+// place; nothing sweeps the table. Shared by all relay workers, since a
+// reply may arrive on another worker's socket than its request.
+typedef struct
+{
+    RelayTransaction *entries;
+    uint32_t mask;
+    uint64_t ttl_ns;
+    uint64_t evicted; // Live entries replaced before they expired
+    pthread_mutex_t locks[TRANSACTION_LOCKS];
+} TransactionTable;
+
+// 'slots' is rounded up to a power of two
+int transaction_table_init(TransactionTable *table, uint32_t slots, uint64_t ttl_ns);
+void transaction_table_destroy(TransactionTable *table);
+
+// Record 'txn' under its (xid, chaddr), replacing the entry of an earlier
+// transmission of the same request, and set its expiry
+void transaction_table_insert(TransactionTable *table, const RelayTransaction *txn, uint64_t now_ns);
+
+// Move the live entry for (xid, chaddr) into 'txn' and return 1, or
+// return 0. The slot is free again for the next request.
+int transaction_table_take(TransactionTable *table, uint32_t xid, const uint8_t chaddr[16], uint64_t now_ns,
+                           RelayTransaction *txn);
+
+#endif
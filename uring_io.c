@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "uring_io.h"
+#include "log.h"
+
+#define RECV_TAG UINT64_MAX // user_data of the multishot receive; sends carry their slot
+#define DISCARD_TAG (UINT64_C(1) << 32) // Added to the slot of a send turned into a no-op
+#define BUFFER_GROUP 0
+
+// Room in each receive buffer ahead of the payload
+#define RX_HEADER (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + BATCH_IO_CONTROL_SIZE)
+
+static int ring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// The kernel reads the SQ tail and buffer ring tail, and writes the CQ
+// tail, concurrently with us
+static inline unsigned int load_acquire(const unsigned int *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(unsigned int *p, unsigned int v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static int map_rings(UringIO *io, const struct io_uring_params *p)
+{
+    io->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    io->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    int single = p->features & IORING_FEAT_SINGLE_MMAP;
+    if (single && io->cq_ring_size > io->sq_ring_size)
+        io->sq_ring_size = io->cq_ring_size;
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                       IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED)
+    {
+        io->sq_ring = NULL;
+        return -1;
+    }
+    if (single)
+    {
+        io->cq_ring = io->sq_ring;
+    }
+    else
+    {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                           IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED)
+        {
+            io->cq_ring = NULL;
+            return -1;
+        }
+    }
+    io->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                    IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED)
+    {
+        io->sqes = NULL;
+        return -1;
+    }
+
+    uint8_t *sq = io->sq_ring;
+    io->sq_head = (unsigned int *)(sq + p->sq_off.head);
+    io->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+    io->sq_mask = *(unsigned int *)(sq + p->sq_off.ring_mask);
+    io->sq_array = (unsigned int *)(sq + p->sq_off.array);
+
+    uint8_t *cq = io->cq_ring;
+    io->cq_head = (unsigned int *)(cq + p->cq_off.head);
+    io->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+    io->cq_mask = *(unsigned int *)(cq + p->cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+// Free submission entry, submitting what is queued first if the ring is full
+static struct io_uring_sqe *get_sqe(UringIO *io)
+{
+    unsigned int tail = *io->sq_tail;
+    if (tail - load_acquire(io->sq_head) > io->sq_mask)
+    {
+        ring_enter(io->ring_fd, io->to_submit, 0, 0);
+        io->to_submit = 0;
+        tail = *io->sq_tail;
+        if (tail - load_acquire(io->sq_head) > io->sq_mask)
+            return NULL;
+    }
+    unsigned int index = tail & io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    io->sq_array[index] = index;
+    return sqe;
+}
+
+static void push_sqe(UringIO *io)
+{
+    store_release(io->sq_tail, *io->sq_tail + 1);
+    io->to_submit++;
+}
+
+static void recycle_buffer(UringIO *io, unsigned int id)
+{
+    size_t stride = RX_HEADER + io->buffer_size;
+    unsigned short tail = io->buf_ring->tail;
+    struct io_uring_buf *buf = &io->buf_ring->bufs[tail & (io->rx_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(io->rx_buf + id * stride);
+    buf->len = (uint32_t)stride;
+    buf->bid = (uint16_t)id;
+    __atomic_store_n(&io->buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static int arm_receive(UringIO *io)
+{
+    struct io_uring_sqe *sqe = get_sqe(io);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = io->sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&io->rx_template;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = RECV_TAG;
+    push_sqe(io);
+    io->rx_armed = 1;
+    return 0;
+}
+
+int uring_io_init(UringIO *io, int sockfd, unsigned int buffers, size_t buffer_size)
+{
+    memset(io, 0, sizeof(*io));
+    io->ring_fd = -1;
+    io->sockfd = sockfd;
+    io->rx_held = -1;
+
+    // Buffer ring entries must be a power of two
+    unsigned int n = 1;
+    while (n < buffers && n < 32768)
+        n <<= 1;
+    io->rx_count = n;
+    io->buffer_size = buffer_size;
+    io->tx_count = 2 * n;
+
+    // Completions are only posted while we wait in io_uring_enter(), so a
+    // pass over the completion queue sees at most one datagram per buffer
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = 4 * n;
+    io->ring_fd = ring_setup(2 * n, &params);
+    if (io->ring_fd < 0 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = 4 * n;
+        io->ring_fd = ring_setup(2 * n, &params);
+    }
+    if (io->ring_fd < 0 || map_rings(io, &params) < 0)
+        goto fail;
+
+    // Receive buffers: recvmsg header, source address, control, payload
+    io->buf_ring_size = n * sizeof(struct io_uring_buf);
+    io->buf_ring = mmap(NULL, io->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    io->rx_buf = malloc(n * (RX_HEADER + buffer_size));
+    if (io->buf_ring == MAP_FAILED)
+        io->buf_ring = NULL;
+    if (io->buf_ring == NULL || io->rx_buf == NULL)
+        goto fail;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)io->buf_ring;
+    reg.ring_entries = n;
+    reg.bgid = BUFFER_GROUP;
+    if (ring_register(io->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (unsigned int i = 0; i < n; i++)
+        recycle_buffer(io, i);
+    io->rx_template.msg_namelen = sizeof(struct sockaddr_in);
+    io->rx_template.msg_controllen = BATCH_IO_CONTROL_SIZE;
+
+    io->tx_buf = malloc(io->tx_count * buffer_size);
+    io->tx_msgs = calloc(io->tx_count, sizeof(struct msghdr));
+    io->tx_iov = calloc(io->tx_count, sizeof(struct iovec));
+    io->tx_addr = calloc(io->tx_count, sizeof(struct sockaddr_in));
+    io->tx_free = malloc(io->tx_count * sizeof(unsigned int));
+    if (!io->tx_buf || !io->tx_msgs || !io->tx_iov || !io->tx_addr || !io->tx_free)
+        goto fail;
+    for (unsigned int i = 0; i < io->tx_count; i++)
+    {
+        io->tx_iov[i].iov_base = io->tx_buf + i * buffer_size;
+        io->tx_msgs[i].msg_iov = &io->tx_iov[i];
+        io->tx_msgs[i].msg_iovlen = 1;
+        io->tx_msgs[i].msg_name = &io->tx_addr[i];
+        io->tx_msgs[i].msg_namelen = sizeof(struct sockaddr_in);
+        io->tx_free[i] = io->tx_count - 1 - i;
+    }
+    io->tx_free_count = io->tx_count;
+
+    // An old kernel rejects the multishot receive straight away
+    if (arm_receive(io) < 0 || ring_enter(io->ring_fd, io->to_submit, 0, IORING_ENTER_GETEVENTS) < 0)
+        goto fail;
+    io->to_submit = 0;
+    unsigned int head = *io->cq_head;
+    if (head != load_acquire(io->cq_tail))
+    {
+        struct io_uring_cqe *cqe = &io->cqes[head & io->cq_mask];
+        if (cqe->user_data == RECV_TAG && cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE))
+        {
+            errno = -cqe->res;
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:;
+    int saved = errno;
+    uring_io_destroy(io);
+    errno = saved;
+    return -1;
+}
+
+void uring_io_destroy(UringIO *io)
+{
+    if (io->ring_fd >= 0)
+        close(io->ring_fd);
+    if (io->sqes != NULL)
+        munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != NULL && io->cq_ring != io->sq_ring)
+        munmap(io->cq_ring, io->cq_ring_size);
+    if (io->sq_ring != NULL)
+        munmap(io->sq_ring, io->sq_ring_size);
+    if (io->buf_ring != NULL)
+        munmap(io->buf_ring, io->buf_ring_size);
+    free(io->rx_buf);
+    free(io->tx_buf);
+    free(io->tx_msgs);
+    free(io->tx_iov);
+    free(io->tx_addr);
+    free(io->tx_free);
+    memset(io, 0, sizeof(*io));
+    io->ring_fd = -1;
+}
+
+int uring_io_probe(void)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    UringIO io;
+    int ret = -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && uring_io_init(&io, fd, 8, 64) == 0)
+    {
+        uring_io_destroy(&io);
+        ret = 0;
+    }
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return ret;
+}
+
+int uring_io_wait(UringIO *io)
+{
+    unsigned int submitted = io->to_submit;
+    int ret = ring_enter(io->ring_fd, io->to_submit, 1, IORING_ENTER_GETEVENTS);
+    if (ret < 0 && errno != EINTR)
+        return -1;
+    if (ret > 0)
+        io->to_submit -= (unsigned int)ret < io->to_submit ? (unsigned int)ret : io->to_submit;
+    io->stats.rx_calls++;
+    if (submitted > 0)
+        io->stats.tx_calls++;
+    return 0;
+}
+
+int uring_io_next(UringIO *io, UringPacket *packet)
+{
+    if (io->rx_held >= 0)
+    {
+        recycle_buffer(io, (unsigned int)io->rx_held);
+        io->rx_held = -1;
+    }
+
+    unsigned int head = *io->cq_head;
+    while (head != load_acquire(io->cq_tail))
+    {
+        struct io_uring_cqe cqe = io->cqes[head & io->cq_mask];
+        store_release(io->cq_head, ++head);
+
+        if (cqe.user_data != RECV_TAG)
+        {
+            // A reply went out, failed or was discarded; its slot is free again
+            if (cqe.res < 0 && !(cqe.user_data & DISCARD_TAG))
+            {
+                io->stats.tx_errors++;
+                log_every(LOG_LEVEL_ERROR, 10, "Error sending reply: %s", strerror(-cqe.res));
+            }
+            else if (!(cqe.user_data & DISCARD_TAG))
+                io->stats.tx_packets++;
+            io->tx_free[io->tx_free_count++] = (unsigned int)(cqe.user_data & ~DISCARD_TAG);
+            continue;
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            // The receive stopped, usually because every buffer was in use
+            io->rx_armed = 0;
+            if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP)
+                return -1;
+            arm_receive(io);
+        }
+        if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+            continue;
+
+        unsigned int id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t *buf = io->rx_buf + id * (RX_HEADER + io->buffer_size);
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+        uint8_t *name = buf + sizeof(*out);
+        uint8_t *control = name + io->rx_template.msg_namelen;
+        uint8_t *payload = control + io->rx_template.msg_controllen;
+        if (out->flags & MSG_TRUNC)
+        {
+            recycle_buffer(io, id);
+            continue;
+        }
+
+        memcpy(&packet->addr, name, sizeof(packet->addr));
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_control = control;
+        hdr.msg_controllen = out->controllen;
+        packet->ifindex = batch_io_msg_ifindex(&hdr);
+        packet->data = payload;
+        packet->len = out->payloadlen;
+        io->rx_held = (int)id;
+        io->stats.rx_packets++;
+        return 1;
+    }
+    return 0;
+}
+
+uint8_t *uring_io_tx_buffer(UringIO *io)
+{
+    if (io->tx_free_count == 0)
+        return NULL;
+    return io->tx_iov[io->tx_free[io->tx_free_count - 1]].iov_base;
+}
+
+void uring_io_tx_discard(UringIO *io)
+{
+    // Entries the kernel has not consumed yet can still be rewritten
+    for (unsigned int i = 1; i <= io->to_submit; i++)
+    {
+        unsigned int index = io->sq_array[(*io->sq_tail - i) & io->sq_mask];
+        struct io_uring_sqe *sqe = &io->sqes[index];
+        if (sqe->opcode != IORING_OP_SENDMSG)
+            continue;
+        uint64_t slot = sqe->user_data;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = slot | DISCARD_TAG;
+    }
+}
+
+void uring_io_tx_add(UringIO *io, size_t len, const struct sockaddr_in *dest)
+{
+    struct io_uring_sqe *sqe = get_sqe(io);
+    if (sqe == NULL)
+        return;
+    unsigned int slot = io->tx_free[--io->tx_free_count];
+    io->tx_iov[slot].iov_len = len;
+    io->tx_addr[slot] = *dest;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = io->sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&io->tx_msgs[slot];
+    sqe->len = 1;
+    sqe->user_data = slot;
+    push_sqe(io);
+}
@@ -0,0 +1,99 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "batch_io.h"
+
+// A datagram taken from the completion queue. 'data' points into a
+// provided buffer that goes back to the kernel on the next uring_io_next().
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    struct sockaddr_in addr;
+    int ifindex; // 0 if the socket does not have IP_PKTINFO enabled
+} UringPacket;
+
+// One io_uring per worker thread, set up with raw syscalls. A multishot
+// recvmsg stays posted on the socket and fills buffers from a registered
+// provided-buffer ring; replies are queued as sendmsg entries and go out
+// with the next io_uring_enter(), which also waits for more datagrams.
+// Nothing in here is shared.
+typedef struct
+{
+    int ring_fd;
+    int sockfd;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int to_submit;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring; // Same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // Receive side: buffers the kernel picks from, recycled by id
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *rx_buf;
+    unsigned int rx_count;
+    size_t buffer_size;
+    struct msghdr rx_template; // Name and control sizes for the multishot recvmsg
+    int rx_armed;
+    int rx_held; // Buffer id handed out by uring_io_next(), or -1
+
+    // Send side: one slot per reply in flight
+    uint8_t *tx_buf;
+    struct msghdr *tx_msgs;
+    struct iovec *tx_iov;
+    struct sockaddr_in *tx_addr;
+    unsigned int *tx_free;
+    unsigned int tx_free_count;
+    unsigned int tx_count;
+
+    BatchIOStats stats; // rx_calls and tx_calls both count io_uring_enter()
+} UringIO;
+
+// 'buffers' receive buffers of 'buffer_size' bytes (payload) and twice as
+// many send slots. Returns -1 with errno set if the kernel lacks io_uring,
+// provided buffer rings or multishot recvmsg.
+int uring_io_init(UringIO *io, int sockfd, unsigned int buffers, size_t buffer_size);
+void uring_io_destroy(UringIO *io);
+
+// Set up and tear down a ring on a throwaway socket: 0 if this kernel
+// supports everything uring_io_init() needs
+int uring_io_probe(void);
+
+// Submit the queued replies and wait for at least one completion
+int uring_io_wait(UringIO *io);
+
+// Next datagram waiting in the completion queue: 1 if there is one, 0
+// when drained, -1 if multishot receive turned out to be unsupported.
+// Send completions are reaped on the way.
+int uring_io_next(UringIO *io, UringPacket *packet);
+
+// Buffer for the next reply, or NULL if every send slot is in flight
+uint8_t *uring_io_tx_buffer(UringIO *io);
+
+// Queue the buffer from uring_io_tx_buffer() for 'dest'
+void uring_io_tx_add(UringIO *io, size_t len, const struct sockaddr_in *dest);
+
+// Turn every reply queued since the last wait into a no-op, so it never
+// goes out; its slot is freed when the no-op completes
+void uring_io_tx_discard(UringIO *io);
+
+#endif